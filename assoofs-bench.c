@@ -0,0 +1,301 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "assoofs.h"
+
+/**************************************************************
+* assoofs-bench: microbenchmarks de metadatos sobre un assoofs
+* ya montado (con el modulo o con assoofs-fuse)
+*
+*   assoofs-bench [-n ficheros] [-r rondas] [-o salida.json] <punto de montaje>
+*
+* Cada ronda crea sus ficheros en <punto de montaje>/bench y los
+* borra al acabar, para no pasar del limite de objetos. Por cada
+* carga se guardan todas las latencias y se informa de ops/s y
+* de los percentiles p50/p99/p999 en JSON.
+***************************************************************/
+
+#define BENCH_DIR "bench"
+#define BENCH_IO_SIZE 64
+#define BENCH_TREE_FANOUT 2
+#define BENCH_TREE_DEPTH 2
+
+enum workload {
+    W_CREATE,
+    W_LOOKUP_HIT,
+    W_LOOKUP_MISS,
+    W_READDIR,
+    W_WRITE,
+    W_READ,
+    W_RENAME,
+    W_UNLINK,
+    W_MKDIR_TREE,
+    W_COUNT,
+};
+
+static const char *workload_names[W_COUNT] = {
+    "create", "lookup_hit", "lookup_miss", "readdir", "write_small",
+    "read_small", "rename", "unlink", "mkdir_tree",
+};
+
+struct samples {
+    double *ns;
+    size_t count;
+    size_t size;
+    size_t errors;
+    double total_ns;
+};
+
+static struct samples results[W_COUNT];
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void record(enum workload w, double start, int failed) {
+    struct samples *s = &results[w];
+    double elapsed = now_ns() - start;
+
+    if (failed) {
+        s->errors++;
+        return;
+    }
+
+    if (s->count == s->size) {
+        s->size = s->size ? s->size * 2 : 256;
+        s->ns = realloc(s->ns, s->size * sizeof(*s->ns));
+    }
+    s->ns[s->count++] = elapsed;
+    s->total_ns += elapsed;
+}
+
+//Mide una llamada: guarda la latencia y si ha fallado
+#define TIMED(w, call) do {                 \
+        double __start = now_ns();          \
+        int __failed = (call) < 0;          \
+        record(w, __start, __failed);       \
+    } while (0)
+
+/**************************************************************
+* Cargas de trabajo. Cada una recorre los n ficheros de la ronda
+***************************************************************/
+
+//Una ruta truncada se queda vacia y la operacion falla como error
+static void file_name(char *buf, size_t len, const char *dir, const char *prefix, int i) {
+    if (snprintf(buf, len, "%s/%s%d", dir, prefix, i) >= (int)len)
+        buf[0] = '\0';
+}
+
+static int create_file(const char *path) {
+    int fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+
+    if (fd < 0)
+        return -1;
+    return close(fd);
+}
+
+static int stat_path(const char *path) {
+    struct stat st;
+
+    return stat(path, &st);
+}
+
+static int list_dir(const char *path) {
+    DIR *dir = opendir(path);
+    struct dirent *de;
+    int n = 0;
+
+    if (!dir)
+        return -1;
+    while ((de = readdir(dir)))
+        n++;
+    closedir(dir);
+    return n;
+}
+
+//Arbol de directorios BENCH_TREE_FANOUT x BENCH_TREE_DEPTH
+static void make_tree(const char *base, int depth) {
+    char path[PATH_MAX];
+    int i;
+
+    for (i = 0; i < BENCH_TREE_FANOUT; i++) {
+        file_name(path, sizeof(path), base, "t", i);
+        TIMED(W_MKDIR_TREE, mkdir(path, 0755));
+        if (depth > 1)
+            make_tree(path, depth - 1);
+    }
+}
+
+static void remove_tree(const char *base, int depth) {
+    char path[PATH_MAX];
+    int i;
+
+    for (i = 0; i < BENCH_TREE_FANOUT; i++) {
+        file_name(path, sizeof(path), base, "t", i);
+        if (depth > 1)
+            remove_tree(path, depth - 1);
+        rmdir(path);
+    }
+}
+
+static int run_round(const char *dir, int n) {
+    char path[PATH_MAX], other[PATH_MAX], buf[BENCH_IO_SIZE];
+    int i, fd;
+
+    memset(buf, 'a', sizeof(buf));
+
+    for (i = 0; i < n; i++) {
+        file_name(path, sizeof(path), dir, "f", i);
+        TIMED(W_CREATE, create_file(path));
+    }
+
+    for (i = 0; i < n; i++) {
+        file_name(path, sizeof(path), dir, "f", i);
+        TIMED(W_LOOKUP_HIT, stat_path(path));
+        file_name(path, sizeof(path), dir, "missing", i);
+        TIMED(W_LOOKUP_MISS, stat_path(path) == 0 ? -1 : 0);
+    }
+
+    for (i = 0; i < n; i++)
+        TIMED(W_READDIR, list_dir(dir));
+
+    for (i = 0; i < n; i++) {
+        file_name(path, sizeof(path), dir, "f", i);
+        fd = open(path, O_RDWR);
+        if (fd < 0) {
+            results[W_WRITE].errors++;
+            results[W_READ].errors++;
+            continue;
+        }
+        TIMED(W_WRITE, pwrite(fd, buf, sizeof(buf), 0) == sizeof(buf) ? 0 : -1);
+        TIMED(W_READ, pread(fd, buf, sizeof(buf), 0) == sizeof(buf) ? 0 : -1);
+        close(fd);
+    }
+
+    for (i = 0; i < n; i++) {
+        file_name(path, sizeof(path), dir, "f", i);
+        file_name(other, sizeof(other), dir, "r", i);
+        TIMED(W_RENAME, rename(path, other));
+    }
+
+    for (i = 0; i < n; i++) {
+        file_name(path, sizeof(path), dir, "r", i);
+        TIMED(W_UNLINK, unlink(path));
+    }
+
+    make_tree(dir, BENCH_TREE_DEPTH);
+    remove_tree(dir, BENCH_TREE_DEPTH);
+    return 0;
+}
+
+/**************************************************************
+* Informe en JSON
+***************************************************************/
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile(const struct samples *s, double p) {
+    size_t i;
+
+    if (!s->count)
+        return 0;
+    i = (size_t)(p * (s->count - 1) + 0.5);
+    return s->ns[i];
+}
+
+static void report(FILE *out, const char *mountpoint, int n, int rounds) {
+    int w;
+
+    fprintf(out, "{\n  \"filesystem\": \"assoofs\",\n  \"mountpoint\": \"%s\",\n", mountpoint);
+    fprintf(out, "  \"files_per_round\": %d,\n  \"rounds\": %d,\n  \"workloads\": {\n", n, rounds);
+
+    for (w = 0; w < W_COUNT; w++) {
+        struct samples *s = &results[w];
+
+        qsort(s->ns, s->count, sizeof(*s->ns), compare_double);
+        fprintf(out, "    \"%s\": {\"ops\": %zu, \"errors\": %zu, \"ops_per_sec\": %.1f, "
+                "\"p50_ns\": %.0f, \"p99_ns\": %.0f, \"p999_ns\": %.0f, \"max_ns\": %.0f}%s\n",
+                workload_names[w], s->count, s->errors,
+                s->total_ns ? s->count / (s->total_ns / 1e9) : 0.0,
+                percentile(s, 0.50), percentile(s, 0.99), percentile(s, 0.999),
+                s->count ? s->ns[s->count - 1] : 0.0,
+                w == W_COUNT - 1 ? "" : ",");
+    }
+
+    fprintf(out, "  }\n}\n");
+}
+
+int main(int argc, char *argv[]) {
+    char dir[PATH_MAX];
+    const char *output = NULL;
+    FILE *out = stdout;
+    int n = 8, rounds = 16, opt, i;
+
+    while ((opt = getopt(argc, argv, "n:r:o:")) != -1) {
+        switch (opt) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (optind != argc - 1 || n < 1 || rounds < 1)
+        goto usage;
+
+    //El directorio de trabajo tiene que caber en un bloque de entradas
+    if (n > ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(struct assoofs_dir_record_entry)) {
+        printf("At most %d files per round fit in one assoofs directory.\n",
+               (int)(ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(struct assoofs_dir_record_entry)));
+        return 1;
+    }
+
+    snprintf(dir, sizeof(dir), "%s/%s", argv[optind], BENCH_DIR);
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        perror(dir);
+        return 1;
+    }
+
+    for (i = 0; i < rounds; i++)
+        run_round(dir, n);
+
+    rmdir(dir);
+
+    if (output) {
+        out = fopen(output, "w");
+        if (!out) {
+            perror(output);
+            return 1;
+        }
+    }
+    report(out, argv[optind], n, rounds);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+
+usage:
+    printf("Usage: assoofs-bench [-n files] [-r rounds] [-o output.json] <mountpoint>\n");
+    return 1;
+}
@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# Formatea una imagen nueva con mkassoofs, la monta (con el modulo o con
+# assoofs-fuse), ejecuta assoofs-bench sobre ella y comprueba la imagen
+# con assoofs-fsck al desmontar. El JSON sale por la salida estandar.
+# Con BENCH_PROG=assoofs-stress se ejecuta la prueba de escalabilidad.
+#
+#   assoofs-bench.sh [kernel|fuse] [opciones del programa]
+#
+
+set -e
+
+PROG=${BENCH_PROG:-assoofs-bench}
+MODE=${1:-kernel}
+[ $# -gt 0 ] && shift
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+IMG=$(mktemp /tmp/assoofs-bench.XXXXXX)
+MNT=$(mktemp -d /tmp/assoofs-bench-mnt.XXXXXX)
+
+cleanup() {
+    if mountpoint -q "$MNT"; then
+        if [ "$MODE" = fuse ]; then fusermount3 -u "$MNT"; else umount "$MNT"; fi
+    fi
+    rmdir "$MNT"
+    rm -f "$IMG"
+}
+trap cleanup EXIT
+
+# 64 bloques de 4 KiB: todo lo que el mapa de bits puede direccionar
+truncate -s $((64 * 4096)) "$IMG"
+"$DIR/mkassoofs" "$IMG" > /dev/null
+
+case "$MODE" in
+kernel)
+    grep -q '^assoofs ' /proc/modules || insmod "$DIR/assoofs.ko"
+    mount -t assoofs -o loop "$IMG" "$MNT"
+    ;;
+fuse)
+    "$DIR/assoofs-fuse" "$IMG" "$MNT"
+    ;;
+*)
+    echo "Usage: assoofs-bench.sh [kernel|fuse] [assoofs-bench options]" >&2
+    exit 1
+    ;;
+esac
+
+"$DIR/$PROG" "$@" "$MNT"
+
+if [ "$MODE" = fuse ]; then fusermount3 -u "$MNT"; else umount "$MNT"; fi
+# Si los contadores o el mapa de bits se han desincronizado, falla aqui
+"$DIR/assoofs-fsck" -n "$IMG" >&2
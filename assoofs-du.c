@@ -0,0 +1,89 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "libassoofs.h"
+
+/**************************************************************
+* assoofs-du: lo que ocupa un directorio sin recorrerlo
+*
+*   assoofs-du <ruta>...
+*   assoofs-du -i <imagen> [ruta]...
+*
+* Sobre un sistema montado se usa ASSOOFS_IOC_GET_USAGE: el
+* modulo lleva en cada directorio los bytes de todos los
+* ficheros que cuelgan de el y cuantos objetos son (version 6).
+* Con -i se leen los mismos totales directamente de la imagen.
+* Se imprimen bytes, inodos y ruta; de un fichero, sus bytes
+***************************************************************/
+
+static void print_usage(const struct assoofs_usage *usage, const char *path) {
+    printf("%llu\t%llu\t%s\n", (unsigned long long)usage->bytes, (unsigned long long)usage->inodes, path);
+}
+
+static int du_mounted(const char *path) {
+    struct assoofs_usage usage;
+    int fd = open(path, O_RDONLY), ret;
+
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    ret = ioctl(fd, ASSOOFS_IOC_GET_USAGE, &usage);
+    if (ret)
+        perror(path);
+    else
+        print_usage(&usage, path);
+    close(fd);
+    return ret ? 1 : 0;
+}
+
+static int du_image(struct assoofs_image *img, const char *path) {
+    struct assoofs_inode_info *inode = assoofs_image_inode(img, ASSOOFS_ROOTDIR_INODE_NUMBER);
+    struct assoofs_usage usage;
+    char copy[PATH_MAX], *name, *save;
+
+    snprintf(copy, sizeof(copy), "%s", path);
+    for (name = strtok_r(copy, "/", &save); inode && name; name = strtok_r(NULL, "/", &save))
+        inode = assoofs_image_lookup(img, inode, name);
+    if (!inode) {
+        perror(path);
+        return 1;
+    }
+
+    usage.bytes = S_ISDIR(inode->mode) ? inode->usage_bytes : inode->file_size;
+    usage.inodes = S_ISDIR(inode->mode) ? inode->usage_inodes : 0;
+    print_usage(&usage, path);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct assoofs_image img;
+    int ret = 0, i;
+
+    if (argc >= 3 && !strcmp(argv[1], "-i")) {
+        if (assoofs_image_open(&img, argv[2], ASSOOFS_IMAGE_RDONLY)) {
+            perror(argv[2]);
+            return 1;
+        }
+        if (argc == 3)
+            ret = du_image(&img, "/");
+        for (i = 3; i < argc; i++)
+            ret |= du_image(&img, argv[i]);
+        assoofs_image_close(&img);
+        return ret;
+    }
+
+    if (argc < 2 || argv[1][0] == '-') {
+        printf("Usage: assoofs-du <path>...\n"
+               "       assoofs-du -i <image> [path]...\n");
+        return 1;
+    }
+
+    for (i = 1; i < argc; i++)
+        ret |= du_mounted(argv[i]);
+    return ret;
+}
@@ -0,0 +1,483 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "libassoofs.h"
+
+/**************************************************************
+* assoofs-dump: copia de seguridad de una imagen sin montar
+*
+*   assoofs-dump [-s n] <imagen> > copia.tar
+*   assoofs-dump -r [-b bloques] <imagen> < copia.tar
+*
+* El volcado lee la imagen una sola vez y en orden fisico: se
+* pide toda la proyeccion de golpe (MADV_WILLNEED, una lectura
+* secuencial), el arbol se reconstruye del almacen de inodos y
+* de los bloques de directorio, y se emite un tar ustar con los
+* directorios primero y los ficheros ordenados por bloque. Con
+* -s se vuelca la instantanea n.
+*
+* La restauracion formatea la imagen de destino y crea cada
+* entrada del tar con libassoofs; como el asignador da el bloque
+* libre mas bajo del grupo del directorio, la imagen nueva queda
+* compacta y cada directorio junto a sus ficheros, en el orden del
+* archivo. Solo se restauran ficheros y directorios
+***************************************************************/
+
+#define TAR_BLOCK 512
+
+//Cabecera ustar (POSIX.1-1988)
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+static char zeros[TAR_BLOCK];
+
+/**************************************************************
+* Escritura del tar
+***************************************************************/
+
+//Los nombres de mas de 100 bytes se parten en prefix y name por una barra
+static int tar_split_name(struct tar_header *h, const char *path) {
+    size_t len = strlen(path);
+    const char *cut;
+
+    if (len <= sizeof(h->name)) {
+        memcpy(h->name, path, len);
+        return 0;
+    }
+
+    for (cut = path + len - 1; cut > path; cut--) {
+        if (*cut != '/' || (size_t)(cut - path) > sizeof(h->prefix) || len - (cut - path) - 1 > sizeof(h->name))
+            continue;
+        memcpy(h->prefix, path, cut - path);
+        memcpy(h->name, cut + 1, len - (cut - path) - 1);
+        return 0;
+    }
+
+    errno = ENAMETOOLONG;
+    return -1;
+}
+
+static int tar_write_header(FILE *out, const char *path, mode_t mode, uint64_t size, char type, time_t mtime) {
+    struct tar_header h;
+    unsigned int sum = 0;
+    size_t i;
+
+    memset(&h, 0, sizeof(h));
+    if (tar_split_name(&h, path))
+        return -1;
+
+    snprintf(h.mode, sizeof(h.mode), "%07o", (unsigned int)(mode & 07777));
+    snprintf(h.uid, sizeof(h.uid), "%07o", 0);
+    snprintf(h.gid, sizeof(h.gid), "%07o", 0);
+    snprintf(h.size, sizeof(h.size), "%011llo", (unsigned long long)size);
+    snprintf(h.mtime, sizeof(h.mtime), "%011llo", (unsigned long long)mtime);
+    h.typeflag = type;
+    memcpy(h.magic, "ustar", 6);
+    memcpy(h.version, "00", 2);
+
+    //La suma se calcula con el propio campo lleno de espacios
+    memset(h.chksum, ' ', sizeof(h.chksum));
+    for (i = 0; i < sizeof(h); i++)
+        sum += ((unsigned char *)&h)[i];
+    snprintf(h.chksum, sizeof(h.chksum), "%06o", sum);
+
+    return fwrite(&h, sizeof(h), 1, out) == 1 ? 0 : -1;
+}
+
+static int tar_write_data(FILE *out, const void *data, uint64_t size) {
+    size_t pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+
+    if (size && fwrite(data, size, 1, out) != 1)
+        return -1;
+    if (pad && fwrite(zeros, pad, 1, out) != 1)
+        return -1;
+    return 0;
+}
+
+/**************************************************************
+* Volcado: primero el arbol (nombres y directorios), despues los
+* datos de los ficheros en orden de bloque
+***************************************************************/
+
+struct dump_file {
+    struct assoofs_inode_info *inode;
+    char *path;
+};
+
+static int compare_blocks(const void *a, const void *b) {
+    const struct dump_file *x = a, *y = b;
+
+    return (x->inode->data_block_number > y->inode->data_block_number) - (x->inode->data_block_number < y->inode->data_block_number);
+}
+
+static int dump(const char *image, int snapshot) {
+    struct assoofs_image img;
+    struct assoofs_inode_info *table, *inode;
+    struct assoofs_dir_record_entry *record;
+    struct assoofs_dir_iter it;
+    struct assoofs_extent ext;
+    struct dump_file files[ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED];
+    char *paths[ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED] = { NULL };
+    int queue[ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED], seen[ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED] = { 0 };
+    int head = 0, tail = 0, nfiles = 0, ret = 1, i;
+    time_t now = time(NULL);
+    uint64_t count, slot;
+    size_t len;
+
+    if (assoofs_image_open(&img, image, ASSOOFS_IMAGE_RDONLY)) {
+        perror(image);
+        return 1;
+    }
+    if (snapshot && assoofs_image_use_snapshot(&img, snapshot)) {
+        fprintf(stderr, "%s: no snapshot %d.\n", image, snapshot);
+        goto out;
+    }
+
+    //Toda la imagen en una sola pasada secuencial; despues todo son aciertos en la cache de paginas
+    madvise(img.map, img.size, MADV_SEQUENTIAL);
+    madvise(img.map, img.size, MADV_WILLNEED);
+
+    table = assoofs_image_inode_table(&img, &count);
+    inode = assoofs_image_inode(&img, ASSOOFS_ROOTDIR_INODE_NUMBER);
+    if (!inode || !S_ISDIR(inode->mode)) {
+        fprintf(stderr, "%s: root directory inode is missing.\n", image);
+        goto out;
+    }
+    slot = inode - table;
+    paths[slot] = strdup("");
+    seen[slot] = 1;
+    queue[tail++] = slot;
+
+    //Directorios en anchura, cada uno con su cabecera; los ficheros se apuntan para despues
+    while (head < tail) {
+        int dir = queue[head++];
+
+        if (assoofs_dir_iter_init(&it, &img, &table[dir]))
+            continue;
+
+        while ((record = assoofs_dir_iter_next(&it))) {
+            inode = assoofs_image_inode(&img, record->inode_no);
+            if (!inode || inode->state_flag != ASSOOFS_STATE_ALIVE)
+                continue;
+            slot = inode - table;
+            if (slot >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED || seen[slot])
+                continue;
+            seen[slot] = 1;
+
+            len = strlen(paths[dir]) + strlen(record->filename) + 2;
+            paths[slot] = malloc(len);
+            snprintf(paths[slot], len, "%s%s%s", paths[dir], *paths[dir] ? "/" : "", record->filename);
+
+            if (S_ISDIR(inode->mode)) {
+                queue[tail++] = slot;
+                if (tar_write_header(stdout, paths[slot], inode->mode & 07777 ? inode->mode : 0755, 0, '5', now)) {
+                    perror(paths[slot]);
+                    goto out;
+                }
+            } else if (S_ISREG(inode->mode)) {
+                files[nfiles].inode = inode;
+                files[nfiles++].path = paths[slot];
+            }
+        }
+    }
+
+    //Los datos en el orden en que estan en la imagen
+    qsort(files, nfiles, sizeof(files[0]), compare_blocks);
+    for (i = 0; i < nfiles; i++) {
+        int n = assoofs_file_extents(&img, files[i].inode, &ext, 1);
+
+        if (n < 0 || tar_write_header(stdout, files[i].path, files[i].inode->mode & 07777 ? files[i].inode->mode : 0644,
+                                      n ? ext.length : 0, '0', now) ||
+            tar_write_data(stdout, n ? ext.data : NULL, n ? ext.length : 0)) {
+            perror(files[i].path);
+            goto out;
+        }
+    }
+
+    //Fin del archivo: dos bloques a cero
+    if (fwrite(zeros, TAR_BLOCK, 1, stdout) != 1 || fwrite(zeros, TAR_BLOCK, 1, stdout) != 1 || fflush(stdout)) {
+        perror("stdout");
+        goto out;
+    }
+    ret = 0;
+
+out:
+    for (i = 0; i < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++)
+        free(paths[i]);
+    assoofs_image_close(&img);
+    return ret;
+}
+
+/**************************************************************
+* Restauracion: imagen nueva con solo el directorio raiz, como
+* la deja mkassoofs pero sin el fichero de bienvenida
+***************************************************************/
+
+static int format_image(const char *image, uint64_t max_blocks) {
+    struct assoofs_super_block_info sb;
+    struct assoofs_inode_info table[ASSOOFS_INODES_PER_BLOCK];
+    char block[ASSOOFS_DEFAULT_BLOCK_SIZE];
+    struct stat st;
+    uint64_t size, blocks;
+    int fd, ret = -1;
+
+    fd = open(image, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || fstat(fd, &st))
+        goto out;
+
+    //Igual que mkassoofs: un fichero vacio pasa a tener 64 bloques
+    if (S_ISBLK(st.st_mode)) {
+        if (ioctl(fd, BLKGETSIZE64, &size))
+            goto out;
+    } else if (!st.st_size) {
+        size = (uint64_t)ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED * ASSOOFS_DEFAULT_BLOCK_SIZE;
+        if (ftruncate(fd, size))
+            goto out;
+    } else {
+        size = st.st_size;
+    }
+
+    blocks = size / ASSOOFS_DEFAULT_BLOCK_SIZE;
+    if (blocks > ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)
+        blocks = ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED;
+    if (max_blocks && max_blocks < blocks)
+        blocks = max_blocks;
+    if (blocks <= ASSOOFS_ROOTDIR_BLOCK_NUMBER) {
+        errno = ENOSPC;
+        goto out;
+    }
+
+    memset(&sb, 0, sizeof(sb));
+    sb.version = ASSOOFS_VERSION;
+    sb.magic = ASSOOFS_MAGIC;
+    sb.block_size = ASSOOFS_DEFAULT_BLOCK_SIZE;
+    sb.inodes_count = ASSOOFS_ROOTDIR_INODE_NUMBER;
+    sb.real_inodes_count = 1;
+    sb.free_blocks = ASSOOFS_BLOCKS_MASK(blocks) & ~((1ULL << (ASSOOFS_ROOTDIR_BLOCK_NUMBER + 1)) - 1);
+    sb.free_blocks_count = blocks - (ASSOOFS_ROOTDIR_BLOCK_NUMBER + 1);
+    sb.blocks_count = blocks;
+    sb.free_inodes = ~0ULL << 1;
+    sb.free_inodes_count = ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED - 1;
+
+    memset(table, 0, sizeof(table));
+    table[0].mode = S_IFDIR;
+    table[0].inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER;
+    table[0].data_block_number = ASSOOFS_ROOTDIR_BLOCK_NUMBER;
+    table[0].state_flag = ASSOOFS_STATE_ALIVE;
+
+    memset(block, 0, sizeof(block));
+    memcpy(block, table, sizeof(table));
+
+    if (pwrite(fd, &sb, sizeof(sb), ASSOOFS_SUPERBLOCK_BLOCK_NUMBER * ASSOOFS_DEFAULT_BLOCK_SIZE) != sizeof(sb) ||
+        pwrite(fd, block, sizeof(block), ASSOOFS_INODESTORE_BLOCK_NUMBER * ASSOOFS_DEFAULT_BLOCK_SIZE) != sizeof(block))
+        goto out;
+    memset(block, 0, sizeof(block));
+    if (pwrite(fd, block, sizeof(block), ASSOOFS_ROOTDIR_BLOCK_NUMBER * ASSOOFS_DEFAULT_BLOCK_SIZE) != sizeof(block))
+        goto out;
+    ret = 0;
+
+out:
+    if (fd >= 0)
+        close(fd);
+    return ret;
+}
+
+//Directorio que contiene path, creando los intermedios que falten; en name queda el ultimo componente
+static struct assoofs_inode_info *restore_parent(struct assoofs_image *img, char *path, char **name) {
+    struct assoofs_inode_info *dir = assoofs_image_inode(img, ASSOOFS_ROOTDIR_INODE_NUMBER), *next;
+    char *p = path, *slash;
+
+    while ((slash = strchr(p, '/'))) {
+        *slash = '\0';
+        if (*p) {
+            next = assoofs_image_lookup(img, dir, p);
+            if (!next) {
+                next = assoofs_image_new_inode(img, S_IFDIR | 0755, dir);
+                if (!next)
+                    return NULL;
+                if (assoofs_image_add_record(img, dir, p, next->inode_no)) {
+                    assoofs_image_release_inode(img, next);
+                    return NULL;
+                }
+            } else if (!S_ISDIR(next->mode)) {
+                errno = ENOTDIR;
+                return NULL;
+            }
+            dir = next;
+        }
+        p = slash + 1;
+    }
+
+    *name = p;
+    return dir;
+}
+
+static int restore_entry(struct assoofs_image *img, char *path, mode_t mode, const char *data, uint64_t size) {
+    struct assoofs_inode_info *dir, *inode;
+    char *name;
+
+    dir = restore_parent(img, path, &name);
+    if (!dir)
+        return -1;
+    if (!*name)
+        return 0;
+
+    //Como tar: si el nombre ya existe gana la ultima entrada, salvo un directorio que ya esta
+    inode = assoofs_image_lookup(img, dir, name);
+    if (inode) {
+        if (S_ISDIR(inode->mode) && S_ISDIR(mode))
+            return 0;
+        if (assoofs_image_unlink(img, dir, name))
+            return -1;
+    }
+
+    inode = assoofs_image_new_inode(img, mode, dir);
+    if (!inode)
+        return -1;
+
+    //El tamano va antes que la entrada para que add_record lo sume a los totales de los directorios
+    if (S_ISREG(mode)) {
+        memcpy(assoofs_image_block(img, inode->data_block_number), data, size);
+        inode->file_size = size;
+    }
+
+    if (assoofs_image_add_record(img, dir, name, inode->inode_no)) {
+        assoofs_image_release_inode(img, inode);
+        return -1;
+    }
+    return 0;
+}
+
+static int restore(const char *image, uint64_t max_blocks) {
+    struct assoofs_image img;
+    struct tar_header h;
+    char path[sizeof(h.prefix) + sizeof(h.name) + 2], data[ASSOOFS_DEFAULT_BLOCK_SIZE];
+    uint64_t size, skip;
+    mode_t mode;
+    int ret = 1;
+
+    if (format_image(image, max_blocks) || assoofs_image_open(&img, image, ASSOOFS_IMAGE_RDWR)) {
+        perror(image);
+        return 1;
+    }
+
+    while (fread(&h, sizeof(h), 1, stdin) == 1) {
+        if (!memcmp(&h, zeros, sizeof(h)))
+            break;
+
+        size = strtoull(h.size, NULL, 8);
+        mode = strtoul(h.mode, NULL, 8) & 07777;
+        snprintf(path, sizeof(path), "%.*s%s%.*s", (int)strnlen(h.prefix, sizeof(h.prefix)), h.prefix,
+                 h.prefix[0] ? "/" : "", (int)strnlen(h.name, sizeof(h.name)), h.name);
+
+        //Sin la barra final de los directorios ni el ./ o la / del principio
+        while (strlen(path) > 1 && path[strlen(path) - 1] == '/')
+            path[strlen(path) - 1] = '\0';
+        while (!strncmp(path, "./", 2) || path[0] == '/')
+            memmove(path, path + (path[0] == '/' ? 1 : 2), strlen(path) + 1);
+        if (!strcmp(path, "."))
+            path[0] = '\0';
+
+        if (h.typeflag == '5') {
+            if (restore_entry(&img, path, S_IFDIR | mode, NULL, 0)) {
+                perror(path);
+                goto out;
+            }
+            size = 0;
+        } else if (h.typeflag == '0' || h.typeflag == '\0') {
+            if (size > ASSOOFS_DEFAULT_BLOCK_SIZE) {
+                fprintf(stderr, "%s: does not fit in one block (%llu bytes).\n", path, (unsigned long long)size);
+                goto out;
+            }
+            if (size && fread(data, size, 1, stdin) != 1) {
+                fprintf(stderr, "%s: archive is truncated.\n", path);
+                goto out;
+            }
+            if (restore_entry(&img, path, S_IFREG | mode, data, size)) {
+                perror(path);
+                goto out;
+            }
+        } else {
+            fprintf(stderr, "Skipping %s: only regular files and directories are supported.\n", path);
+        }
+
+        //Lo que quede del contenido (tipos que no se restauran) y el relleno hasta el siguiente bloque
+        skip = (h.typeflag == '0' || h.typeflag == '\0' ? 0 : size) + (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+        while (skip) {
+            size_t n = skip < sizeof(data) ? skip : sizeof(data);
+
+            if (fread(data, n, 1, stdin) != 1) {
+                fprintf(stderr, "Archive is truncated.\n");
+                goto out;
+            }
+            skip -= n;
+        }
+    }
+
+    ret = assoofs_image_sync(&img) ? 1 : 0;
+    if (ret)
+        perror(image);
+
+out:
+    assoofs_image_close(&img);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    static char buffer[1 << 20];
+    uint64_t blocks = 0;
+    int opt, restoring = 0, snapshot = 0;
+
+    while ((opt = getopt(argc, argv, "rb:s:")) != -1) {
+        switch (opt) {
+        case 'r':
+            restoring = 1;
+            break;
+        case 'b':
+            blocks = strtoull(optarg, NULL, 0);
+            break;
+        case 's':
+            snapshot = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1 || (restoring && snapshot) || (!restoring && blocks))
+        goto usage;
+
+    //El tar sale en escrituras grandes, no de cabecera en cabecera
+    setvbuf(restoring ? stdin : stdout, buffer, _IOFBF, sizeof(buffer));
+
+    return restoring ? restore(argv[optind], blocks) : dump(argv[optind], snapshot);
+
+usage:
+    printf("Usage: assoofs-dump [-s snapshot] <image> > archive.tar\n"
+           "       assoofs-dump -r [-b blocks] <image> < archive.tar\n");
+    return 1;
+}
@@ -0,0 +1,514 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "libassoofs.h"
+
+/**************************************************************
+* assoofs-fsck: comprobacion y reparacion offline de una imagen
+*
+* Fase 1 (en paralelo): cada hilo recorre un trozo del almacen
+*   de inodos, marca los bloques en uso y lee los bloques de los
+*   directorios que le tocan.
+* Fase 2: recorrido desde el raiz para ver que inodos son
+*   alcanzables y cuantas entradas apuntan a cada uno.
+* Fase 3: se comparan mapa de bits, referencias de los bloques
+*   compartidos (con los ficheros y directorios de las
+*   instantaneas), contadores del superbloque, dir_children_count
+*   y los totales recursivos de cada directorio con lo calculado
+*   y, con -y, se reescriben. Una imagen anterior a la version 6
+*   se actualiza antes de repararla.
+*
+* Codigos de salida como los de e2fsck: 0 limpio, 1 errores
+* corregidos, 4 errores sin corregir, 8 error de operacion.
+***************************************************************/
+
+#define FSCK_OK          0
+#define FSCK_CORRECTED   1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR       8
+
+//Desde la version 2 los inodos van de 1 a ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED
+#define FSCK_MAX_INODE ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED
+
+//Lo que la fase 1 averigua de cada entrada del almacen de inodos
+struct slot_scan {
+    int alive;
+    int valid;
+    int nchildren;                                                      //Entradas vivas en el bloque del directorio
+    struct assoofs_dir_record_entry *children[ASSOOFS_DIR_RECORDS_PER_BLOCK];
+};
+
+struct fsck_state {
+    struct assoofs_image img;
+    struct assoofs_inode_info *table;
+    uint64_t count;                                     //Entradas del almacen de inodos en uso
+    struct slot_scan *slots;
+    int ino_slot[FSCK_MAX_INODE + 1];                   //Inodo -> entrada viva del almacen
+    int links[FSCK_MAX_INODE + 1];                      //Entradas de directorio que apuntan al inodo
+    int reachable[FSCK_MAX_INODE + 1];
+    int has_root;                                       //Hay un raiz del que medir la alcanzabilidad (fase 2)
+    int parent[FSCK_MAX_INODE + 1];                     //Directorio con la entrada que apunta al inodo
+    int repair;
+    int errors;
+    int fixed;
+};
+
+struct worker {
+    pthread_t thread;
+    struct fsck_state *st;
+    uint64_t first;
+    uint64_t last;
+};
+
+static void problem(struct fsck_state *st, int fixable, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+static void problem(struct fsck_state *st, int fixable, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+
+    st->errors++;
+    if (fixable && st->repair) {
+        st->fixed++;
+        printf("  -> fixed\n");
+    }
+}
+
+/**************************************************************
+* FASE 1: un hilo por trozo del almacen de inodos
+***************************************************************/
+
+static void *scan_slots(void *arg) {
+    struct worker *w = arg;
+    struct fsck_state *st = w->st;
+    uint64_t i;
+
+    for (i = w->first; i < w->last; i++) {
+        struct assoofs_inode_info *inode = &st->table[i];
+        struct slot_scan *scan = &st->slots[i];
+        struct assoofs_dir_iter it;
+        struct assoofs_dir_record_entry *record;
+
+        scan->alive = inode->state_flag == ASSOOFS_STATE_ALIVE;
+        if (!scan->alive)
+            continue;
+
+        scan->valid = (S_ISDIR(inode->mode) || S_ISREG(inode->mode))
+            && inode->inode_no > 0 && inode->inode_no <= FSCK_MAX_INODE
+            && inode->data_block_number > ASSOOFS_INODESTORE_BLOCK_NUMBER
+            && inode->data_block_number < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED
+            && inode->data_block_number < st->img.nblocks;
+        if (!scan->valid)
+            continue;
+
+        if (!S_ISDIR(inode->mode))
+            continue;
+
+        //Contamos todas las entradas vivas del bloque, no solo las dir_children_count primeras
+        assoofs_dir_iter_init(&it, &st->img, inode);
+        it.remaining = ASSOOFS_DIR_RECORDS_PER_BLOCK;
+        while ((record = assoofs_dir_iter_next(&it)))
+            scan->children[scan->nchildren++] = record;
+    }
+
+    return NULL;
+}
+
+static int run_phase1(struct fsck_state *st, int nthreads) {
+    struct worker *workers;
+    uint64_t chunk;
+    int i;
+
+    if (nthreads > st->count)
+        nthreads = st->count ? st->count : 1;
+
+    workers = calloc(nthreads, sizeof(*workers));
+    chunk = (st->count + nthreads - 1) / nthreads;
+
+    for (i = 0; i < nthreads; i++) {
+        workers[i].st = st;
+        workers[i].first = i * chunk;
+        workers[i].last = (i + 1) * chunk > st->count ? st->count : (i + 1) * chunk;
+        if (pthread_create(&workers[i].thread, NULL, scan_slots, &workers[i])) {
+            perror("pthread_create");
+            nthreads = i;
+            break;
+        }
+    }
+
+    for (i = 0; i < nthreads; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    free(workers);
+    return 0;
+}
+
+/**************************************************************
+* FASE 2: alcanzabilidad desde el raiz
+***************************************************************/
+
+static void run_phase2(struct fsck_state *st) {
+    int queue[FSCK_MAX_INODE + 1];
+    int head = 0, tail = 0, i, j;
+
+    for (i = 0; i <= FSCK_MAX_INODE; i++)
+        st->ino_slot[i] = -1;
+
+    for (i = 0; i < st->count; i++) {
+        struct assoofs_inode_info *inode = &st->table[i];
+
+        if (!st->slots[i].alive)
+            continue;
+        if (!st->slots[i].valid) {
+            problem(st, 1, "Inode in slot %d (ino %llu) is corrupted.\n", i, (unsigned long long)inode->inode_no);
+            if (st->repair)
+                inode->state_flag = ASSOOFS_STATE_REMOVED;
+            continue;
+        }
+        if (st->ino_slot[inode->inode_no] != -1) {
+            problem(st, 1, "Inode %llu is stored twice (slots %d and %d).\n", (unsigned long long)inode->inode_no, st->ino_slot[inode->inode_no], i);
+            if (st->repair)
+                inode->state_flag = ASSOOFS_STATE_REMOVED;
+            st->slots[i].alive = 0;
+            continue;
+        }
+        //En la version 2 el modulo busca el inodo N solo en la posicion N - 1
+        if (st->img.sb->version >= ASSOOFS_VERSION_INODE_BITMAP && ASSOOFS_INODE_SLOT(inode->inode_no) != i)
+            problem(st, 0, "Inode %llu is stored in slot %d instead of slot %llu.\n", (unsigned long long)inode->inode_no,
+                    i, (unsigned long long)ASSOOFS_INODE_SLOT(inode->inode_no));
+        st->ino_slot[inode->inode_no] = i;
+    }
+
+    if (st->ino_slot[ASSOOFS_ROOTDIR_INODE_NUMBER] == -1 || !S_ISDIR(st->table[st->ino_slot[ASSOOFS_ROOTDIR_INODE_NUMBER]].mode)) {
+        problem(st, 0, "Root directory inode is missing.\n");
+        return;
+    }
+
+    st->has_root = 1;
+    st->reachable[ASSOOFS_ROOTDIR_INODE_NUMBER] = 1;
+    queue[tail++] = ASSOOFS_ROOTDIR_INODE_NUMBER;
+
+    while (head < tail) {
+        int ino = queue[head++];
+        struct slot_scan *scan = &st->slots[st->ino_slot[ino]];
+
+        for (j = 0; j < scan->nchildren; j++) {
+            struct assoofs_dir_record_entry *record = scan->children[j];
+            uint64_t child = record->inode_no;
+
+            if (child > FSCK_MAX_INODE || st->ino_slot[child] == -1) {
+                problem(st, 1, "Entry '%.*s' in directory %d points to missing inode %llu.\n",
+                        ASSOOFS_FILENAME_MAXLEN, record->filename, ino, (unsigned long long)child);
+                if (st->repair)
+                    record->state_flag = ASSOOFS_STATE_REMOVED;
+                scan->children[j--] = scan->children[--scan->nchildren];
+                continue;
+            }
+
+            if (st->links[child]++) {
+                problem(st, 1, "Inode %llu is linked more than once (entry '%.*s' in directory %d).\n",
+                        (unsigned long long)child, ASSOOFS_FILENAME_MAXLEN, record->filename, ino);
+                if (st->repair)
+                    record->state_flag = ASSOOFS_STATE_REMOVED;
+                scan->children[j--] = scan->children[--scan->nchildren];
+                continue;
+            }
+
+            st->reachable[child] = 1;
+            st->parent[child] = ino;
+            if (S_ISDIR(st->table[st->ino_slot[child]].mode))
+                queue[tail++] = child;
+        }
+    }
+}
+
+/**************************************************************
+* FASE 3: contadores y mapa de bits
+***************************************************************/
+
+/*
+ * Version 6: cada directorio alcanzable lleva los bytes de todos
+ * los ficheros que cuelgan de el y cuantos objetos son, sacados
+ * aqui del arbol que ha recorrido la fase 2
+ */
+static void check_usage(struct fsck_state *st) {
+    uint64_t bytes[FSCK_MAX_INODE + 1] = { 0 }, inodes[FSCK_MAX_INODE + 1] = { 0 };
+    struct assoofs_inode_info *inode;
+    int ino, p, depth;
+
+    if (st->img.sb->version < ASSOOFS_VERSION_USAGE)
+        return;
+
+    for (ino = ASSOOFS_ROOTDIR_INODE_NUMBER + 1; ino <= FSCK_MAX_INODE; ino++) {
+        if (!st->reachable[ino])
+            continue;
+        inode = &st->table[st->ino_slot[ino]];
+        for (p = st->parent[ino], depth = 0; p && depth < FSCK_MAX_INODE; p = st->parent[p], depth++) {
+            bytes[p] += S_ISREG(inode->mode) ? inode->file_size : 0;
+            inodes[p]++;
+            if (p == ASSOOFS_ROOTDIR_INODE_NUMBER)
+                break;
+        }
+    }
+
+    for (ino = ASSOOFS_ROOTDIR_INODE_NUMBER; ino <= FSCK_MAX_INODE; ino++) {
+        if (!st->reachable[ino])
+            continue;
+        inode = &st->table[st->ino_slot[ino]];
+        if (!S_ISDIR(inode->mode) || (inode->usage_bytes == bytes[ino] && inode->usage_inodes == inodes[ino]))
+            continue;
+        problem(st, 1, "Directory %d holds %llu bytes in %llu inodes, totals say %llu bytes in %llu inodes.\n", ino,
+                (unsigned long long)bytes[ino], (unsigned long long)inodes[ino],
+                (unsigned long long)inode->usage_bytes, (unsigned long long)inode->usage_inodes);
+        if (st->repair) {
+            inode->usage_bytes = bytes[ino];
+            inode->usage_inodes = inodes[ino];
+        }
+    }
+}
+
+/*
+ * Version 4: cada instantanea ocupa el bloque con su copia del
+ * almacen y tiene una referencia en el bloque de cada uno de sus
+ * inodos vivos. Una instantanea que apunta fuera de la imagen se
+ * borra con -y; lo que compartia deja de contarse
+ */
+static void count_snapshots(struct fsck_state *st, int *refs, uint64_t *used, uint64_t *stores) {
+    struct assoofs_super_block_info *sb = st->img.sb;
+    struct assoofs_inode_info *table;
+    uint64_t block, count, i;
+    int n;
+
+    if (sb->version < ASSOOFS_VERSION_SNAPSHOT)
+        return;
+
+    for (n = 0; n < ASSOOFS_MAX_SNAPSHOTS; n++) {
+        block = sb->snapshot_store[n];
+        if (!block)
+            continue;
+
+        if (block <= ASSOOFS_INODESTORE_BLOCK_NUMBER || block >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED ||
+            block >= st->img.nblocks || sb->snapshot_inodes_count[n] > ASSOOFS_INODES_PER_BLOCK) {
+            problem(st, 1, "Snapshot %d has an invalid inode store (block %llu).\n", n + 1, (unsigned long long)block);
+            if (st->repair) {
+                sb->snapshot_store[n] = 0;
+                sb->snapshot_inodes_count[n] = 0;
+                sb->snapshot_time[n] = 0;
+            }
+            continue;
+        }
+
+        *used |= 1ULL << block;
+        *stores |= 1ULL << block;
+        refs[block]++;
+
+        table = assoofs_image_block(&st->img, block);
+        count = sb->snapshot_inodes_count[n];
+        for (i = 0; i < count; i++) {
+            if (table[i].state_flag != ASSOOFS_STATE_ALIVE || table[i].data_block_number <= ASSOOFS_INODESTORE_BLOCK_NUMBER ||
+                table[i].data_block_number >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)
+                continue;
+            *used |= 1ULL << table[i].data_block_number;
+            refs[table[i].data_block_number]++;
+        }
+    }
+}
+
+static void run_phase3(struct fsck_state *st) {
+    struct assoofs_super_block_info *sb = st->img.sb;
+    uint64_t used = (1ULL << ASSOOFS_SUPERBLOCK_BLOCK_NUMBER) | (1ULL << ASSOOFS_INODESTORE_BLOCK_NUMBER);
+    uint64_t alive = 0, free_blocks, free_count, last_slot = 0, used_slots = 0, free_inodes, dir_blocks = 0, stores = 0;
+    int refs[ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED] = { 0 }, live_refs[ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED], expected;
+    int i;
+
+    for (i = 0; i < st->count; i++) {
+        struct assoofs_inode_info *inode = &st->table[i];
+        struct slot_scan *scan = &st->slots[i];
+
+        if (inode->inode_no || inode->state_flag)
+            last_slot = i + 1;
+
+        if (!scan->alive || !scan->valid)
+            continue;
+
+        //Sin raiz nada es alcanzable: borrar lo que no lo es vaciaria la imagen entera
+        if (st->has_root && !st->reachable[inode->inode_no]) {
+            problem(st, 1, "Inode %llu is not reachable from the root directory.\n", (unsigned long long)inode->inode_no);
+            if (st->repair) {
+                inode->state_flag = ASSOOFS_STATE_REMOVED;
+                continue;
+            }
+        }
+
+        alive++;
+        used |= 1ULL << inode->data_block_number;
+        refs[inode->data_block_number]++;
+        if (S_ISDIR(inode->mode))
+            dir_blocks |= 1ULL << inode->data_block_number;
+        if (i < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)
+            used_slots |= 1ULL << i;
+
+        if (S_ISDIR(inode->mode) && inode->dir_children_count != scan->nchildren) {
+            problem(st, 1, "Directory %llu has %llu children, counter says %llu.\n", (unsigned long long)inode->inode_no,
+                    (unsigned long long)scan->nchildren, (unsigned long long)inode->dir_children_count);
+            if (st->repair)
+                inode->dir_children_count = scan->nchildren;
+        }
+    }
+
+    memcpy(live_refs, refs, sizeof(live_refs));
+    count_snapshots(st, refs, &used, &stores);
+
+    //Version 3: varios ficheros pueden compartir bloque (reflink) si block_refcount lo refleja.
+    //Un directorio vivo solo puede compartir su bloque con instantaneas, y el almacen de una
+    //instantanea con nadie. Ni eso ni un bloque compartido sin contador tienen arreglo
+    for (i = 0; i < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++) {
+        expected = refs[i] ? refs[i] - 1 : 0;
+        if (expected && (((dir_blocks & (1ULL << i)) && live_refs[i] > 1) || (stores & (1ULL << i)) ||
+                         sb->version < ASSOOFS_VERSION_REFCOUNT || expected > ASSOOFS_MAX_BLOCK_REFCOUNT)) {
+            problem(st, 0, "Block %d is used by %d inodes.\n", i, refs[i]);
+            continue;
+        }
+        if (sb->version >= ASSOOFS_VERSION_REFCOUNT && sb->block_refcount[i] != expected) {
+            problem(st, 1, "Block %d has %u extra references, should be %d.\n", i, sb->block_refcount[i], expected);
+            if (st->repair)
+                sb->block_refcount[i] = expected;
+        }
+    }
+
+    if (last_slot > sb->inodes_count) {
+        problem(st, 1, "inodes_count is %llu but the inode store has %llu entries.\n",
+                (unsigned long long)sb->inodes_count, (unsigned long long)last_slot);
+        if (st->repair)
+            sb->inodes_count = last_slot;
+    }
+
+    if (sb->real_inodes_count != alive) {
+        problem(st, 1, "real_inodes_count is %llu, should be %llu.\n", (unsigned long long)sb->real_inodes_count, (unsigned long long)alive);
+        if (st->repair)
+            sb->real_inodes_count = alive;
+    }
+
+    //Version 5: los bloques a partir de blocks_count no existen y nunca estan libres
+    free_blocks = ~used;
+    if (sb->version >= ASSOOFS_VERSION_BLOCKS_COUNT) {
+        if (sb->blocks_count > ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED || sb->blocks_count > st->img.nblocks)
+            problem(st, 0, "Filesystem has %llu blocks but the image only holds %llu.\n",
+                    (unsigned long long)sb->blocks_count, (unsigned long long)st->img.nblocks);
+        else if (used & ~ASSOOFS_BLOCKS_MASK(sb->blocks_count))
+            problem(st, 0, "Block %d is in use but the filesystem only has %llu blocks.\n",
+                    63 - __builtin_clzll(used), (unsigned long long)sb->blocks_count);
+        free_blocks &= ASSOOFS_BLOCKS_MASK(sb->blocks_count);
+    }
+    if (sb->free_blocks != free_blocks) {
+        problem(st, 1, "Free block bitmap is %#llx, should be %#llx.\n", (unsigned long long)sb->free_blocks, (unsigned long long)free_blocks);
+        if (st->repair)
+            sb->free_blocks = free_blocks;
+    }
+
+    //Totales que el modulo vuelca en cada sync; tras un corte pueden quedar atrasados
+    free_count = __builtin_popcountll(free_blocks);
+    if (sb->free_blocks_count != free_count) {
+        problem(st, 1, "free_blocks_count is %llu, should be %llu.\n", (unsigned long long)sb->free_blocks_count, (unsigned long long)free_count);
+        if (st->repair)
+            sb->free_blocks_count = free_count;
+    }
+
+    //Version 2: mapa de posiciones libres del almacen. En la version 1 solo quedaba lo que faltaba hasta el limite
+    if (sb->version >= ASSOOFS_VERSION_INODE_BITMAP) {
+        free_inodes = ~used_slots;
+        if (sb->free_inodes != free_inodes) {
+            problem(st, 1, "Free inode bitmap is %#llx, should be %#llx.\n", (unsigned long long)sb->free_inodes, (unsigned long long)free_inodes);
+            if (st->repair)
+                sb->free_inodes = free_inodes;
+        }
+        free_count = __builtin_popcountll(free_inodes);
+    } else {
+        free_count = sb->inodes_count < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED ? ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED - sb->inodes_count : 0;
+    }
+    if (sb->free_inodes_count != free_count) {
+        problem(st, 1, "free_inodes_count is %llu, should be %llu.\n", (unsigned long long)sb->free_inodes_count, (unsigned long long)free_count);
+        if (st->repair)
+            sb->free_inodes_count = free_count;
+    }
+
+    check_usage(st);
+}
+
+int main(int argc, char *argv[]) {
+    struct fsck_state st;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt, ret, upgraded = 0;
+
+    memset(&st, 0, sizeof(st));
+
+    while ((opt = getopt(argc, argv, "nyj:")) != -1) {
+        switch (opt) {
+        case 'n':
+            st.repair = 0;
+            break;
+        case 'y':
+            st.repair = 1;
+            break;
+        case 'j':
+            nthreads = atol(optarg);
+            break;
+        default:
+            printf("Usage: assoofs-fsck [-n|-y] [-j threads] <device>\n");
+            return FSCK_ERROR;
+        }
+    }
+
+    if (optind != argc - 1 || nthreads < 1) {
+        printf("Usage: assoofs-fsck [-n|-y] [-j threads] <device>\n");
+        return FSCK_ERROR;
+    }
+
+    if (assoofs_image_open(&st.img, argv[optind], st.repair ? ASSOOFS_IMAGE_RDWR : ASSOOFS_IMAGE_RDONLY)) {
+        perror("Error opening the device");
+        return FSCK_ERROR;
+    }
+
+    //Las reparaciones se escriben en el formato actual, igual que al montar en lectura/escritura
+    if (st.repair && st.img.sb->version < ASSOOFS_VERSION) {
+        printf("Upgrading image from version %llu to %d.\n", (unsigned long long)st.img.sb->version, ASSOOFS_VERSION);
+        if (assoofs_image_upgrade(&st.img)) {
+            perror("Error upgrading the image");
+            assoofs_image_close(&st.img);
+            return FSCK_ERROR;
+        }
+        upgraded = 1;
+    }
+
+    st.table = assoofs_image_inode_table(&st.img, &st.count);
+    st.slots = calloc(st.count ? st.count : 1, sizeof(*st.slots));
+
+    run_phase1(&st, nthreads);
+    run_phase2(&st);
+    run_phase3(&st);
+
+    if (st.repair && (st.fixed || upgraded) && assoofs_image_sync(&st.img)) {
+        perror("Error writing the repaired image");
+        assoofs_image_close(&st.img);
+        return FSCK_ERROR;
+    }
+
+    printf("%s: %d problems found, %d fixed.\n", argv[optind], st.errors, st.fixed);
+
+    if (!st.errors)
+        ret = FSCK_OK;
+    else if (st.fixed == st.errors)
+        ret = FSCK_CORRECTED;
+    else
+        ret = FSCK_UNCORRECTED;
+
+    free(st.slots);
+    assoofs_image_close(&st.img);
+    return ret;
+}
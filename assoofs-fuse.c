@@ -0,0 +1,536 @@
+#define FUSE_USE_VERSION 31
+
+#include <errno.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/statvfs.h>
+#include "libassoofs.h"
+
+/**************************************************************
+* assoofs-fuse: servidor FUSE que monta una imagen assoofs en
+* espacio de usuario, sin necesidad de cargar assoofs.ko
+*
+* Usa el mismo formato en disco y los mismos algoritmos que el
+* modulo (a traves de libassoofs): bloque libre mas bajo del
+* mapa de bits, numero de inodo libre mas bajo de su propio mapa
+* (el inodo N en la posicion N - 1 del almacen) y entradas de
+* directorio marcadas como REMOVED. copy_file_range de un
+* fichero completo comparte el bloque (reflink) en vez de copiarlo.
+*
+* Igual que el modulo, todas las operaciones se serializan con
+* un unico cerrojo global (assoofs_sb_lock).
+*
+*   assoofs-fuse <imagen> <punto de montaje> [opciones de FUSE]
+***************************************************************/
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+static struct assoofs_image image;
+static pthread_mutex_t assoofs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**************************************************************
+* Resolucion de rutas componente a componente desde el raiz.
+* Si parent no es NULL devuelve ademas el directorio padre y el
+* ultimo componente (que puede no existir todavia)
+***************************************************************/
+
+static struct assoofs_inode_info *resolve(const char *path, struct assoofs_inode_info **parent, const char **last) {
+    struct assoofs_inode_info *inode = assoofs_image_inode(&image, ASSOOFS_ROOTDIR_INODE_NUMBER);
+    struct assoofs_inode_info *dir = NULL;
+    char name[ASSOOFS_FILENAME_MAXLEN];
+    const char *p = path, *end;
+    size_t len;
+
+    if (parent)
+        *parent = NULL;
+
+    while (*p == '/')
+        p++;
+
+    while (*p) {
+        end = strchr(p, '/');
+        len = end ? (size_t)(end - p) : strlen(p);
+        if (len >= ASSOOFS_FILENAME_MAXLEN) {
+            errno = ENAMETOOLONG;
+            return NULL;
+        }
+        if (!inode || !S_ISDIR(inode->mode)) {
+            errno = ENOTDIR;
+            return NULL;
+        }
+
+        memcpy(name, p, len);
+        name[len] = '\0';
+        dir = inode;
+        if (last)
+            *last = p;
+
+        inode = assoofs_image_lookup(&image, dir, name);
+
+        p += len;
+        while (*p == '/')
+            p++;
+
+        //Un componente intermedio que no existe es un error; el ultimo puede no existir
+        if (!inode && *p) {
+            errno = ENOENT;
+            return NULL;
+        }
+    }
+
+    if (parent)
+        *parent = dir;
+    if (!inode)
+        errno = ENOENT;
+    return inode;
+}
+
+/**************************************************************
+* Atributos
+***************************************************************/
+
+static int assoofs_fuse_getattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+    struct assoofs_inode_info *inode;
+    int ret = 0;
+
+    pthread_mutex_lock(&assoofs_lock);
+
+    inode = resolve(path, NULL, NULL);
+    if (!inode) {
+        ret = -errno;
+        goto out;
+    }
+
+    memset(st, 0, sizeof(*st));
+    st->st_ino = inode->inode_no;
+    st->st_mode = inode->mode;
+    //mkassoofs y el modulo no guardan permisos, damos unos razonables
+    if (!(st->st_mode & 07777))
+        st->st_mode |= S_ISDIR(inode->mode) ? 0755 : 0644;
+    st->st_nlink = S_ISDIR(inode->mode) ? 2 : 1;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_size = S_ISDIR(inode->mode) ? ASSOOFS_DEFAULT_BLOCK_SIZE : inode->file_size;
+    st->st_blksize = ASSOOFS_DEFAULT_BLOCK_SIZE;
+    st->st_blocks = ASSOOFS_DEFAULT_BLOCK_SIZE / 512;
+
+out:
+    pthread_mutex_unlock(&assoofs_lock);
+    return ret;
+}
+
+/**************************************************************
+* Directorios: iterate, mkdir, rmdir
+***************************************************************/
+
+static int assoofs_fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                                struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+    struct assoofs_inode_info *dir;
+    struct assoofs_dir_iter it;
+    struct assoofs_dir_record_entry *record;
+    int ret = 0;
+
+    pthread_mutex_lock(&assoofs_lock);
+
+    dir = resolve(path, NULL, NULL);
+    if (!dir || assoofs_dir_iter_init(&it, &image, dir)) {
+        ret = -errno;
+        goto out;
+    }
+
+    filler(buf, ".", NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+    while ((record = assoofs_dir_iter_next(&it)))
+        if (filler(buf, record->filename, NULL, 0, 0))
+            break;
+
+out:
+    pthread_mutex_unlock(&assoofs_lock);
+    return ret;
+}
+
+//Comun a create y mkdir, igual que en el modulo
+static int assoofs_fuse_new(const char *path, mode_t mode) {
+    struct assoofs_inode_info *parent, *inode;
+    const char *name;
+    int ret = 0;
+
+    pthread_mutex_lock(&assoofs_lock);
+
+    if (resolve(path, &parent, &name)) {
+        ret = -EEXIST;
+        goto out;
+    }
+    if (errno != ENOENT || !parent) {
+        ret = -errno;
+        goto out;
+    }
+
+    inode = assoofs_image_new_inode(&image, mode, parent);
+    if (!inode) {
+        ret = -errno;
+        goto out;
+    }
+
+    if (assoofs_image_add_record(&image, parent, name, inode->inode_no)) {
+        ret = -errno;
+        assoofs_image_release_inode(&image, inode);
+    }
+
+out:
+    pthread_mutex_unlock(&assoofs_lock);
+    return ret;
+}
+
+static int assoofs_fuse_mkdir(const char *path, mode_t mode) {
+    return assoofs_fuse_new(path, S_IFDIR | mode);
+}
+
+static int assoofs_fuse_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    return assoofs_fuse_new(path, S_IFREG | mode);
+}
+
+static int assoofs_fuse_remove(const char *path) {
+    struct assoofs_inode_info *parent;
+    const char *name;
+    int ret = 0;
+
+    pthread_mutex_lock(&assoofs_lock);
+
+    if (!resolve(path, &parent, &name) || !parent)
+        ret = parent ? -errno : -EBUSY;
+    else if (assoofs_image_unlink(&image, parent, name))
+        ret = -errno;
+
+    pthread_mutex_unlock(&assoofs_lock);
+    return ret;
+}
+
+static int assoofs_fuse_unlink(const char *path) {
+    return assoofs_fuse_remove(path);
+}
+
+static int assoofs_fuse_rmdir(const char *path) {
+    return assoofs_fuse_remove(path);
+}
+
+/**************************************************************
+* Renombrado: a diferencia del modulo, que borra y vuelve a
+* crear (perdiendo los datos), aqui solo movemos la entrada de
+* directorio y el inodo queda intacto
+***************************************************************/
+
+static int assoofs_fuse_rename(const char *from, const char *to, unsigned int flags) {
+    struct assoofs_inode_info *old_parent, *new_parent, *inode, *target;
+    struct assoofs_dir_record_entry *record, *other;
+    const char *old_name, *new_name;
+    char name[ASSOOFS_FILENAME_MAXLEN];
+    int64_t bytes, inodes, target_bytes, target_inodes;
+    uint64_t inode_no;
+    int ret = 0;
+
+    //Mismas flags que assoofs_move en el modulo
+    if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE))
+        return -EINVAL;
+
+    pthread_mutex_lock(&assoofs_lock);
+
+    inode = resolve(from, &old_parent, &old_name);
+    if (!inode || !old_parent) {
+        ret = inode ? -EBUSY : -errno;
+        goto out;
+    }
+    inode_no = inode->inode_no;
+
+    target = resolve(to, &new_parent, &new_name);
+    if (!new_parent) {
+        ret = target ? -EBUSY : -errno;
+        goto out;
+    }
+    if (!target && errno != ENOENT) {
+        ret = -errno;
+        goto out;
+    }
+
+    //El nombre apunta dentro de la ruta; lo copiamos sin la barra final
+    snprintf(name, sizeof(name), "%.*s", (int)strcspn(new_name, "/"), new_name);
+
+    //Las entradas se cambian en su sitio: si el bloque es de una instantanea hay que copiarlo antes
+    if (assoofs_image_unshare(&image, old_parent) || assoofs_image_unshare(&image, new_parent)) {
+        ret = -errno;
+        goto out;
+    }
+    record = assoofs_image_find_record(&image, old_parent, old_name);
+
+    if (!target && (flags & RENAME_EXCHANGE)) {
+        ret = -ENOENT;
+        goto out;
+    }
+
+    if (target) {
+        if (flags & RENAME_NOREPLACE) {
+            ret = -EEXIST;
+            goto out;
+        }
+        if (target == inode)
+            goto out;
+        if (flags & RENAME_EXCHANGE) {
+            //Solo se intercambian los inodos de las dos entradas
+            other = assoofs_image_find_record(&image, new_parent, name);
+            record->inode_no = other->inode_no;
+            other->inode_no = inode_no;
+
+            //Entre directorios distintos cada lado cambia lo que aportaba uno por lo que aporta el otro
+            if (old_parent != new_parent) {
+                assoofs_usage_of(inode, &bytes, &inodes);
+                assoofs_usage_of(target, &target_bytes, &target_inodes);
+                assoofs_image_usage_add(&image, old_parent, target_bytes - bytes, target_inodes - inodes);
+                assoofs_image_usage_add(&image, new_parent, bytes - target_bytes, inodes - target_inodes);
+            }
+            goto out;
+        }
+        if (assoofs_image_unlink(&image, new_parent, new_name)) {
+            ret = -errno;
+            goto out;
+        }
+    }
+
+    if (old_parent == new_parent) {
+        strcpy(record->filename, name);
+    } else {
+        if (assoofs_image_add_record(&image, new_parent, name, inode_no)) {
+            ret = -errno;
+            goto out;
+        }
+        record->state_flag = ASSOOFS_STATE_REMOVED;
+        old_parent->dir_children_count--;
+        assoofs_usage_of(inode, &bytes, &inodes);
+        assoofs_image_usage_add(&image, old_parent, -bytes, -inodes);
+    }
+
+out:
+    pthread_mutex_unlock(&assoofs_lock);
+    return ret;
+}
+
+/**************************************************************
+* Ficheros: read, write, truncate. Cada fichero ocupa un unico
+* bloque, asi que no se puede pasar de ASSOOFS_DEFAULT_BLOCK_SIZE
+***************************************************************/
+
+static int assoofs_fuse_open(const char *path, struct fuse_file_info *fi) {
+    struct assoofs_inode_info *inode;
+    int ret = 0;
+
+    pthread_mutex_lock(&assoofs_lock);
+    inode = resolve(path, NULL, NULL);
+    if (!inode)
+        ret = -errno;
+    else if (S_ISDIR(inode->mode))
+        ret = -EISDIR;
+    pthread_mutex_unlock(&assoofs_lock);
+    return ret;
+}
+
+static int assoofs_fuse_read(const char *path, char *buf, size_t len, off_t offset, struct fuse_file_info *fi) {
+    struct assoofs_inode_info *inode;
+    struct assoofs_extent ext;
+    int ret;
+
+    pthread_mutex_lock(&assoofs_lock);
+
+    inode = resolve(path, NULL, NULL);
+    if (!inode || (ret = assoofs_file_extents(&image, inode, &ext, 1)) < 0) {
+        ret = -errno;
+        goto out;
+    }
+
+    if (!ret || offset >= ext.length) {
+        ret = 0;
+        goto out;
+    }
+
+    if (len > ext.length - offset)
+        len = ext.length - offset;
+    memcpy(buf, (const char *)ext.data + offset, len);
+    ret = len;
+
+out:
+    pthread_mutex_unlock(&assoofs_lock);
+    return ret;
+}
+
+static int assoofs_fuse_write(const char *path, const char *buf, size_t len, off_t offset, struct fuse_file_info *fi) {
+    struct assoofs_inode_info *inode, *parent;
+    char *data;
+    int ret;
+
+    pthread_mutex_lock(&assoofs_lock);
+
+    inode = resolve(path, &parent, NULL);
+    if (!inode) {
+        ret = -errno;
+        goto out;
+    }
+
+    if (offset >= ASSOOFS_DEFAULT_BLOCK_SIZE) {
+        ret = -EFBIG;
+        goto out;
+    }
+    if (len > ASSOOFS_DEFAULT_BLOCK_SIZE - offset)
+        len = ASSOOFS_DEFAULT_BLOCK_SIZE - offset;
+
+    //Copia en escritura si el bloque lo comparte un clon
+    if (assoofs_image_unshare(&image, inode)) {
+        ret = -errno;
+        goto out;
+    }
+
+    data = assoofs_image_block(&image, inode->data_block_number);
+    memcpy(data + offset, buf, len);
+    if (offset + len > inode->file_size) {
+        assoofs_image_usage_add(&image, parent, offset + len - inode->file_size, 0);
+        inode->file_size = offset + len;
+    }
+    ret = len;
+
+out:
+    pthread_mutex_unlock(&assoofs_lock);
+    return ret;
+}
+
+static int assoofs_fuse_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    struct assoofs_inode_info *inode, *parent;
+    char *data;
+    int ret = 0;
+
+    pthread_mutex_lock(&assoofs_lock);
+
+    inode = resolve(path, &parent, NULL);
+    if (!inode) {
+        ret = -errno;
+    } else if (S_ISDIR(inode->mode)) {
+        ret = -EISDIR;
+    } else if (size > ASSOOFS_DEFAULT_BLOCK_SIZE) {
+        ret = -EFBIG;
+    } else if (assoofs_image_unshare(&image, inode)) {
+        ret = -errno;
+    } else {
+        data = assoofs_image_block(&image, inode->data_block_number);
+        if (size > inode->file_size)
+            memset(data + inode->file_size, 0, size - inode->file_size);
+        assoofs_image_usage_add(&image, parent, size - (int64_t)inode->file_size, 0);
+        inode->file_size = size;
+    }
+
+    pthread_mutex_unlock(&assoofs_lock);
+    return ret;
+}
+
+//Una copia del fichero completo es un clon del bloque; el resto lo copia el kernel con read y write
+static ssize_t assoofs_fuse_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t offset_in,
+                                            const char *path_out, struct fuse_file_info *fi_out, off_t offset_out,
+                                            size_t size, int flags) {
+    struct assoofs_inode_info *src, *dst;
+    ssize_t ret;
+
+    pthread_mutex_lock(&assoofs_lock);
+
+    src = resolve(path_in, NULL, NULL);
+    dst = src ? resolve(path_out, NULL, NULL) : NULL;
+    if (!dst) {
+        ret = -errno;
+    } else if (src == dst || offset_in || offset_out || size < src->file_size || dst->file_size > src->file_size) {
+        ret = -EOPNOTSUPP;
+    } else if (assoofs_image_clone(&image, src, dst)) {
+        ret = -errno;
+    } else {
+        ret = src->file_size;
+    }
+
+    pthread_mutex_unlock(&assoofs_lock);
+    return ret;
+}
+
+static int assoofs_fuse_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi) {
+    //assoofs no guarda tiempos en disco
+    return 0;
+}
+
+static int assoofs_fuse_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    int ret;
+
+    pthread_mutex_lock(&assoofs_lock);
+    ret = assoofs_image_sync(&image) ? -errno : 0;
+    pthread_mutex_unlock(&assoofs_lock);
+    return ret;
+}
+
+//Mismos valores que assoofs_statfs en el modulo
+static int assoofs_fuse_statfs(const char *path, struct statvfs *st) {
+    memset(st, 0, sizeof(*st));
+    pthread_mutex_lock(&assoofs_lock);
+    st->f_bsize = st->f_frsize = ASSOOFS_DEFAULT_BLOCK_SIZE;
+    st->f_blocks = image.sb->version >= ASSOOFS_VERSION_BLOCKS_COUNT ? image.sb->blocks_count : ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED;
+    st->f_bfree = st->f_bavail = image.sb->free_blocks_count;
+    st->f_files = ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED;
+    st->f_ffree = st->f_favail = image.sb->free_inodes_count;
+    st->f_namemax = ASSOOFS_FILENAME_MAXLEN;
+    pthread_mutex_unlock(&assoofs_lock);
+    return 0;
+}
+
+static void assoofs_fuse_destroy(void *private_data) {
+    assoofs_image_sync(&image);
+    assoofs_image_close(&image);
+}
+
+static const struct fuse_operations assoofs_fuse_ops = {
+    .getattr  = assoofs_fuse_getattr,
+    .readdir  = assoofs_fuse_readdir,
+    .mkdir    = assoofs_fuse_mkdir,
+    .create   = assoofs_fuse_create,
+    .unlink   = assoofs_fuse_unlink,
+    .rmdir    = assoofs_fuse_rmdir,
+    .rename   = assoofs_fuse_rename,
+    .open     = assoofs_fuse_open,
+    .read     = assoofs_fuse_read,
+    .write    = assoofs_fuse_write,
+    .truncate = assoofs_fuse_truncate,
+    .copy_file_range = assoofs_fuse_copy_file_range,
+    .utimens  = assoofs_fuse_utimens,
+    .fsync    = assoofs_fuse_fsync,
+    .statfs   = assoofs_fuse_statfs,
+    .destroy  = assoofs_fuse_destroy,
+};
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        printf("Usage: assoofs-fuse <device> <mountpoint> [fuse options]\n");
+        return 1;
+    }
+
+    if (assoofs_image_open(&image, argv[1], ASSOOFS_IMAGE_RDWR)) {
+        perror("Error opening the device");
+        return 1;
+    }
+
+    //Igual que al montar con el modulo, una imagen antigua se actualiza primero
+    if (assoofs_image_upgrade(&image)) {
+        perror("Error upgrading the image");
+        return 1;
+    }
+
+    //FUSE no sabe nada de la imagen: le pasamos el resto de argumentos
+    argv[1] = argv[0];
+    return fuse_main(argc - 1, argv + 1, &assoofs_fuse_ops, NULL);
+}
@@ -0,0 +1,68 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include "libassoofs.h"
+
+/**************************************************************
+* assoofs-resize: hacer crecer un assoofs hasta el final de su
+* dispositivo, o hasta el numero de bloques indicado
+*
+*   assoofs-resize <punto de montaje|imagen> [bloques]
+*
+* Sobre un punto de montaje se usa ASSOOFS_IOC_RESIZE (hace
+* falta CAP_SYS_ADMIN) y el sistema sigue montado: basta con
+* ampliar antes el volumen (lvextend, truncate + losetup -c).
+* Sobre una imagen sin montar se hace con libassoofs. Nunca se
+* mueven datos y no se puede encoger.
+***************************************************************/
+
+static int resize_mounted(const char *mountpoint, uint64_t *blocks) {
+    int fd = open(mountpoint, O_RDONLY | O_DIRECTORY), ret;
+
+    if (fd < 0)
+        return -1;
+    ret = ioctl(fd, ASSOOFS_IOC_RESIZE, blocks);
+    close(fd);
+    return ret;
+}
+
+static int resize_image(const char *path, uint64_t *blocks) {
+    struct assoofs_image img;
+    int ret;
+
+    if (assoofs_image_open(&img, path, ASSOOFS_IMAGE_RDWR))
+        return -1;
+    ret = assoofs_image_resize(&img, blocks) || assoofs_image_sync(&img) ? -1 : 0;
+    assoofs_image_close(&img);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    struct stat st;
+    uint64_t blocks = 0;
+    int ret;
+
+    if (argc < 2 || argc > 3) {
+        printf("Usage: assoofs-resize <mountpoint|image> [blocks]\n");
+        return 1;
+    }
+    if (argc == 3)
+        blocks = strtoull(argv[2], NULL, 0);
+
+    if (!stat(argv[1], &st) && S_ISDIR(st.st_mode))
+        ret = resize_mounted(argv[1], &blocks);
+    else
+        ret = resize_image(argv[1], &blocks);
+
+    if (ret) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    printf("%s: %llu blocks.\n", argv[1], (unsigned long long)blocks);
+    return 0;
+}
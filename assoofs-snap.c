@@ -0,0 +1,202 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include "libassoofs.h"
+
+/**************************************************************
+* assoofs-snap: instantaneas de solo lectura
+*
+*   assoofs-snap create <punto de montaje|imagen>
+*   assoofs-snap delete <punto de montaje|imagen> <n>
+*   assoofs-snap list <imagen>
+*   assoofs-snap ls <imagen> <n> [ruta]
+*   assoofs-snap cat <imagen> <n> <ruta>
+*
+* Sobre un punto de montaje create y delete usan el ioctl del
+* modulo (hace falta CAP_SYS_ADMIN); sobre una imagen sin montar
+* se hacen con libassoofs. ls y cat leen la instantanea
+* directamente de la imagen, sin montarla.
+***************************************************************/
+
+//Con un directorio se habla con el modulo; con cualquier otra cosa, con la imagen
+static int is_mountpoint(const char *path) {
+    struct stat st;
+
+    return !stat(path, &st) && S_ISDIR(st.st_mode);
+}
+
+static int snap_ioctl(const char *mountpoint, unsigned long cmd, uint32_t *id) {
+    int fd = open(mountpoint, O_RDONLY | O_DIRECTORY), ret;
+
+    if (fd < 0) {
+        perror(mountpoint);
+        return 1;
+    }
+    ret = ioctl(fd, cmd, id);
+    if (ret)
+        perror(mountpoint);
+    close(fd);
+    return ret ? 1 : 0;
+}
+
+static int snap_create(const char *path) {
+    struct assoofs_image img;
+    uint32_t id;
+    int ret;
+
+    if (is_mountpoint(path)) {
+        if (snap_ioctl(path, ASSOOFS_IOC_SNAP_CREATE, &id))
+            return 1;
+        printf("%u\n", id);
+        return 0;
+    }
+
+    if (assoofs_image_open(&img, path, ASSOOFS_IMAGE_RDWR)) {
+        perror(path);
+        return 1;
+    }
+    ret = assoofs_image_snapshot_create(&img, &id) || assoofs_image_sync(&img);
+    if (ret)
+        perror(path);
+    else
+        printf("%u\n", id);
+    assoofs_image_close(&img);
+    return ret;
+}
+
+static int snap_delete(const char *path, uint32_t id) {
+    struct assoofs_image img;
+    int ret;
+
+    if (is_mountpoint(path))
+        return snap_ioctl(path, ASSOOFS_IOC_SNAP_DELETE, &id);
+
+    if (assoofs_image_open(&img, path, ASSOOFS_IMAGE_RDWR)) {
+        perror(path);
+        return 1;
+    }
+    ret = assoofs_image_snapshot_delete(&img, id) || assoofs_image_sync(&img);
+    if (ret)
+        perror(path);
+    assoofs_image_close(&img);
+    return ret;
+}
+
+static int snap_list(struct assoofs_image *img) {
+    struct assoofs_super_block_info *sb = img->sb;
+    char when[64];
+    time_t t;
+    int n;
+
+    if (sb->version < ASSOOFS_VERSION_SNAPSHOT)
+        return 0;
+
+    for (n = 0; n < ASSOOFS_MAX_SNAPSHOTS; n++) {
+        if (!sb->snapshot_store[n])
+            continue;
+        t = sb->snapshot_time[n];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+        printf("%d\t%s\t%llu inodes\tstore block %llu\n", n + 1, when,
+               (unsigned long long)sb->snapshot_inodes_count[n], (unsigned long long)sb->snapshot_store[n]);
+    }
+    return 0;
+}
+
+/**************************************************************
+* Recorrido de rutas dentro de la instantanea elegida
+***************************************************************/
+
+static struct assoofs_inode_info *resolve(struct assoofs_image *img, const char *path) {
+    struct assoofs_inode_info *inode = assoofs_image_inode(img, ASSOOFS_ROOTDIR_INODE_NUMBER);
+    char copy[PATH_MAX], *name, *save;
+
+    snprintf(copy, sizeof(copy), "%s", path);
+    for (name = strtok_r(copy, "/", &save); inode && name; name = strtok_r(NULL, "/", &save))
+        inode = assoofs_image_lookup(img, inode, name);
+    return inode;
+}
+
+static int snap_ls(struct assoofs_image *img, const char *path) {
+    struct assoofs_inode_info *dir = resolve(img, path), *child;
+    struct assoofs_dir_record_entry *record;
+    struct assoofs_dir_iter it;
+
+    if (!dir || assoofs_dir_iter_init(&it, img, dir)) {
+        perror(path);
+        return 1;
+    }
+
+    while ((record = assoofs_dir_iter_next(&it))) {
+        child = assoofs_image_inode(img, record->inode_no);
+        printf("%s%s\t%llu\n", record->filename, child && S_ISDIR(child->mode) ? "/" : "",
+               child ? (unsigned long long)child->file_size : 0ULL);
+    }
+    return 0;
+}
+
+static int snap_cat(struct assoofs_image *img, const char *path) {
+    struct assoofs_inode_info *inode = resolve(img, path);
+    struct assoofs_extent ext;
+    int n;
+
+    if (!inode || (n = assoofs_file_extents(img, inode, &ext, 1)) < 0) {
+        perror(path);
+        return 1;
+    }
+    if (n && fwrite(ext.data, 1, ext.length, stdout) != ext.length)
+        return 1;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct assoofs_image img;
+    const char *cmd;
+    int ret;
+
+    if (argc < 3)
+        goto usage;
+    cmd = argv[1];
+
+    if (!strcmp(cmd, "create") && argc == 3)
+        return snap_create(argv[2]);
+    if (!strcmp(cmd, "delete") && argc == 4)
+        return snap_delete(argv[2], atoi(argv[3]));
+
+    if (!((!strcmp(cmd, "list") && argc == 3) || (!strcmp(cmd, "ls") && (argc == 4 || argc == 5)) ||
+          (!strcmp(cmd, "cat") && argc == 5)))
+        goto usage;
+
+    if (assoofs_image_open(&img, argv[2], ASSOOFS_IMAGE_RDONLY)) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    if (!strcmp(cmd, "list")) {
+        ret = snap_list(&img);
+    } else if (assoofs_image_use_snapshot(&img, atoi(argv[3]))) {
+        fprintf(stderr, "%s: no snapshot %s.\n", argv[2], argv[3]);
+        ret = 1;
+    } else if (!strcmp(cmd, "ls")) {
+        ret = snap_ls(&img, argc == 5 ? argv[4] : "/");
+    } else {
+        ret = snap_cat(&img, argv[4]);
+    }
+
+    assoofs_image_close(&img);
+    return ret;
+
+usage:
+    printf("Usage: assoofs-snap create <mountpoint|image>\n"
+           "       assoofs-snap delete <mountpoint|image> <n>\n"
+           "       assoofs-snap list <image>\n"
+           "       assoofs-snap ls <image> <n> [path]\n"
+           "       assoofs-snap cat <image> <n> <path>\n");
+    return 1;
+}
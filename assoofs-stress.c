@@ -0,0 +1,286 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "assoofs.h"
+
+/**************************************************************
+* assoofs-stress: escalabilidad con varios hilos sobre un
+* assoofs montado
+*
+*   assoofs-stress [-t hilos] [-i iteraciones] [-o salida.json] <punto de montaje>
+*
+* Para 1, 2, 4 ... hasta -t hilos, y en modo compartido (todos
+* en el mismo directorio) y privado (un directorio por hilo),
+* cada hilo repite create + write + unlink. Se informa del
+* rendimiento y de las latencias por operacion en JSON.
+*
+* Si el kernel tiene CONFIG_LOCK_STAT se limpia /proc/lock_stat
+* antes de cada prueba y se anaden las esperas y tiempos de
+* retencion de los mutex assoofs_* del modulo.
+*
+* La consistencia de contadores y mapa de bits se comprueba al
+* desmontar con assoofs-fsck (ver assoofs-bench.sh).
+***************************************************************/
+
+#define STRESS_DIR "stress"
+#define STRESS_IO_SIZE 256
+#define LOCK_STAT "/proc/lock_stat"
+#define MAX_LOCKS 8
+
+//Un directorio de assoofs solo tiene sitio para un bloque de entradas
+#define DIR_CAPACITY ((int)(ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(struct assoofs_dir_record_entry)))
+
+struct thread_ctx {
+    pthread_t thread;
+    int id;
+    int iterations;
+    char dir[PATH_MAX];
+    double *ns;                 //Latencia de cada operacion correcta
+    size_t count;
+    size_t errors;
+};
+
+struct lock_sample {
+    char name[128];
+    double contentions;
+    double wait_total_us;
+    double hold_total_us;
+    double acquisitions;
+};
+
+static pthread_barrier_t start_barrier;
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void timed(struct thread_ctx *ctx, double start, int failed) {
+    if (failed)
+        ctx->errors++;
+    else
+        ctx->ns[ctx->count++] = now_ns() - start;
+}
+
+static void *worker(void *arg) {
+    struct thread_ctx *ctx = arg;
+    char path[PATH_MAX + 32], buf[STRESS_IO_SIZE];
+    double start;
+    int i, fd;
+
+    memset(buf, 'a' + ctx->id % 26, sizeof(buf));
+    snprintf(path, sizeof(path), "%s/w%d", ctx->dir, ctx->id);
+
+    pthread_barrier_wait(&start_barrier);
+
+    for (i = 0; i < ctx->iterations; i++) {
+        start = now_ns();
+        fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+        timed(ctx, start, fd < 0);
+        if (fd < 0)
+            continue;
+
+        start = now_ns();
+        timed(ctx, start, write(fd, buf, sizeof(buf)) != sizeof(buf));
+        close(fd);
+
+        start = now_ns();
+        timed(ctx, start, unlink(path) < 0);
+    }
+
+    return NULL;
+}
+
+/**************************************************************
+* /proc/lock_stat: solo las clases de cerrojo del modulo
+***************************************************************/
+
+static void lock_stat_reset(void) {
+    FILE *f = fopen(LOCK_STAT, "w");
+
+    if (f) {
+        fputs("0\n", f);
+        fclose(f);
+    }
+}
+
+static int lock_stat_read(struct lock_sample *locks) {
+    char line[512], name[128];
+    double v[12];
+    int n = 0;
+    FILE *f = fopen(LOCK_STAT, "r");
+
+    if (!f)
+        return 0;
+
+    while (n < MAX_LOCKS && fgets(line, sizeof(line), f)) {
+        //name: con-bounces contentions waittime-min waittime-max waittime-total waittime-avg
+        //      acq-bounces acquisitions holdtime-min holdtime-max holdtime-total holdtime-avg
+        if (sscanf(line, " %127[^:]: %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf", name,
+                   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8], &v[9], &v[10], &v[11]) != 13)
+            continue;
+        if (!strstr(name, "assoofs_"))
+            continue;
+
+        snprintf(locks[n].name, sizeof(locks[n].name), "%s", name);
+        locks[n].contentions = v[1];
+        locks[n].wait_total_us = v[4];
+        locks[n].acquisitions = v[7];
+        locks[n].hold_total_us = v[10];
+        n++;
+    }
+
+    fclose(f);
+    return n;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**************************************************************
+* Una prueba: n hilos en modo compartido o privado
+***************************************************************/
+
+static void run(FILE *out, const char *base, int shared, int nthreads, int iterations, int first) {
+    struct thread_ctx *ctx = calloc(nthreads, sizeof(*ctx));
+    struct lock_sample locks[MAX_LOCKS];
+    double start, elapsed, *all;
+    size_t total = 0, errors = 0, k;
+    int i, nlocks;
+
+    for (i = 0; i < nthreads; i++) {
+        ctx[i].id = i;
+        ctx[i].iterations = iterations;
+        ctx[i].ns = calloc(iterations * 3, sizeof(double));
+        if (shared)
+            snprintf(ctx[i].dir, sizeof(ctx[i].dir), "%s", base);
+        else if (snprintf(ctx[i].dir, sizeof(ctx[i].dir), "%s/p%d", base, i) < sizeof(ctx[i].dir))
+            mkdir(ctx[i].dir, 0755);
+    }
+
+    lock_stat_reset();
+    pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&ctx[i].thread, NULL, worker, &ctx[i]);
+
+    start = now_ns();
+    pthread_barrier_wait(&start_barrier);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(ctx[i].thread, NULL);
+    elapsed = now_ns() - start;
+    pthread_barrier_destroy(&start_barrier);
+
+    nlocks = lock_stat_read(locks);
+
+    for (i = 0; i < nthreads; i++) {
+        total += ctx[i].count;
+        errors += ctx[i].errors;
+    }
+    all = calloc(total ? total : 1, sizeof(double));
+    for (i = 0, k = 0; i < nthreads; i++) {
+        memcpy(all + k, ctx[i].ns, ctx[i].count * sizeof(double));
+        k += ctx[i].count;
+    }
+    qsort(all, total, sizeof(double), compare_double);
+
+    fprintf(out, "%s    {\"mode\": \"%s\", \"threads\": %d, \"ops\": %zu, \"errors\": %zu, "
+            "\"ops_per_sec\": %.1f, \"p50_ns\": %.0f, \"p99_ns\": %.0f, \"max_ns\": %.0f, \"locks\": [",
+            first ? "" : ",\n", shared ? "shared" : "private", nthreads, total, errors,
+            total / (elapsed / 1e9),
+            total ? all[(size_t)(0.50 * (total - 1))] : 0.0,
+            total ? all[(size_t)(0.99 * (total - 1))] : 0.0,
+            total ? all[total - 1] : 0.0);
+    for (i = 0; i < nlocks; i++)
+        fprintf(out, "%s{\"name\": \"%s\", \"acquisitions\": %.0f, \"contentions\": %.0f, "
+                "\"wait_total_us\": %.2f, \"hold_total_us\": %.2f}",
+                i ? ", " : "", locks[i].name, locks[i].acquisitions, locks[i].contentions,
+                locks[i].wait_total_us, locks[i].hold_total_us);
+    fprintf(out, "]}");
+
+    for (i = 0; i < nthreads; i++) {
+        if (!shared)
+            rmdir(ctx[i].dir);
+        free(ctx[i].ns);
+    }
+    free(all);
+    free(ctx);
+}
+
+int main(int argc, char *argv[]) {
+    char base[PATH_MAX];
+    const char *output = NULL;
+    FILE *out = stdout;
+    int max_threads = 32, iterations = 64, opt, n, shared, first = 1;
+
+    while ((opt = getopt(argc, argv, "t:i:o:")) != -1) {
+        switch (opt) {
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'i':
+            iterations = atoi(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (optind != argc - 1 || max_threads < 1 || iterations < 1)
+        goto usage;
+
+    //Ni un directorio compartido ni el directorio base admiten mas hijos
+    if (max_threads > DIR_CAPACITY) {
+        fprintf(stderr, "assoofs directories hold %d entries, limiting the run to %d threads.\n", DIR_CAPACITY, DIR_CAPACITY);
+        max_threads = DIR_CAPACITY;
+    }
+
+    if (snprintf(base, sizeof(base), "%s/%s", argv[optind], STRESS_DIR) >= sizeof(base))
+        goto usage;
+    if (mkdir(base, 0755) && errno != EEXIST) {
+        perror(base);
+        return 1;
+    }
+
+    if (output && !(out = fopen(output, "w"))) {
+        perror(output);
+        return 1;
+    }
+
+    fprintf(out, "{\n  \"filesystem\": \"assoofs\",\n  \"iterations\": %d,\n  \"lock_stat\": %s,\n  \"runs\": [\n",
+            iterations, access(LOCK_STAT, R_OK) ? "false" : "true");
+
+    for (shared = 1; shared >= 0; shared--) {
+        for (n = 1; n <= max_threads; n = n < max_threads && n * 2 > max_threads ? max_threads : n * 2) {
+            run(out, base, shared, n, iterations, first);
+            first = 0;
+            if (n == max_threads)
+                break;
+        }
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout)
+        fclose(out);
+    rmdir(base);
+    return 0;
+
+usage:
+    printf("Usage: assoofs-stress [-t threads] [-i iterations] [-o output.json] <mountpoint>\n");
+    return 1;
+}
@@ -4,19 +4,31 @@
 #include <linux/fs.h>           /* libfs stuff           */
 #include <linux/buffer_head.h>  /* buffer_head           */
 #include <linux/slab.h>         /* kmem_cache            */
+#include <linux/debugfs.h>      /* estadisticas          */
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/percpu_counter.h>
+#include <linux/statfs.h>
+#include <linux/mpage.h>         /* writepages por lotes  */
+#include <linux/blkdev.h>
+#include <linux/bio.h>         /* copia del superbloque en commit */
+#include <linux/uio.h>
+#include <linux/writeback.h>
+#include <linux/hashtable.h>     /* cache de nombres      */
+#include <linux/rculist.h>
+#include <linux/stringhash.h>
+#include <linux/shrinker.h>
+#include <linux/parser.h>        /* opciones de montaje   */
+#include <linux/workqueue.h>
 #include "assoofs.h"
 
+#define CREATE_TRACE_POINTS
+#include "assoofs_trace.h"
+
 //Configuramos unas macros para la licencia 
 #define DRIVER_AUTHOR "Angel Lopez Arias"
 #define DRIVER_DESC   "An assoofs sample"
 
-//Voy a configurar algunas variables para hacer printf con algun color, para que las trazas queden mas visuales
-#define RC  "\x1b[0m"		//Reset color
-#define R 	"\x1b[31m"		//Red
-#define G   "\x1b[32m"		//Green
-#define Y	"\x1b[33m"		//Yellow
-#define B   "\x1b[34m"		//Blue
-
 //Configuramos unos mutex para proteger el acceso al superbloque y al almacen de inodos
 static DEFINE_MUTEX(assoofs_sb_lock);
 static DEFINE_MUTEX(assoofs_inodes_block_lock);
@@ -24,979 +36,4002 @@ static DEFINE_MUTEX(assoofs_inodes_block_lock);
 //Vamos a configurar una chache de inodos como variable global
 static struct kmem_cache *assoofs_inode_cache;
 
+//Directorio /sys/kernel/debug/assoofs, con un subdirectorio por montaje
+static struct dentry *assoofs_debugfs_root;
+
+//Bloques contiguos que cada CPU se reserva de una vez del mapa de bits
+#define ASSOOFS_RESERVE_WINDOW 4
+
+//Ventana de bloques reservados de una CPU (ver assoofs_sb_get_a_freeblock)
+struct assoofs_block_window {
+    spinlock_t lock;
+    uint64_t free;                  //Bloques reservados sin usar (bit = 1), fuera ya del mapa de bits
+};
+
+//Modo log: bloques que se preasignan como mucho a un fichero abierto que escribe al final
+#define ASSOOFS_PREALLOC_MAX 8
+
+//Preasignacion especulativa de un fichero abierto en modo log (file->private_data, ver assoofs_log_prealloc)
+struct assoofs_prealloc {
+    struct list_head list;          //En fsi->prealloc, para recuperar los bloques si se acaba el espacio
+    uint64_t blocks;                //Bloques reservados sin usar (bit = 1), fuera ya del mapa de bits
+    unsigned int window;            //Bloques de la siguiente reserva: se dobla en cada una hasta ASSOOFS_PREALLOC_MAX
+};
+
+//commit=N: segundos como mucho entre un cambio de metadatos y su escritura (0 = sincrono, por defecto)
+#define ASSOOFS_MAX_COMMIT_INTERVAL 300
+
+//discard: tiempo que se juntan los bloques liberados antes de descartarlos en un solo lote
+#define ASSOOFS_DISCARD_DELAY (HZ / 2)
+
+//Cache de nombres: cubos de la tabla hash y directorios posibles (inodos 1..64)
+#define ASSOOFS_DCACHE_BITS 6
+#define ASSOOFS_DCACHE_DIRS (ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED + 1)
+
+//Filtro de Bloom de cada directorio: 256 bits y 3 bits por nombre (un 0,4% de falsos positivos con 15 entradas)
+#define ASSOOFS_BLOOM_BITS 256
+#define ASSOOFS_BLOOM_HASHES 3
+
+/**************************************************************
+* Informacion de cada montaje (sb->s_fs_info)
+*
+* El bloque del superbloque se lee una vez al montar y se
+* mantiene en memoria hasta desmontar: sb_info apunta a sus
+* datos, de modo que guardar el superbloque es solo marcar
+* sb_bh como sucio y sincronizarlo.
+*
+* Los contadores se consultan en
+* /sys/kernel/debug/assoofs/<dispositivo>/stats
+*
+* Los bloques e inodos libres se llevan en contadores por CPU:
+* reservar y liberar no toca ningun cerrojo compartido para
+* actualizarlos y statfs los suma sin pasar por assoofs_sb_lock.
+* En cada sync se vuelcan a free_blocks_count/free_inodes_count.
+*
+* Los bloques de las ventanas por CPU y de las preasignaciones
+* del modo log cuentan como libres hasta que se usan; sync_fs y
+* put_super los devuelven al mapa de bits.
+*
+* Con commit=N los bloques de metadatos (superbloque, almacen de
+* inodos, directorios) solo se marcan sucios y commit_work los
+* escribe todos juntos como mucho N segundos despues. Al ser
+* buffers del dispositivo, el writeback del kernel tambien los
+* escribe antes si hay presion de memoria.
+*
+* Con discard los bloques liberados se apuntan en discard_pending
+* y discard_work los descarta juntos. Mientras se descartan estan
+* en discard_busy: siguen libres en el mapa, pero no se reservan.
+***************************************************************/
+struct assoofs_fs_info {
+    struct super_block *sb;
+    struct assoofs_super_block_info *sb_info;
+    struct buffer_head *sb_bh;
+    struct dentry *debugfs;
+    unsigned int commit_interval;   //Segundos de commit=N, 0 si cada cambio se escribe en el momento
+    struct delayed_work commit_work;
+    bool log_mode;                  //Opcion log: los datos se escriben fuera de sitio, en orden (ver assoofs_log_relocate)
+    unsigned int snapshot;          //Opcion snapshot=N: instantanea montada (solo lectura), 0 = sistema vivo
+    uint64_t inode_store;           //Bloque del almacen de inodos que se lee: el 1 o la copia de la instantanea
+    bool discard;                   //Opcion discard: los bloques liberados se descartan en el dispositivo
+    struct delayed_work discard_work;
+    uint64_t discard_pending;       //Liberados desde el ultimo lote (con assoofs_sb_lock)
+    uint64_t discard_busy;          //Descartandose ahora mismo (con assoofs_sb_lock)
+    struct assoofs_packed_inode *packed;    //Tabla de inodos de una imagen empaquetada (solo lectura), NULL si no lo es
+
+    atomic64_t bread;               //Bloques leidos con sb_bread
+    atomic64_t sync_writes;         //Bloques escritos de forma sincrona
+    atomic64_t lookup_hit;
+    atomic64_t lookup_miss;
+    atomic64_t allocs;              //Bloques reservados del mapa de bits
+    atomic64_t frees;               //Bloques devueltos al mapa de bits
+    atomic64_t lock_wait_ns;        //Tiempo esperando por los mutex
+    atomic64_t writepages;          //Lotes de paginas sucias llevados a disco
+    atomic64_t delayed_writes;      //Bloques de metadatos dejados sucios para el commit
+    atomic64_t commits;             //Commits periodicos hechos
+    atomic64_t log_commits;         //Bloques del log confirmados en el almacen de inodos
+    atomic64_t discards;            //Peticiones de discard enviadas al dispositivo
+    atomic64_t discarded_blocks;
+
+    struct percpu_counter free_blocks;
+    struct percpu_counter free_inodes;
+    struct assoofs_block_window __percpu *windows;
+
+    //Cache de nombres de los directorios (ver assoofs_dcache_lookup)
+    spinlock_t dcache_lock;
+    DECLARE_HASHTABLE(dcache, ASSOOFS_DCACHE_BITS);
+    DECLARE_BITMAP(dcache_dirs, ASSOOFS_DCACHE_DIRS);
+    atomic_long_t dcache_count;
+    struct shrinker dcache_shrinker;
+
+    //Filtros de Bloom de los nombres de cada directorio (ver assoofs_bloom_miss)
+    DECLARE_BITMAP(bloom_valid, ASSOOFS_DCACHE_DIRS);
+    unsigned long bloom[ASSOOFS_DCACHE_DIRS][BITS_TO_LONGS(ASSOOFS_BLOOM_BITS)];
+
+    //Modo log: cabeza del log y bloque nuevo de cada inodo aun sin confirmar en el almacen (0 = ninguno)
+    spinlock_t log_lock;
+    uint64_t log_head;
+    uint64_t log_pending[ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED + 1];
+
+    //Preasignaciones de los ficheros abiertos en modo log (con prealloc_lock)
+    spinlock_t prealloc_lock;
+    struct list_head prealloc;
+    atomic64_t prealloc_hits;       //Bloques del log sacados de una preasignacion
+};
+
+static inline struct assoofs_fs_info *ASSOOFS_FS(struct super_block *sb) {
+    return sb->s_fs_info;
+}
+
+static inline struct assoofs_super_block_info *ASSOOFS_SB(struct super_block *sb) {
+    return ASSOOFS_FS(sb)->sb_info;
+}
+
+//Bloques libres que se pueden reservar: ni el superbloque ni el almacen, ni los que se estan descartando. Con assoofs_sb_lock
+static inline uint64_t assoofs_allocatable(struct super_block *sb) {
+    return ASSOOFS_SB(sb)->free_blocks & ~((1ULL << ASSOOFS_ROOTDIR_BLOCK_NUMBER) - 1) & ~ASSOOFS_FS(sb)->discard_busy;
+}
+
+//Los libres del grupo goal o, si no tiene ninguno, los del siguiente grupo que tenga alguno (dando la vuelta)
+static inline uint64_t assoofs_group_free(uint64_t free, unsigned int goal) {
+    unsigned int i, g;
+
+    for (i = 0; i < ASSOOFS_GROUPS; i++) {
+        g = (goal + i) % ASSOOFS_GROUPS;
+        if (free & ASSOOFS_GROUP_MASK(g))
+            return free & ASSOOFS_GROUP_MASK(g);
+    }
+    return 0;
+}
+
+//Bloques de 4096 bytes que caben en el dispositivo ahora mismo (puede haber crecido despues de montarlo)
+static uint64_t assoofs_device_blocks(struct super_block *sb) {
+    return div_u64(i_size_read(sb->s_bdev->bd_inode), ASSOOFS_DEFAULT_BLOCK_SIZE);
+}
+
+//Lectura de un bloque contabilizada
+static struct buffer_head *assoofs_bread(struct super_block *sb, sector_t block) {
+    atomic64_inc(&ASSOOFS_FS(sb)->bread);
+    return sb_bread(sb, block);
+}
+
+//Escritura de un bloque de metadatos contabilizada: sincrona, o con commit=N queda para commit_work
+static void assoofs_sync_buffer(struct super_block *sb, struct buffer_head *bh) {
+    struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+    unsigned int interval = READ_ONCE(fsi->commit_interval);
+
+    mark_buffer_dirty(bh);
+    if (interval) {
+        atomic64_inc(&fsi->delayed_writes);
+        schedule_delayed_work(&fsi->commit_work, interval * HZ);   //No hace nada si ya hay uno pendiente
+        return;
+    }
+    sync_dirty_buffer(bh);
+    atomic64_inc(&ASSOOFS_FS(sb)->sync_writes);
+    trace_assoofs_sync_write(sb, bh->b_blocknr);
+}
+
+//Toma un mutex y, si estaba ocupado, suma el tiempo de espera
+static void assoofs_lock(struct super_block *sb, struct mutex *lock) {
+    ktime_t start;
+
+    if (mutex_trylock(lock))
+        return;
+
+    start = ktime_get();
+    mutex_lock(lock);
+    atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)), &ASSOOFS_FS(sb)->lock_wait_ns);
+}
+
+/*
+ * Commit periodico: todos los bloques sucios del dispositivo de una
+ * vez. Del superbloque se saca una copia con assoofs_sb_lock, para
+ * que no se escriba a medio cambiar, y se escribe ya sin el cerrojo;
+ * el resto se lleva a disco con sync_blockdev, tambien sin el. Asi
+ * las reservas de los demas montajes no esperan a este dispositivo.
+ */
+static void assoofs_commit(struct work_struct *work) {
+    struct assoofs_fs_info *fsi = container_of(to_delayed_work(work), struct assoofs_fs_info, commit_work);
+    struct super_block *sb = fsi->sb;
+    struct page *page = alloc_page(GFP_NOFS);
+    struct bio *bio;
+    bool dirty = false;
+    int ret = 0;
+
+    if (page) {
+        assoofs_lock(sb, &assoofs_sb_lock);
+        dirty = test_clear_buffer_dirty(fsi->sb_bh);
+        if (dirty)
+            memcpy(page_address(page), fsi->sb_bh->b_data, ASSOOFS_DEFAULT_BLOCK_SIZE);
+        mutex_unlock(&assoofs_sb_lock);
+    }
+
+    if (dirty) {
+        bio = bio_alloc(GFP_NOFS, 1);
+        bio_set_dev(bio, sb->s_bdev);
+        bio->bi_iter.bi_sector = fsi->sb_bh->b_blocknr * (ASSOOFS_DEFAULT_BLOCK_SIZE >> 9);
+        bio->bi_opf = REQ_OP_WRITE | REQ_SYNC;
+        bio_add_page(bio, page, ASSOOFS_DEFAULT_BLOCK_SIZE, 0);
+        ret = submit_bio_wait(bio);
+        bio_put(bio);
+        if (ret)
+            mark_buffer_dirty(fsi->sb_bh);      //Que lo intente el siguiente commit o el writeback
+    }
+    if (page)
+        __free_page(page);
+
+    //Sin pagina para la copia el superbloque sigue sucio y va con el resto
+    if (!ret)
+        ret = sync_blockdev(sb->s_bdev);
+
+    atomic64_inc(&fsi->commits);
+    trace_assoofs_commit(fsi->sb, atomic64_read(&fsi->delayed_writes), ret);
+}
+
+/**************************************************************
+* Cache de nombres de los directorios
+*
+* La primera vez que se busca en un directorio se leen todas sus
+* entradas vivas a una tabla hash del montaje: nombre -> (inodo,
+* posicion de la entrada en el bloque). A partir de ahi lookup
+* responde desde la tabla bajo RCU, sin leer el bloque y sin
+* cerrojos, tanto si el nombre esta como si no.
+*
+* dcache_dirs marca los directorios que estan completos en la
+* tabla: solo para ellos un nombre ausente es un fallo seguro.
+* create, mkdir, unlink, rmdir y rename la mantienen al dia (el
+* VFS ya les da el directorio en exclusiva) y dcache_lock ordena
+* a quienes la modifican entre si y con el shrinker, que bajo
+* presion de memoria tira directorios completos.
+*
+* Cada directorio leido tiene ademas un filtro de Bloom con sus
+* nombres, que el shrinker no tira (son 32 bytes): aunque el
+* directorio ya no este en la tabla, un nombre que no esta en el
+* filtro es un fallo seguro sin leer el bloque. Borrar no quita
+* bits; el filtro se rehace entero cada vez que se lee el bloque.
+***************************************************************/
+struct assoofs_dcache_entry {
+    struct hlist_node node;
+    struct rcu_head rcu;
+    uint64_t dir;                   //Inodo del directorio
+    uint64_t ino;                   //Inodo al que apunta la entrada
+    unsigned int slot;              //Posicion de la entrada en el bloque del directorio
+    u32 hash;
+    char name[];
+};
+
+//Posicion de una entrada dentro del bloque de su directorio
+#define ASSOOFS_RECORD_SLOT(bh, record) ((unsigned int)((record) - (struct assoofs_dir_record_entry *)(bh)->b_data))
+
+static inline u32 assoofs_dcache_hash(uint64_t dir, const char *name) {
+    return full_name_hash((void *)(unsigned long)dir, name, strlen(name));
+}
+
+//Los bits del filtro salen de trozos de 8 bits del hash del nombre
+static inline unsigned int assoofs_bloom_bit(u32 hash, int i) {
+    return (hash >> (8 * i)) & (ASSOOFS_BLOOM_BITS - 1);
+}
+
+static void assoofs_bloom_add(unsigned long *bloom, u32 hash) {
+    int i;
+
+    for (i = 0; i < ASSOOFS_BLOOM_HASHES; i++)
+        set_bit(assoofs_bloom_bit(hash, i), bloom);
+}
+
+//Fallo seguro: el filtro del directorio es valido y al nombre le falta alguno de sus bits
+static bool assoofs_bloom_miss(struct super_block *sb, uint64_t dir, const char *name) {
+    struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+    u32 hash = assoofs_dcache_hash(dir, name);
+    int i;
+
+    if (!test_bit(dir, fsi->bloom_valid))
+        return false;
+    smp_rmb();
+    for (i = 0; i < ASSOOFS_BLOOM_HASHES; i++)
+        if (!test_bit(assoofs_bloom_bit(hash, i), fsi->bloom[dir]))
+            return true;
+    return false;
+}
+
+static struct assoofs_dcache_entry *assoofs_dcache_alloc(uint64_t dir, const char *name, uint64_t ino, unsigned int slot) {
+    struct assoofs_dcache_entry *entry = kmalloc(sizeof(*entry) + strlen(name) + 1, GFP_KERNEL);
+
+    if (!entry)
+        return NULL;
+    entry->dir = dir;
+    entry->ino = ino;
+    entry->slot = slot;
+    entry->hash = assoofs_dcache_hash(dir, name);
+    strcpy(entry->name, name);
+    return entry;
+}
+
+//Busca sin cerrojos: 1 si esta, 0 si seguro que no esta, -1 si el directorio no esta en la cache
+static int assoofs_dcache_lookup(struct super_block *sb, uint64_t dir, const char *name, uint64_t *ino, unsigned int *slot) {
+    struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+    struct assoofs_dcache_entry *entry;
+    u32 hash = assoofs_dcache_hash(dir, name);
+    int ret = -1;
+
+    rcu_read_lock();
+    if (test_bit(dir, fsi->dcache_dirs)) {
+        hash_for_each_possible_rcu(fsi->dcache, entry, node, hash) {
+            if (entry->dir == dir && entry->hash == hash && !strcmp(entry->name, name)) {
+                *ino = entry->ino;
+                *slot = entry->slot;
+                ret = 1;
+                break;
+            }
+        }
+        //El shrinker desmarca el directorio antes de tirar sus entradas
+        smp_rmb();
+        if (ret < 0 && test_bit(dir, fsi->dcache_dirs))
+            ret = 0;
+    }
+    rcu_read_unlock();
+    return ret;
+}
+
+//Quita de la tabla las entradas de un directorio. Con dcache_lock tomado
+static unsigned long assoofs_dcache_drop_dir(struct assoofs_fs_info *fsi, uint64_t dir) {
+    struct assoofs_dcache_entry *entry;
+    struct hlist_node *tmp;
+    unsigned long dropped = 0;
+    int bkt;
+
+    clear_bit(dir, fsi->dcache_dirs);
+    smp_mb__after_atomic();
+
+    hash_for_each_safe(fsi->dcache, bkt, tmp, entry, node) {
+        if (entry->dir != dir)
+            continue;
+        hash_del_rcu(&entry->node);
+        kfree_rcu(entry, rcu);
+        dropped++;
+    }
+    atomic_long_sub(dropped, &fsi->dcache_count);
+    return dropped;
+}
+
+//El directorio se ha borrado: fuera sus entradas y su filtro, su numero de inodo se reutilizara
+static void assoofs_dcache_forget_dir(struct super_block *sb, uint64_t dir) {
+    struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+
+    spin_lock(&fsi->dcache_lock);
+    assoofs_dcache_drop_dir(fsi, dir);
+    clear_bit(dir, fsi->bloom_valid);
+    spin_unlock(&fsi->dcache_lock);
+}
+
+//Carga todas las entradas vivas del bloque de un directorio. Si falta memoria se queda fuera de la cache
+static void assoofs_dcache_fill(struct super_block *sb, struct assoofs_inode_info *dir_info, struct buffer_head *bh) {
+    struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+    struct assoofs_dir_record_entry *first = (struct assoofs_dir_record_entry *)bh->b_data;
+    struct assoofs_dir_record_entry *record, *end = first + ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(*first);
+    struct assoofs_dcache_entry *entry;
+    struct hlist_node *tmp;
+    HLIST_HEAD(entries);
+    DECLARE_BITMAP(bloom, ASSOOFS_BLOOM_BITS);
+    uint64_t alive = 0;
+    bool complete = true;
+    int i;
+
+    bitmap_zero(bloom, ASSOOFS_BLOOM_BITS);
+    for (record = first; record < end && alive < dir_info->dir_children_count; record++) {
+        if (record->state_flag != ASSOOFS_STATE_ALIVE)
+            continue;
+        alive++;
+        assoofs_bloom_add(bloom, assoofs_dcache_hash(dir_info->inode_no, record->filename));
+        if (!complete)
+            continue;
+        entry = assoofs_dcache_alloc(dir_info->inode_no, record->filename, record->inode_no, record - first);
+        if (entry)
+            hlist_add_head(&entry->node, &entries);
+        else
+            complete = false;
+    }
+
+    spin_lock(&fsi->dcache_lock);
+
+    //El filtro nuevo contiene los mismos nombres vivos que el anterior: cambiarlo palabra a palabra no da falsos fallos
+    for (i = 0; i < BITS_TO_LONGS(ASSOOFS_BLOOM_BITS); i++)
+        WRITE_ONCE(fsi->bloom[dir_info->inode_no][i], bloom[i]);
+    smp_wmb();
+    set_bit(dir_info->inode_no, fsi->bloom_valid);
+
+    if (complete && !test_bit(dir_info->inode_no, fsi->dcache_dirs)) {
+        hlist_for_each_entry_safe(entry, tmp, &entries, node) {
+            hlist_del(&entry->node);
+            hash_add_rcu(fsi->dcache, &entry->node, entry->hash);
+        }
+        atomic_long_add(alive, &fsi->dcache_count);
+        smp_wmb();
+        set_bit(dir_info->inode_no, fsi->dcache_dirs);
+    }
+    spin_unlock(&fsi->dcache_lock);
+
+    //Lo que no ha entrado en la tabla (otra busqueda la lleno antes, o falto memoria)
+    hlist_for_each_entry_safe(entry, tmp, &entries, node)
+        kfree(entry);
+}
+
+//Nueva entrada en un directorio que esta en la cache y en su filtro
+static void assoofs_dcache_add(struct super_block *sb, uint64_t dir, const char *name, uint64_t ino, unsigned int slot) {
+    struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+    struct assoofs_dcache_entry *entry;
+
+    //El filtro se mantiene aunque el directorio no este en la tabla
+    if (test_bit(dir, fsi->bloom_valid))
+        assoofs_bloom_add(fsi->bloom[dir], assoofs_dcache_hash(dir, name));
+
+    if (!test_bit(dir, fsi->dcache_dirs))
+        return;
+
+    entry = assoofs_dcache_alloc(dir, name, ino, slot);
+    if (!entry) {
+        //Sin la entrada el directorio ya no esta completo
+        spin_lock(&fsi->dcache_lock);
+        assoofs_dcache_drop_dir(fsi, dir);
+        spin_unlock(&fsi->dcache_lock);
+        return;
+    }
+
+    spin_lock(&fsi->dcache_lock);
+    if (test_bit(dir, fsi->dcache_dirs)) {
+        hash_add_rcu(fsi->dcache, &entry->node, entry->hash);
+        atomic_long_inc(&fsi->dcache_count);
+        entry = NULL;
+    }
+    spin_unlock(&fsi->dcache_lock);
+    kfree(entry);
+}
+
+static void assoofs_dcache_remove(struct super_block *sb, uint64_t dir, const char *name) {
+    struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+    struct assoofs_dcache_entry *entry;
+    u32 hash = assoofs_dcache_hash(dir, name);
+
+    spin_lock(&fsi->dcache_lock);
+    hash_for_each_possible(fsi->dcache, entry, node, hash) {
+        if (entry->dir == dir && entry->hash == hash && !strcmp(entry->name, name)) {
+            hash_del_rcu(&entry->node);
+            kfree_rcu(entry, rcu);
+            atomic_long_dec(&fsi->dcache_count);
+            break;
+        }
+    }
+    spin_unlock(&fsi->dcache_lock);
+}
+
+//Shrinker: cuantas entradas se podrian liberar
+static unsigned long assoofs_dcache_count(struct shrinker *shrink, struct shrink_control *sc) {
+    struct assoofs_fs_info *fsi = container_of(shrink, struct assoofs_fs_info, dcache_shrinker);
+
+    return atomic_long_read(&fsi->dcache_count);
+}
+
+//Shrinker: tira directorios completos hasta liberar nr_to_scan entradas
+static unsigned long assoofs_dcache_scan(struct shrinker *shrink, struct shrink_control *sc) {
+    struct assoofs_fs_info *fsi = container_of(shrink, struct assoofs_fs_info, dcache_shrinker);
+    unsigned long freed = 0;
+    unsigned long dir;
+
+    spin_lock(&fsi->dcache_lock);
+    for_each_set_bit(dir, fsi->dcache_dirs, ASSOOFS_DCACHE_DIRS) {
+        if (freed >= sc->nr_to_scan)
+            break;
+        freed += assoofs_dcache_drop_dir(fsi, dir);
+    }
+    spin_unlock(&fsi->dcache_lock);
+
+    return freed ? freed : SHRINK_STOP;
+}
+
 /* ++++++++++++++++++++++++++++++++++++++++++++ /
  *       DECLARACION FUNCIONES                 *
 / ++++++++++++++++++++++++++++++++++++++++++++ */
 static struct inode *assoofs_get_inode(struct super_block *sb, int ino);
 struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no);
-int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block);
-void assoofs_save_sb_info(struct super_block *vsb);
+int assoofs_sb_get_a_freeblock(struct super_block *sb, unsigned int goal, uint64_t *block);
+static int assoofs_log_get_a_freeblock(struct super_block *sb, uint64_t *block);
+static int assoofs_log_reserve(struct super_block *sb, unsigned int want, uint64_t *run);
+static int assoofs_log_prealloc(struct inode *inode, struct file *file, loff_t pos, uint64_t *block);
+void assoofs_save_sb_info(struct super_block *sb);
 void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode);
 int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info);
 struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *start, struct assoofs_inode_info *search);
+static void assoofs_usage_of(struct assoofs_inode_info *inode_info, int64_t *bytes, int64_t *inodes);
+static void assoofs_usage_update(struct dentry *dentry, int64_t bytes, int64_t inodes);
 
 /* =========================================================== *
  *  OPERACIONES SOBRE FICHEROS DEL SO    
  * =========================================================== */
-ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos);
-ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos);
+/*
+ * Los datos de los ficheros pasan por la cache de paginas: read y
+ * write son los genericos del VFS y solo hay que decirle en que
+ * bloque esta cada pagina (assoofs_get_block). La escritura a
+ * disco la hace assoofs_writepages por lotes, no cada write.
+ */
+static ssize_t assoofs_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t assoofs_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static loff_t assoofs_remap_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, loff_t len, unsigned int remap_flags);
+static ssize_t assoofs_copy_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, size_t len, unsigned int flags);
+static int assoofs_unshare_block(struct inode *inode);
+static int assoofs_log_relocate(struct inode *inode, struct file *file, loff_t pos, struct buffer_head *bh);
+static int assoofs_log_commit(struct inode *inode);
+static int assoofs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+static long assoofs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static int assoofs_release_file(struct inode *inode, struct file *file);
 const struct file_operations assoofs_file_operations = {
-    .read = assoofs_read,
-    .write = assoofs_write,
+    .llseek = generic_file_llseek,
+    .read_iter = assoofs_read_iter,
+    .write_iter = assoofs_write_iter,
+    .mmap = generic_file_readonly_mmap,     //Sin page_mkwrite no habria copia en escritura para los reflink
+    .splice_read = generic_file_splice_read,
+    .fsync = assoofs_fsync,
+    .remap_file_range = assoofs_remap_file_range,
+    .copy_file_range = assoofs_copy_file_range,
+    .unlocked_ioctl = assoofs_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .release = assoofs_release_file,
 };
 
 /* =========================================================== *
- *  OPERACION SOBRE FICHEROS --> READ    
+ *  OPERACIONES SOBRE LA CACHE DE PAGINAS (ADDRESS_SPACE)
  * =========================================================== */
-ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos) {
-    
-    /* ++++++++++++++++++++++++++++++++++++++++++++ /
-     *     DECLARACION DE VARIABLES                * 
-    / ++++++++++++++++++++++++++++++++++++++++++++ */
-    struct assoofs_inode_info *inode_info;
-    struct buffer_head *bh;
-	char *buffer;
-	int nbytes;
+static int assoofs_readpage(struct file *file, struct page *page);
+static int assoofs_writepage(struct page *page, struct writeback_control *wbc);
+static int assoofs_writepages(struct address_space *mapping, struct writeback_control *wbc);
+static int assoofs_write_begin(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, unsigned flags, struct page **pagep, void **fsdata);
+static sector_t assoofs_bmap(struct address_space *mapping, sector_t block);
+static const struct address_space_operations assoofs_aops = {
+    .readpage = assoofs_readpage,
+    .writepage = assoofs_writepage,
+    .writepages = assoofs_writepages,
+    .write_begin = assoofs_write_begin,
+    .write_end = generic_write_end,
+    .bmap = assoofs_bmap,
+};
+
+/* =========================================================== *
+ *  CORRESPONDENCIA ENTRE BLOQUE DEL FICHERO Y BLOQUE DEL DISCO
+ * =========================================================== */
+/*
+ * Cada fichero tiene un unico bloque de datos, reservado al crearlo,
+ * asi que solo existe el bloque 0. Mas alla no hay nada que leer y
+ * no se puede crear nada (s_maxbytes ya lo impide en los write).
+ */
+static int assoofs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	struct assoofs_fs_info *fsi = ASSOOFS_FS(inode->i_sb);
+	uint64_t block;
 
-	//IMPRESION DE LA TRAZA CORRESPONDIENTE AL USO DE ESTA FUNCION
-	printk(KERN_INFO B "Read request" RC "\n");
 
     /* ++++++++++++++++++++++++++++++++++++++++++++ /
      *      PROCECEMOS CON EL DESARROLLO           * 
-    / ++++++++++++++++++++++++++++++++++++++++++++ */	
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
 
-	//obtenemos la informacion persistente del nodo
-    inode_info = filp->f_path.dentry->d_inode->i_private; 
+	if(iblock > 0){
+		return create ? -EFBIG : 0;
+	}
 
-    //Para comprobar si hemos o no llegado al final del fichero
-    if (*ppos >= inode_info->file_size){
-    	printk(KERN_INFO R "READ: EOF reached" RC "\n");
-    	return 0;   
-    }
+	//En modo log los datos van al bloque nuevo en cuanto lo hay, aunque el almacen aun no lo sepa
+	block = READ_ONCE(fsi->log_pending[inode->i_ino]);
+	map_bh(bh_result, inode->i_sb, block ? block : inode_info->data_block_number);
+	return 0;
+}
+
+static int assoofs_readpage(struct file *file, struct page *page){
+	return mpage_readpage(page, assoofs_get_block);
+}
+
+static int assoofs_writepage(struct page *page, struct writeback_control *wbc){
+	return block_write_full_page(page, assoofs_get_block, wbc);
+}
 
-    //Leemos del disco la información que nos han pedido
-    bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
-    //copiamos en buf el contenido del fichero que hemos leido
-	buffer = (char *)bh->b_data;
+static int assoofs_write_begin(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, unsigned flags, struct page **pagep, void **fsdata){
+	int ret = block_write_begin(mapping, pos, len, flags, pagep, assoofs_get_block);
 
-	// Hay que comparar len con el tamanio del fichero por si llegamos al final del fichero
-	nbytes = min((size_t) inode_info->file_size, len); 
-	printk(KERN_INFO Y "TEXT READ: %s" RC "\n", buffer);
-	copy_to_user(buf, buffer, nbytes);
+	//Modo log: la pagina ya tiene los datos de su bloque; se escribira en el siguiente bloque del log
+	if(!ret && ASSOOFS_FS(mapping->host->i_sb)->log_mode){
+		ret = assoofs_log_relocate(mapping->host, file, pos, page_buffers(*pagep));
+		if(ret){
+			unlock_page(*pagep);
+			put_page(*pagep);
+			*pagep = NULL;
+		}
+	}
+	return ret;
+}
 
-	*ppos += nbytes;		//incrementamos ppos
-	brelse(bh);				//liberamos memoria del bufferhead
-	printk(KERN_INFO Y "BYTES READ: %d" RC "\n", nbytes);		//imprimios una traza de lectura
-	printk(KERN_INFO "\n");
-	return nbytes;			//devolvemos el numero de bytes leidos
+static sector_t assoofs_bmap(struct address_space *mapping, sector_t block){
+	return generic_block_bmap(mapping, block, assoofs_get_block);
 }
 
 /* =========================================================== *
- *  OPERACION SOBRE FICHEROS --> WRITE   
+ *  ESCRITURA A DISCO DE LAS PAGINAS SUCIAS DE UN FICHERO
  * =========================================================== */
-ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos) {
-    
-    /* ++++++++++++++++++++++++++++++++++++++++++++ /
-     *     DECLARACION DE VARIABLES                * 
-    / ++++++++++++++++++++++++++++++++++++++++++++ */
-    struct assoofs_inode_info *inode_info;
-    struct buffer_head *bh;
-	char *buffer;
-	struct super_block *sb;
+/*
+ * mpage_writepages recorre las paginas sucias en orden, las traduce
+ * a bloques con assoofs_get_block y junta las que son contiguas en
+ * disco en un mismo bio (hasta lo que admita el dispositivo). El
+ * plug alrededor de todo el lote deja que el planificador fusione
+ * tambien los bios de varias llamadas antes de mandarlos.
+ */
+static int assoofs_writepages(struct address_space *mapping, struct writeback_control *wbc){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct inode *inode = mapping->host;
+	long nr_to_write = wbc->nr_to_write;
+	struct blk_plug plug;
+	int ret;
 
-	//IMPRESION DE LA TRAZA CORRESPONDIENTE AL USO DE ESTA FUNCION
-	printk(KERN_INFO B "Write request" RC "\n");
 
     /* ++++++++++++++++++++++++++++++++++++++++++++ /
      *      PROCECEMOS CON EL DESARROLLO           * 
     / ++++++++++++++++++++++++++++++++++++++++++++ */
 
-	//mediante el file flip accedemos a la informacion del superbloque
-	sb = filp->f_path.dentry->d_inode->i_sb;
-
-	//obtenemos la informacion persistente del nodo
-    inode_info = filp->f_path.dentry->d_inode->i_private;
+	blk_start_plug(&plug);
+	ret = mpage_writepages(mapping, wbc, assoofs_get_block);
+	blk_finish_plug(&plug);
 
-    //leemos informacion del superbloque
-	bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
-
-    //Copiamos en disco la información que nos han dado
-    buffer = (char *)bh->b_data;
-    buffer += *ppos;
-	if(copy_from_user(buffer, buf, len)){
-		brelse(bh);
-		printk(KERN_ERR "Error copying file contents from the userspace buffer to the kernel");
-		return -1;
+	//Modo log: con los datos ya en el bloque nuevo, el almacen de inodos pasa a apuntarlo
+	if(!ret && ASSOOFS_FS(inode->i_sb)->log_mode){
+		ret = assoofs_log_commit(inode);
 	}
 
-	printk(KERN_INFO Y "TEXT WRITTEN: %s" RC "\n", buffer);
-	printk(KERN_INFO Y "BYTES WRITTEN: %ld" RC "\n", len);		//imprimios una traza de lectura
-
-	*ppos+=len; //actualizamos el puntero ppos
-
-	mark_buffer_dirty(bh);		//LO MARCAMOS COMO SUCIO
-	sync_dirty_buffer(bh);		//SINCRONIZAMOS
-	brelse(bh);					//liberamos memoria del bufferhead
-
-	//-----------------------  MUTEX DEL ALMACEN DE INODOS  -------------------------//
-    mutex_lock_interruptible(&assoofs_inodes_block_lock);
-
-	inode_info->file_size = *ppos;				//actualizamos la informacion del tamaño
-	assoofs_save_inode_info(sb, inode_info);	//guardamos la informacion del inodo en disco
-	
-	mutex_unlock(&assoofs_inodes_block_lock);
-	printk(KERN_INFO "\n");
-	return len;									//devolvemos el numero de bytes que hemos escrit0
+	atomic64_inc(&ASSOOFS_FS(inode->i_sb)->writepages);
+	trace_assoofs_writepages(inode, nr_to_write - wbc->nr_to_write, ret);
+	return ret;
 }
 
 /* =========================================================== *
- *  OPERACIONES SOBRE DIRECTORIOS   
+ *  OPERACION SOBRE FICHEROS --> READ    
  * =========================================================== */
-static int assoofs_iterate(struct file *filp, struct dir_context *ctx);
-const struct file_operations assoofs_dir_operations = {
-    .owner = THIS_MODULE,
-    .iterate = assoofs_iterate,
-};
+static ssize_t assoofs_read_iter(struct kiocb *iocb, struct iov_iter *to){
+	trace_assoofs_read(file_inode(iocb->ki_filp), iocb->ki_pos, iov_iter_count(to));
+	return generic_file_read_iter(iocb, to);
+}
 
 /* =========================================================== *
- *  OPERACION DIRECTORIO --> ITERATE   
+ *  OPERACION SOBRE FICHEROS --> WRITE   
  * =========================================================== */
-static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
-    
-    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+/*
+ * Los datos se quedan sucios en la cache de paginas y los lleva a
+ * disco assoofs_writepages (o fsync, o O_SYNC con generic_write_sync).
+ * El tamano nuevo si se guarda ya en el almacen de inodos.
+ */
+static ssize_t assoofs_write_iter(struct kiocb *iocb, struct iov_iter *from){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
 	 *       DECLARACION FUNCIONES                 *
 	/ ++++++++++++++++++++++++++++++++++++++++++++ */
-    struct inode *inode;
-	struct super_block *sb;
-	struct assoofs_inode_info *inode_info;
-	struct assoofs_inode_info *child_inode_info;
-	struct buffer_head *bh;
-	struct assoofs_dir_record_entry *record;
-	int i;
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	int64_t delta = 0;
+	ssize_t ret;
 
-	//IMPRESION DE LA TRAZA CORRESPONDIENTE AL USO DE ESTA FUNCION
-	printk(KERN_INFO B "Iterate request" RC "\n");
 
     /* ++++++++++++++++++++++++++++++++++++++++++++ /
      *      PROCECEMOS CON EL DESARROLLO           * 
     / ++++++++++++++++++++++++++++++++++++++++++++ */
 
-	//Antes de nada comprobamos si el directorio ya se encuentra en la cache para evitar bucles infinitos
-	if (ctx->pos){
-		printk(KERN_INFO R "The directory already is at the cache" RC "\n");
-		printk(KERN_INFO "\n");
-		return 0;
-	} 
+	//El cerrojo del inodo ordena el write frente a un reflink del mismo fichero
+	inode_lock(inode);
 
-	//Sacamos del descriptor de archivos todo lo que necesitamos:
-	inode = filp->f_path.dentry->d_inode;		//el inodo
-	sb = inode->i_sb;							//el superbloque
-	inode_info = inode->i_private;				//la informacion del inodo
+	ret = generic_write_checks(iocb, from);
+	if(ret <= 0){
+		goto out;
+	}
 
-	if ((!S_ISDIR(inode_info->mode))){
-		printk(KERN_ERR "The file was supposed to be a directory, but it is not\n");
-		return -1;  //Si por algun casual el modo del indodo no es de directorio, nos salimos
+	//Copia en escritura: si el bloque lo comparte un reflink se duplica antes de tocarlo.
+	//En modo log no hace falta: los datos nunca se escriben en su sitio
+	if(!ASSOOFS_FS(sb)->log_mode && assoofs_unshare_block(inode)){
+		ret = -ENOSPC;
+		goto out;
 	}
 
-	bh = sb_bread(sb, inode_info->data_block_number);			//leemos en disco
-	record = (struct assoofs_dir_record_entry *)bh->b_data;		//el contenido que queriamos estaba en data y hay que castearlo
-	
-	printk(KERN_INFO "Directory: reading all the dir_record_entries: %lld\n", inode_info->dir_children_count);
+	trace_assoofs_write(inode, iocb->ki_pos, iov_iter_count(from));
+	ret = __generic_file_write_iter(iocb, from);
 
-	for (i = 0; i < inode_info->dir_children_count; i++) {		//recorremos todos los hijos que tiene el directorio
-		child_inode_info = assoofs_get_inode_info(sb, record->inode_no);
+	if(i_size_read(inode) != inode_info->file_size){
+		//-----------------------  MUTEX DEL ALMACEN DE INODOS  -------------------------//
+		assoofs_lock(sb, &assoofs_inodes_block_lock);
 
-		if(record->state_flag == ASSOOFS_STATE_ALIVE){
-			dir_emit(ctx, record->filename, ASSOOFS_FILENAME_MAXLEN, record->inode_no, DT_UNKNOWN);		//Inicializando el contexto con los datos del directorio
-			ctx->pos += sizeof(struct assoofs_dir_record_entry);										//Incrementamos el valor del puntero pos, se inicializa con 0, pero lo voy a aumentar tanto como ocupe un record entry
-			printk(KERN_INFO Y "FILE: " B "Name:" RC " '%s' " Y "Inode_Number:" RC " %llu" Y " Block Number: " RC "%llu --> " G "ALIVE" RC "\n", record->filename, record->inode_no, child_inode_info->data_block_number);
-		}else if(record->state_flag == ASSOOFS_STATE_REMOVED){
-			//No imprimo el file porque no deberia existir
-			printk(KERN_INFO Y "FILE: " B "Name:" RC " '%s' " Y "Inode_Number:" RC " %llu" Y " Block Number: " RC "%llu --> " R "REMOVED" RC "\n", record->filename, record->inode_no, child_inode_info->data_block_number);
-			i--; //para que no lo cuente como hijo
-		}
-		record++;						//Aumento el valor del puntero record
+		delta = i_size_read(inode) - inode_info->file_size;
+		inode_info->file_size = i_size_read(inode);		//actualizamos la informacion del tamaño
+		assoofs_save_inode_info(sb, inode_info);		//guardamos la informacion del inodo en disco
+
+		mutex_unlock(&assoofs_inodes_block_lock);
 	}
 
-	//Liberamos la memoria del bufferhead
-	brelse(bh);
+	//Un fichero ya borrado (abierto todavia) no cuenta en los totales de nadie
+	if(delta && inode_info->state_flag == ASSOOFS_STATE_ALIVE){
+		assoofs_usage_update(iocb->ki_filp->f_path.dentry, delta, 0);
+	}
 
-	//Si todo ha ido bien salimos y devolvemos un cero
-	printk(KERN_INFO "\n");
-	return 0;
+out:
+	inode_unlock(inode);
+	if(ret > 0){
+		ret = generic_write_sync(iocb, ret);		//O_SYNC y O_DSYNC escriben ya las paginas
+	}
+	return ret;
 }
 
 /* =========================================================== *
- *  OPERACIONES SOBRE INODOS 
- * =========================================================== */
-struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags);
-static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl);
-static int assoofs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode);
-static int assoofs_remove(struct inode *dir, struct dentry *dentry);
-void assoofs_set_a_freeblock(struct assoofs_super_block_info *super_info, uint64_t data_block_number);
-static int assoofs_move(struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir, struct dentry *new_dentry, unsigned int num);
-
-/* =========================================================== *
- *  OPERACIONES DE INODOS (INODE_OPS)   
+ *  OPERACION SOBRE FICHEROS --> REFLINK (FICLONE, FICLONERANGE)
  * =========================================================== */
-static struct inode_operations assoofs_inode_ops = {
-    .lookup = assoofs_lookup,
-    .create = assoofs_create,
-    .mkdir = assoofs_mkdir,
-    .unlink = assoofs_remove,
-    .rename = assoofs_move,
-    .rmdir = assoofs_remove,
-};
+/*
+ * Cada fichero ocupa un solo bloque, asi que clonar es hacer que
+ * el destino apunte al bloque del origen y anotar una referencia
+ * mas en block_refcount: no se lee ni se copia ningun dato. El
+ * primer write sobre cualquiera de los dos lo duplica (ver
+ * assoofs_unshare_block).
+ *
+ * Solo se clonan ficheros completos: desde 0 en ambos, hasta el
+ * final del origen, y sin que el destino sea mas largo que el
+ * origen (sus bytes de mas se perderian). El resto es -EINVAL.
+ */
+static loff_t assoofs_remap_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, loff_t len, unsigned int remap_flags){
 
-/* =========================================================== *
- *  CONSULTA DE LOS ARCHIVOS EN UN DIRECTORIO    
- * =========================================================== */
-struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags) {
-	
 	/* ++++++++++++++++++++++++++++++++++++++++++++ /
 	 *       DECLARACION FUNCIONES                 *
 	/ ++++++++++++++++++++++++++++++++++++++++++++ */
-	struct assoofs_inode_info *parent_info;		
-	struct super_block *sb;							
-	struct buffer_head *bh;	
-	struct assoofs_dir_record_entry *record;
-	struct inode *inode;												
-	int i;						//EN ESTE CASO EL BLOQUE DONDE TIENE LA INFO EL RAIZ
+	struct inode *src = file_inode(file_in);
+	struct inode *dst = file_inode(file_out);
+	struct super_block *sb = src->i_sb;
+	struct assoofs_inode_info *src_info = src->i_private;
+	struct assoofs_inode_info *dst_info = dst->i_private;
+	struct assoofs_super_block_info *assoofs_sb = ASSOOFS_SB(sb);
+	uint64_t block, old_block, size;
+	int64_t delta = 0;
+	loff_t ret;
 
-	//IMPRESION DE LA TRAZA CORRESPONDIENTE AL USO DE ESTA FUNCION
-	printk(KERN_INFO B "Lookup request" RC "\n");
 
     /* ++++++++++++++++++++++++++++++++++++++++++++ /
      *      PROCECEMOS CON EL DESARROLLO           * 
     / ++++++++++++++++++++++++++++++++++++++++++++ */
 
-	parent_info = parent_inode->i_private;		//SACAMOS LA INFORMACION PERSISTENTE
-	sb = parent_inode->i_sb;					//SACAMOS EL SUPERBLOQUE
-	bh = sb_bread(sb, parent_info->data_block_number);//PARA LEER LA INFO DEL BLOQUE PADRE
+	if(remap_flags & REMAP_FILE_DEDUP){
+		return -EOPNOTSUPP;
+	}
+	if(remap_flags & ~REMAP_FILE_ADVISORY & ~REMAP_FILE_CAN_SHORTEN){
+		return -EINVAL;
+	}
+	if(sb != dst->i_sb){
+		return -EXDEV;
+	}
+	if(src == dst){
+		return -EINVAL;
+	}
 
-	printk(KERN_INFO "Lookup in: parent_ino=%llu, parent_block=%llu\n", parent_info->inode_no, parent_info->data_block_number);
+	//Ningun write de los dos ficheros puede colarse mientras se comparte el bloque
+	lock_two_nondirectories(src, dst);
 
-	//voy a recorrerlos records dentro del directorio
-	record = (struct assoofs_dir_record_entry *)bh->b_data;
-	for (i=0; i < parent_info->dir_children_count; i++) {
+	//Comprobaciones del VFS (inmutables, solo anadir, rango), lo sucio de los dos en disco antes de
+	//compartir el bloque, y mtime/ctime y bits setuid/setgid del destino como en cualquier escritura
+	ret = generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out, &len, remap_flags);
+	if(ret < 0){
+		unlock_two_nondirectories(src, dst);
+		return ret;
+	}
 
-		if(record->state_flag == ASSOOFS_STATE_ALIVE){
-			printk(KERN_INFO B "Have file: " RC " '%s' (" Y "ino" RC ":%llu) --> " G "ALIVE" RC "\n", record->filename, record->inode_no);
-			if (!strcmp(record->filename, child_dentry->d_name.name)) {		//COMPROBAR INFO DEL FICHERO CON EL QUE NOS PASAN (0 SI SON IGUALES, !=0 SI NO SON IGUALES)
-				inode = assoofs_get_inode(sb, record->inode_no); // Función auxiliar que obtine la información de un inodo a partir de su número de inodo.
-				inode_init_owner(inode, parent_inode, ((struct assoofs_inode_info *)inode->i_private)->mode);	//OBTENER LA INFO DE ESE INODO
-				d_add(child_dentry, inode);		//GUARDAR LA INFO EN MEMORIA DEL FICHERO
-				return NULL;
-			}
-		}
+	//-----------------------  MUTEX DEL ALMACEN DE INODOS  -------------------------//
+	assoofs_lock(sb, &assoofs_inodes_block_lock);
 
-		if(record->state_flag == ASSOOFS_STATE_REMOVED){
-			printk(KERN_INFO B "Have file: " RC " '%s' (" Y "ino" RC ":%llu) --> " R "REMOVED" RC "\n", record->filename, record->inode_no);
-			i--; //para que no los cuente como hijos, los que estan muertos
-		}
+	size = src_info->file_size;
+	block = src_info->data_block_number;
+	old_block = dst_info->data_block_number;
 
-		record++;
+	if(pos_in || pos_out || (len && len < size) || dst_info->file_size > size){
+		ret = -EINVAL;
+		goto out;
 	}
 
-	printk(KERN_ERR "No inode " G "ALIVE" R " found for the filename [%s]" RC "\n", child_dentry->d_name.name);
-	printk(KERN_INFO "\n");
-	return NULL;
+	if(block != old_block && assoofs_sb->block_refcount[block] == ASSOOFS_MAX_BLOCK_REFCOUNT){
+		ret = -EMLINK;
+		goto out;
+	}
+
+	//Primero el inodo: si el corte llega antes del superbloque, assoofs-fsck recalcula las referencias
+	if(dst_info->state_flag == ASSOOFS_STATE_ALIVE){
+		delta = size - dst_info->file_size;
+	}
+	dst_info->data_block_number = block;
+	dst_info->file_size = size;
+	assoofs_save_inode_info(sb, dst_info);
+
+	//Las paginas del destino eran de su bloque antiguo: se vuelven a leer del compartido
+	truncate_inode_pages(dst->i_mapping, 0);
+	i_size_write(dst, size);
+
+	if(block != old_block){
+		//--------------------------  MUTEX DEL SUPER BLOQUE  ---------------------------//
+		assoofs_lock(sb, &assoofs_sb_lock);
+
+		assoofs_sb->block_refcount[block]++;
+		assoofs_set_a_freeblock(sb, old_block);		//El bloque antiguo del destino pierde su referencia
+		assoofs_save_sb_info(sb);
+
+		mutex_unlock(&assoofs_sb_lock);
+	}
+
+	trace_assoofs_clone(src, dst, block);
+
+	//FICLONERANGE exige que se devuelva exactamente la longitud pedida
+	ret = len && !(remap_flags & REMAP_FILE_CAN_SHORTEN) ? len : size;
+
+out:
+	mutex_unlock(&assoofs_inodes_block_lock);
+	if(ret >= 0 && delta){
+		assoofs_usage_update(file_out->f_path.dentry, delta, 0);
+	}
+	unlock_two_nondirectories(src, dst);
+	return ret;
 }
 
 /* =========================================================== *
- *  CREACION DE UN ARCHIVO    
+ *  OPERACION SOBRE FICHEROS --> COPY_FILE_RANGE
  * =========================================================== */
-static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
+/*
+ * Una copia del fichero completo se resuelve como un reflink. Si
+ * no se puede clonar se devuelve -EOPNOTSUPP y el VFS hace la
+ * copia de siempre con read y write.
+ */
+static ssize_t assoofs_copy_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, size_t len, unsigned int flags){
 
 	/* ++++++++++++++++++++++++++++++++++++++++++++ /
 	 *       DECLARACION FUNCIONES                 *
 	/ ++++++++++++++++++++++++++++++++++++++++++++ */
-    struct inode *inode;
-    struct super_block *sb;
-    uint64_t count;
-    struct assoofs_inode_info *inode_info;
-    struct assoofs_inode_info *parent_inode_info;
-	struct assoofs_dir_record_entry *dir_contents;
-	struct buffer_head *bh;
-	uint64_t block_number;
-	int i;
+	loff_t ret;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	if(file_inode(file_in)->i_sb != file_inode(file_out)->i_sb){
+		return -EXDEV;
+	}
+
+	ret = assoofs_remap_file_range(file_in, pos_in, file_out, pos_out, len, REMAP_FILE_CAN_SHORTEN);
+	if(ret < 0 && ret != -EXDEV){
+		return -EOPNOTSUPP;
+	}
+	return ret;
+}
+
+/* =========================================================== *
+ *  OPERACION SOBRE INODOS --> SETATTR (TRUNCATE)
+ * =========================================================== */
+/*
+ * Lo mismo que simple_setattr, pero un cambio de tamano se guarda
+ * en el almacen de inodos y llega a los totales de los directorios.
+ * Los bytes entre el tamano viejo y el nuevo se ponen a cero con
+ * el mismo camino que un write (write_begin/write_end): asi pasan
+ * por la copia en escritura y por el modo log, y un fichero que
+ * vuelve a crecer no ensena datos antiguos.
+ */
+static int assoofs_setattr(struct dentry *dentry, struct iattr *attr){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct inode *inode = d_inode(dentry);
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	loff_t old_size = i_size_read(inode), from, len;
+	struct page *page;
+	void *fsdata;
+	int64_t delta = 0;
+	int ret;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	ret = setattr_prepare(dentry, attr);
+	if(ret){
+		return ret;
+	}
+
+	if((attr->ia_valid & ATTR_SIZE) && attr->ia_size != old_size){
+		if(!ASSOOFS_FS(sb)->log_mode && assoofs_unshare_block(inode)){
+			return -ENOSPC;
+		}
+
+		from = min_t(loff_t, old_size, attr->ia_size);
+		len = max_t(loff_t, old_size, attr->ia_size) - from;
+		ret = pagecache_write_begin(NULL, inode->i_mapping, from, len, 0, &page, &fsdata);
+		if(ret){
+			return ret;
+		}
+		zero_user(page, from, len);
+		ret = pagecache_write_end(NULL, inode->i_mapping, from, len, len, page, fsdata);
+		if(ret < 0){
+			return ret;
+		}
+		truncate_setsize(inode, attr->ia_size);
+
+		//-----------------------  MUTEX DEL ALMACEN DE INODOS  -------------------------//
+		assoofs_lock(sb, &assoofs_inodes_block_lock);
+
+		delta = attr->ia_size - inode_info->file_size;
+		inode_info->file_size = attr->ia_size;
+		assoofs_save_inode_info(sb, inode_info);
+
+		mutex_unlock(&assoofs_inodes_block_lock);
+
+		if(delta && inode_info->state_flag == ASSOOFS_STATE_ALIVE){
+			assoofs_usage_update(dentry, delta, 0);
+		}
+	}
+
+	setattr_copy(inode, attr);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/* =========================================================== *
+ *  MODO LOG: ESCRITURA FUERA DE SITIO
+ * =========================================================== */
+/*
+ * Con la opcion de montaje log los datos de un fichero nunca se
+ * sobrescriben en su bloque: en el primer write_begin despues de
+ * confirmar se le da el siguiente bloque libre a partir de la
+ * cabeza del log (assoofs_log_get_a_freeblock) y la pagina pasa a
+ * apuntarlo. Asi los writeback de muchos ficheros pequenos caen
+ * en bloques consecutivos y el plug de writepages los junta.
+ *
+ * El almacen de inodos hace de mapa de inodos: solo cuando los
+ * datos estan escritos en el bloque nuevo, writepages cambia el
+ * data_block_number del inodo y libera el bloque anterior. Como
+ * cada fichero ocupa un bloque entero, un bloque sustituido queda
+ * libre del todo y no hace falta un limpiador de segmentos.
+ *
+ * Quien llama a assoofs_log_relocate tiene el cerrojo del inodo y
+ * la pagina bloqueada. file es NULL si no viene de un write.
+ */
+static int assoofs_log_relocate(struct inode *inode, struct file *file, loff_t pos, struct buffer_head *bh){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+	uint64_t block;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	spin_lock(&fsi->log_lock);
+	block = fsi->log_pending[inode->i_ino];
+	spin_unlock(&fsi->log_lock);
+
+	if(!block){
+		if(assoofs_log_prealloc(inode, file, pos, &block) && assoofs_log_get_a_freeblock(sb, &block)){
+			return -ENOSPC;
+		}
+		spin_lock(&fsi->log_lock);
+		fsi->log_pending[inode->i_ino] = block;
+		spin_unlock(&fsi->log_lock);
+	}
+
+	//Un bloque de 4096 bytes por pagina: un solo buffer, que se lleva al bloque nuevo
+	if(bh->b_blocknr != block){
+		bh->b_blocknr = block;
+		set_buffer_mapped(bh);
+		clean_bdev_bh_alias(bh);		//Un buffer viejo del dispositivo no puede pisar los datos
+	}
+	return 0;
+}
+
+/* =========================================================== *
+ *  MODO LOG: PREASIGNACION PARA LOS QUE ESCRIBEN AL FINAL
+ * =========================================================== */
+/*
+ * Un fichero que se va escribiendo siempre por el final (un log,
+ * una descarga) pide un bloque nuevo del log en cada writeback. En
+ * vez de sacarlos de uno en uno del mapa de bits, con
+ * assoofs_sb_lock y el superbloque cada vez, cada fichero abierto
+ * que escribe al final se reserva de golpe un tramo contiguo a
+ * partir de la cabeza del log y gasta de ahi sus bloques: 1 la
+ * primera vez, y el doble en cada reserva hasta
+ * ASSOOFS_PREALLOC_MAX. Dos ficheros que crecen a la vez quedan
+ * cada uno en su tramo en lugar de alternarse en el log.
+ *
+ * Un write que no es al final no usa la preasignacion y vuelve a
+ * empezar por 1. Lo que sobra se devuelve al cerrar el fichero, en
+ * cada sync_fs y, si se acaba el espacio, cuando el asignador
+ * recupera las reservas (assoofs_return_reservations). Devuelve -1
+ * si hay que pedir el bloque a assoofs_log_get_a_freeblock.
+ */
+static int assoofs_log_prealloc(struct inode *inode, struct file *file, loff_t pos, uint64_t *block){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+	struct assoofs_prealloc *pa;
+	unsigned int want;
+	uint64_t run;
+	int found = 0;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	if(!file){
+		return -1;
+	}
+	pa = file->private_data;
+
+	//No es un append: la ventana vuelve a empezar y el bloque sale del log como siempre
+	if(pos != i_size_read(inode)){
+		if(pa){
+			spin_lock(&fsi->prealloc_lock);
+			pa->window = 1;
+			spin_unlock(&fsi->prealloc_lock);
+		}
+		return -1;
+	}
+
+	//Primera escritura al final con este fichero abierto; el cerrojo del inodo nos protege de otro write
+	if(!pa){
+		pa = kzalloc(sizeof(*pa), GFP_NOFS);
+		if(!pa){
+			return -1;
+		}
+		pa->window = 1;
+		spin_lock(&fsi->prealloc_lock);
+		list_add(&pa->list, &fsi->prealloc);
+		spin_unlock(&fsi->prealloc_lock);
+		file->private_data = pa;
+	}
+
+	spin_lock(&fsi->prealloc_lock);
+	if(pa->blocks){
+		*block = __ffs64(pa->blocks);
+		pa->blocks &= ~(1ULL << *block);
+		found = 1;
+	}
+	want = pa->window;
+	spin_unlock(&fsi->prealloc_lock);
+
+	if(found){
+		atomic64_inc(&fsi->prealloc_hits);
+		goto out;
+	}
+
+	//Se agoto: un tramo nuevo, el doble de grande que el anterior
+	if(assoofs_log_reserve(sb, want, &run)){
+		return -1;
+	}
+	trace_assoofs_reserve(sb, run, 1);
+
+	*block = __ffs64(run);
+	spin_lock(&fsi->prealloc_lock);
+	pa->blocks |= run & ~(1ULL << *block);
+	pa->window = min_t(unsigned int, want * 2, ASSOOFS_PREALLOC_MAX);
+	spin_unlock(&fsi->prealloc_lock);
+
+out:
+	atomic64_inc(&fsi->allocs);
+	percpu_counter_dec(&fsi->free_blocks);
+	trace_assoofs_alloc_block(sb, *block, READ_ONCE(fsi->sb_info->free_blocks));
+	return 0;
+}
+
+//Al cerrar el ultimo descriptor del fichero abierto, lo que quede de su preasignacion vuelve al mapa de bits
+static int assoofs_release_file(struct inode *inode, struct file *file){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+	struct assoofs_prealloc *pa = file->private_data;
+	uint64_t blocks;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	if(!pa){
+		return 0;
+	}
+
+	//--------------------------  MUTEX DEL SUPER BLOQUE  ---------------------------//
+	assoofs_lock(sb, &assoofs_sb_lock);
+
+	spin_lock(&fsi->prealloc_lock);
+	list_del(&pa->list);
+	blocks = pa->blocks;
+	spin_unlock(&fsi->prealloc_lock);
+
+	if(blocks){
+		fsi->sb_info->free_blocks |= blocks;
+		assoofs_save_sb_info(sb);
+		trace_assoofs_reserve(sb, blocks, 0);
+	}
+
+	mutex_unlock(&assoofs_sb_lock);
+
+	file->private_data = NULL;
+	kfree(pa);
+	return 0;
+}
+
+static int assoofs_log_commit(struct inode *inode){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	uint64_t block, old_block;
+	int ret;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	if(!READ_ONCE(fsi->log_pending[inode->i_ino])){
+		return 0;
+	}
+
+	//Los datos tienen que estar en disco antes de que el inodo apunte al bloque nuevo
+	ret = filemap_fdatawait_range(inode->i_mapping, 0, LLONG_MAX);
+	if(ret || mapping_tagged(inode->i_mapping, PAGECACHE_TAG_DIRTY)){
+		return ret;		//Se ha vuelto a ensuciar: lo confirmara el siguiente writepages
+	}
+
+	//-----------------------  MUTEX DEL ALMACEN DE INODOS  -------------------------//
+	assoofs_lock(sb, &assoofs_inodes_block_lock);
+
+	//El borrado del inodo (assoofs_release_inode) puede haber liberado ya el bloque nuevo
+	spin_lock(&fsi->log_lock);
+	block = fsi->log_pending[inode->i_ino];
+	fsi->log_pending[inode->i_ino] = 0;
+	spin_unlock(&fsi->log_lock);
+	if(!block || inode_info->state_flag != ASSOOFS_STATE_ALIVE){
+		mutex_unlock(&assoofs_inodes_block_lock);
+		return 0;
+	}
+
+	old_block = inode_info->data_block_number;
+	inode_info->data_block_number = block;
+	assoofs_save_inode_info(sb, inode_info);
+
+	//--------------------------  MUTEX DEL SUPER BLOQUE  ---------------------------//
+	assoofs_lock(sb, &assoofs_sb_lock);
+
+	assoofs_set_a_freeblock(sb, old_block);		//Si lo compartia un reflink solo pierde una referencia
+	assoofs_save_sb_info(sb);
+
+	mutex_unlock(&assoofs_sb_lock);
+	mutex_unlock(&assoofs_inodes_block_lock);
+
+	atomic64_inc(&fsi->log_commits);
+	trace_assoofs_cow(sb, old_block, block);
+	return 0;
+}
+
+/* =========================================================== *
+ *  COPIA EN ESCRITURA DE UN BLOQUE COMPARTIDO
+ * =========================================================== */
+/*
+ * Si el bloque de datos del inodo tiene otras referencias (reflink
+ * o instantaneas) se copia a un bloque nuevo, el inodo pasa a
+ * apuntar a la copia y el original pierde una referencia. Con un
+ * solo dueno no hace nada. Sirve igual para ficheros y para
+ * directorios. Quien llama tiene el cerrojo del inodo.
+ *
+ * Si dos clones escriben a la vez y los dos copian, el segundo en
+ * soltar la referencia libera el original, que ya no usa nadie.
+ */
+static int assoofs_unshare_block(struct inode *inode){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	struct buffer_head *old_bh, *new_bh;
+	uint64_t old_block = inode_info->data_block_number;
+	uint64_t new_block;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	if(!READ_ONCE(ASSOOFS_SB(sb)->block_refcount[old_block])){
+		return 0;
+	}
+
+	if(assoofs_sb_get_a_freeblock(sb, ASSOOFS_GROUP_OF(old_block), &new_block)){
+		return -1;
+	}
+
+	old_bh = assoofs_bread(sb, old_block);
+	new_bh = assoofs_bread(sb, new_block);
+	memcpy(new_bh->b_data, old_bh->b_data, ASSOOFS_DEFAULT_BLOCK_SIZE);
+	assoofs_sync_buffer(sb, new_bh);
+	brelse(new_bh);
+	brelse(old_bh);
+
+	//-----------------------  MUTEX DEL ALMACEN DE INODOS  -------------------------//
+	assoofs_lock(sb, &assoofs_inodes_block_lock);
+
+	inode_info->data_block_number = new_block;
+	assoofs_save_inode_info(sb, inode_info);
+
+	//--------------------------  MUTEX DEL SUPER BLOQUE  ---------------------------//
+	assoofs_lock(sb, &assoofs_sb_lock);
+
+	assoofs_set_a_freeblock(sb, old_block);
+	assoofs_save_sb_info(sb);
+
+	mutex_unlock(&assoofs_sb_lock);
+	mutex_unlock(&assoofs_inodes_block_lock);
+
+	//Las paginas en cache (limpias: se escribieron al clonar) siguen apuntando al bloque compartido
+	invalidate_inode_pages2(inode->i_mapping);
+
+	trace_assoofs_cow(sb, old_block, new_block);
+	return 0;
+}
+
+/* =========================================================== *
+ *  OPERACIONES SOBRE DIRECTORIOS   
+ * =========================================================== */
+static int assoofs_iterate(struct file *filp, struct dir_context *ctx);
+const struct file_operations assoofs_dir_operations = {
+    .owner = THIS_MODULE,
+    .iterate = assoofs_iterate,
+    .fsync = assoofs_fsync,
+    .unlocked_ioctl = assoofs_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+};
+
+/* =========================================================== *
+ *  OPERACION DIRECTORIO --> ITERATE   
+ * =========================================================== */
+static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
+    
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+    struct inode *inode;
+	struct super_block *sb;
+	struct assoofs_inode_info *inode_info;
+	struct buffer_head *bh;
+	struct assoofs_dir_record_entry *record, *end;
+	int i;
+	int emitted = 0;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	//Antes de nada comprobamos si el directorio ya se encuentra en la cache para evitar bucles infinitos
+	if (ctx->pos){
+		return 0;
+	} 
+
+	//Sacamos del descriptor de archivos todo lo que necesitamos:
+	inode = filp->f_path.dentry->d_inode;		//el inodo
+	sb = inode->i_sb;							//el superbloque
+	inode_info = inode->i_private;				//la informacion del inodo
+
+	if ((!S_ISDIR(inode_info->mode))){
+		printk(KERN_ERR "The file was supposed to be a directory, but it is not\n");
+		return -1;  //Si por algun casual el modo del indodo no es de directorio, nos salimos
+	}
+
+	bh = assoofs_bread(sb, inode_info->data_block_number);			//leemos en disco
+	if(!bh){
+		return -EIO;
+	}
+	record = (struct assoofs_dir_record_entry *)bh->b_data;		//el contenido que queriamos estaba en data y hay que castearlo
+	end = record + ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(*record);	//Aunque dir_children_count mienta, no se sale del bloque
+
+	//Recorremos las dir_children_count entradas vivas, saltando las borradas (no cuentan como hijo)
+	for (i = 0; record < end && i < inode_info->dir_children_count; record++) {
+		if(record->state_flag != ASSOOFS_STATE_ALIVE){
+			continue;		//No imprimo el file porque no deberia existir
+		}
+		i++;
+
+		dir_emit(ctx, record->filename, strnlen(record->filename, ASSOOFS_FILENAME_MAXLEN), record->inode_no, DT_UNKNOWN);	//Inicializando el contexto con los datos del directorio
+		ctx->pos += sizeof(struct assoofs_dir_record_entry);										//Incrementamos el valor del puntero pos, se inicializa con 0, pero lo voy a aumentar tanto como ocupe un record entry
+		emitted++;
+	}
+
+	//Liberamos la memoria del bufferhead
+	brelse(bh);
+	trace_assoofs_iterate(inode, emitted);
+
+	//Si todo ha ido bien salimos y devolvemos un cero
+	return 0;
+}
+
+/* =========================================================== *
+ *  OPERACIONES SOBRE INODOS 
+ * =========================================================== */
+struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags);
+static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl);
+static int assoofs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode);
+static int assoofs_remove(struct inode *dir, struct dentry *dentry);
+void assoofs_set_a_freeblock(struct super_block *sb, uint64_t data_block_number);
+int assoofs_sb_get_a_freeinode(struct super_block *sb, unsigned int goal, uint64_t *inode_no);
+static unsigned int assoofs_dir_group(struct super_block *sb, unsigned int parent_group);
+void assoofs_set_a_freeinode(struct super_block *sb, uint64_t inode_no);
+static void assoofs_release_inode(struct super_block *sb, struct assoofs_inode_info *inode_info);
+static struct assoofs_dir_record_entry *assoofs_find_record(struct buffer_head *bh, struct assoofs_inode_info *dir_info, const char *name);
+static struct assoofs_dir_record_entry *assoofs_add_record(struct buffer_head *bh, struct assoofs_inode_info *dir_info, const char *name, uint64_t inode_no);
+static int assoofs_move(struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir, struct dentry *new_dentry, unsigned int num);
+static int assoofs_setattr(struct dentry *dentry, struct iattr *attr);
+
+/* =========================================================== *
+ *  OPERACIONES DE INODOS (INODE_OPS)   
+ * =========================================================== */
+static struct inode_operations assoofs_inode_ops = {
+    .lookup = assoofs_lookup,
+    .create = assoofs_create,
+    .mkdir = assoofs_mkdir,
+    .unlink = assoofs_remove,
+    .rename = assoofs_move,
+    .rmdir = assoofs_remove,
+    .setattr = assoofs_setattr,
+};
+
+/* =========================================================== *
+ *  CONSULTA DE LOS ARCHIVOS EN UN DIRECTORIO    
+ * =========================================================== */
+struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags) {
+	
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct assoofs_inode_info *parent_info;		
+	struct super_block *sb;							
+	struct buffer_head *bh;	
+	struct assoofs_dir_record_entry *record;
+	struct inode *inode;
+	const char *name = child_dentry->d_name.name;
+	uint64_t ino = 0;
+	unsigned int slot;
+	int found;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	parent_info = parent_inode->i_private;		//SACAMOS LA INFORMACION PERSISTENTE
+	sb = parent_inode->i_sb;					//SACAMOS EL SUPERBLOQUE
+
+	//Si el directorio esta en la cache de nombres no hace falta leer su bloque
+	found = assoofs_dcache_lookup(sb, parent_info->inode_no, name, &ino, &slot);
+	if(found < 0 && assoofs_bloom_miss(sb, parent_info->inode_no, name)){
+		found = 0;			//El filtro de Bloom descarta el nombre sin leer el bloque
+	}
+	if(found < 0){
+		bh = assoofs_bread(sb, parent_info->data_block_number);//PARA LEER LA INFO DEL BLOQUE PADRE
+		record = assoofs_find_record(bh, parent_info, name);
+		found = record != NULL;
+		if(record){
+			ino = record->inode_no;
+		}
+		assoofs_dcache_fill(sb, parent_info, bh);		//Las siguientes busquedas ya no leen el bloque
+		brelse(bh);
+	}
+
+	if(found){
+		inode = assoofs_get_inode(sb, ino); // Función auxiliar que obtine la información de un inodo a partir de su número de inodo.
+		inode_init_owner(inode, parent_inode, ((struct assoofs_inode_info *)inode->i_private)->mode);	//OBTENER LA INFO DE ESE INODO
+		d_add(child_dentry, inode);		//GUARDAR LA INFO EN MEMORIA DEL FICHERO
+		atomic64_inc(&ASSOOFS_FS(sb)->lookup_hit);
+		trace_assoofs_lookup(parent_inode, name, inode->i_ino);
+		return NULL;
+	}
+
+	//No hay ninguna entrada viva con ese nombre: dentry negativa, para que el VFS
+	//responda los siguientes fallos sin llamarnos. create y rename la convierten
+	d_add(child_dentry, NULL);
+	atomic64_inc(&ASSOOFS_FS(sb)->lookup_miss);
+	trace_assoofs_lookup(parent_inode, name, 0);
+	return NULL;
+}
+
+/* =========================================================== *
+ *  CREACION DE UN ARCHIVO    
+ * =========================================================== */
+static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+    struct inode *inode;
+    struct super_block *sb;
+    uint64_t inode_no;
+    struct assoofs_inode_info *inode_info;
+    struct assoofs_inode_info *parent_inode_info;
+	struct assoofs_dir_record_entry *dir_contents;
+	struct buffer_head *bh;
+	uint64_t block_number;
+	unsigned int group;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+    sb = dir->i_sb;			//OBTENEMOS UN PUNTERO AL SUPERBLOQUE DESDE DIR
+
+    //El nombre tiene que caber en la entrada con su '\0', como en assoofs_rename
+    if(dentry->d_name.len >= ASSOOFS_FILENAME_MAXLEN){
+    	return -ENAMETOOLONG;
+    }
+
+    //Si una instantanea comparte el bloque del directorio, se copia antes de anadirle la entrada
+    if(assoofs_unshare_block(dir)){
+    	return -ENOSPC;
+    }
+
+    //La entrada se hace sitio en el bloque del padre antes de reservar nada; el numero de inodo se pone despues
+    parent_inode_info = dir->i_private;
+    bh = assoofs_bread(sb, parent_inode_info->data_block_number);
+    if(!bh){
+    	return -EIO;
+    }
+    dir_contents = assoofs_add_record(bh, parent_inode_info, dentry->d_name.name, 0);
+    if(!dir_contents){
+    	brelse(bh);
+    	return -ENOSPC;
+    }
+
+    //Numero de inodo y bloque de datos se reservan por separado, cada uno de su mapa de bits,
+    //en el grupo del directorio padre para que su contenido quede junto
+    group = ASSOOFS_GROUP_OF(((struct assoofs_inode_info *)dir->i_private)->data_block_number);
+    if(assoofs_sb_get_a_freeinode(sb, group, &inode_no)){
+    	goto nospc;
+    }
+
+    if(assoofs_sb_get_a_freeblock(sb, group, &block_number)){  //Para asignarle un bloque vacío
+    	assoofs_lock(sb, &assoofs_sb_lock);
+    	assoofs_set_a_freeinode(sb, inode_no);
+    	assoofs_save_sb_info(sb);
+    	mutex_unlock(&assoofs_sb_lock);
+    	goto nospc;
+    }
+
+    inode = new_inode(sb);
+
+    inode->i_ino = inode_no;
+
+    inode->i_sb = sb;
+    inode->i_op = &assoofs_inode_ops;
+    inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+
+    //una vez asignado esto, vamos a almacenar el campo i_private del nodo, que contendrá datos persistentes que habrá que llevar a disco
+    inode_info = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);
+
+    inode_info->inode_no = inode->i_ino;		
+    inode_info->mode = mode;
+    inode_info->file_size = 0;
+    inode_info->data_block_number = block_number;  //Para asignarle un bloque vacío
+    inode_info->state_flag = ASSOOFS_STATE_ALIVE;	//necesario para el remove
+    inode_info->usage_bytes = 0;
+    inode_info->usage_inodes = 0;
+
+    inode->i_private = inode_info;
+
+    inode->i_fop=&assoofs_file_operations;
+    inode->i_mapping->a_ops = &assoofs_aops;
+    inode_init_owner(inode, dir, mode);
+    d_instantiate(dentry, inode);		//La dentry ya esta en la cache del VFS (negativa desde lookup)
+
+    assoofs_add_inode_info(sb, inode_info);							//Para guardar la informacion persistente del nuevo nodo en disco
+
+    //AHORA PASO 2
+    //MODIFICAR EL CONTENIDO DEL DIRECTORIO PADRE: LA ENTRADA RESERVADA AL PRINCIPIO APUNTA AL NUEVO INODO
+	dir_contents->inode_no = inode_info->inode_no; // inode_info es la información persistente del inodo creado en el paso 2.
+
+	//Escribir en disco
+	assoofs_sync_buffer(sb, bh);		//FORZAMOS LA SINCRONIZACION. Todos los cambios que esten en dirty, se trasladaran a disco
+	assoofs_dcache_add(sb, parent_inode_info->inode_no, dentry->d_name.name, inode_info->inode_no,
+			ASSOOFS_RECORD_SLOT(bh, dir_contents));
+	brelse(bh);					//liberamos memoria del bufferhead
+	trace_assoofs_create(dir, dentry->d_name.name, inode->i_ino, inode_info->mode);
+
+	//-----------------------  MUTEX DEL ALMACEN DE INODOS  -------------------------//
+    assoofs_lock(sb, &assoofs_inodes_block_lock);
+
+	parent_inode_info->dir_children_count++;			//AUMENTAMOS EN UNO ELCONTADOR DE HIJOS DEL PADRE
+	assoofs_save_inode_info(sb, parent_inode_info);		//CON ESTA FUNCION PASAMOS A DISCO LA INFORMACION DEL PADRE
+
+	mutex_unlock(&assoofs_inodes_block_lock);
+
+	assoofs_usage_update(dentry, 0, 1);		//Un inodo mas en el padre y en todos sus antepasados
+	return 0;	//PARA INDICAR QUE TODO HA SALIDO BIEN
+
+nospc:
+	dir_contents->state_flag = ASSOOFS_STATE_REMOVED;		//La entrada reservada vuelve a estar libre; el bloque no se ha escrito
+	brelse(bh);
+	return -ENOSPC;
+}
+
+/* =========================================================== *
+ *  CREACION DE UN DIRECTORIO    
+ * =========================================================== */
+static int assoofs_mkdir(struct inode *dir , struct dentry *dentry, umode_t mode) {
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+    struct inode *inode;
+    struct super_block *sb;
+    uint64_t inode_no;
+    struct assoofs_inode_info *inode_info;
+    struct assoofs_inode_info *parent_inode_info;
+	struct assoofs_dir_record_entry *dir_contents;
+	struct buffer_head *bh;
+	uint64_t block_number;
+	unsigned int group;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+    sb = dir->i_sb;			//OBTENEMOS UN PUNTERO AL SUPERBLOQUE DESDE DIR
+
+    //El nombre tiene que caber en la entrada con su '\0', como en assoofs_rename
+    if(dentry->d_name.len >= ASSOOFS_FILENAME_MAXLEN){
+    	return -ENAMETOOLONG;
+    }
+
+    //Si una instantanea comparte el bloque del directorio, se copia antes de anadirle la entrada
+    if(assoofs_unshare_block(dir)){
+    	return -ENOSPC;
+    }
+
+    //La entrada se hace sitio en el bloque del padre antes de reservar nada; el numero de inodo se pone despues
+    parent_inode_info = dir->i_private;
+    bh = assoofs_bread(sb, parent_inode_info->data_block_number);
+    if(!bh){
+    	return -EIO;
+    }
+    dir_contents = assoofs_add_record(bh, parent_inode_info, dentry->d_name.name, 0);
+    if(!dir_contents){
+    	brelse(bh);
+    	return -ENOSPC;
+    }
+
+    //Numero de inodo y bloque de datos se reservan por separado, cada uno de su mapa de bits;
+    //un directorio nuevo empieza su propio grupo (ver assoofs_dir_group)
+    group = assoofs_dir_group(sb, ASSOOFS_GROUP_OF(((struct assoofs_inode_info *)dir->i_private)->data_block_number));
+    if(assoofs_sb_get_a_freeinode(sb, group, &inode_no)){
+    	goto nospc;
+    }
+
+    if(assoofs_sb_get_a_freeblock(sb, group, &block_number)){  //Para asignarle un bloque vacío
+    	assoofs_lock(sb, &assoofs_sb_lock);
+    	assoofs_set_a_freeinode(sb, inode_no);
+    	assoofs_save_sb_info(sb);
+    	mutex_unlock(&assoofs_sb_lock);
+    	goto nospc;
+    }
+
+    inode = new_inode(sb);
+
+    inode->i_ino = inode_no;
+
+    inode->i_sb = sb;
+    inode->i_op = &assoofs_inode_ops;
+    inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+
+    //una vez asignado esto, vamos a almacenar el campo i_private del nodo, que contendrá datos persistentes que habrá que llevar a disco
+    
+    inode_info = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);
+
+    inode_info->inode_no = inode->i_ino;	
+    inode_info->file_size = 0;
+    inode_info->data_block_number = block_number;  //Para asignarle un bloque vacío
+    inode->i_fop=&assoofs_dir_operations;
+	inode_info->dir_children_count = 0;
+	inode_info->mode = S_IFDIR | mode;
+	inode_info->state_flag = ASSOOFS_STATE_ALIVE;		//necesario para el remove
+	inode_info->usage_bytes = 0;					//Un directorio nuevo no tiene nada debajo
+	inode_info->usage_inodes = 0;
+
+	inode->i_private = inode_info;
+
+    inode_init_owner(inode, dir, inode_info->mode);
+    d_instantiate(dentry, inode);		//La dentry ya esta en la cache del VFS (negativa desde lookup)
+
+    assoofs_add_inode_info(sb, inode_info);							//Para guardar la informacion persistente del nuevo nodo en disco
+
+    //AHORA PASO 2
+    //MODIFICAR EL CONTENIDO DEL DIRECTORIO PADRE: LA ENTRADA RESERVADA AL PRINCIPIO APUNTA AL NUEVO INODO
+	dir_contents->inode_no = inode_info->inode_no; // inode_info es la información persistente del inodo creado en el paso 2.
+
+	//Escribir en disco
+	assoofs_sync_buffer(sb, bh);		//FORZAMOS LA SINCRONIZACION. Todos los cambios que esten en dirty, se trasladaran a disco
+	assoofs_dcache_add(sb, parent_inode_info->inode_no, dentry->d_name.name, inode_info->inode_no,
+			ASSOOFS_RECORD_SLOT(bh, dir_contents));
+	brelse(bh);					//liberamos memoria del bufferhead
+	trace_assoofs_create(dir, dentry->d_name.name, inode->i_ino, inode_info->mode);
+
+	parent_inode_info->dir_children_count++;			//AUMENTAMOS EN UNO ELCONTADOR DE HIJOS DEL PADRE
+	assoofs_save_inode_info(sb, parent_inode_info);		//CON ESTA FUNCION PASAMOS A DISCO LA INFORMACION DEL PADRE
+
+	assoofs_usage_update(dentry, 0, 1);		//Un inodo mas en el padre y en todos sus antepasados
+	return 0;	//PARA INDICAR QUE TODO HA SALIDO BIEN
+
+nospc:
+	dir_contents->state_flag = ASSOOFS_STATE_REMOVED;		//La entrada reservada vuelve a estar libre; el bloque no se ha escrito
+	brelse(bh);
+	return -ENOSPC;
+}
+
+/* =========================================================== *
+ *  BORRADO DE UN ARCHIVO    
+ * =========================================================== */
+/* 
+ * Para borrar un archivo nos vamos a limitar a poner en sus
+ * dentry e inode_info las flags de REMOVED o ALIVE
+ *
+ * Despues de esto solamente tendremos que bajar el contador
+ * de inodos del superbloque, bajar el contador de hijos
+ * del padre y borrar el inodo
+ *
+ * Todo esto al mismo tiempo que guardamos la informacion en memoria
+ * y en disco, y borramos el inodo del mapa de bits ocupados.
+ *
+ * Al final ejecutaremos ddrop sobre la dentry para borrarla
+ * 
+ */
+static int assoofs_remove(struct inode *dir, struct dentry *dentry){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct inode *inode;
+	struct assoofs_inode_info *inode_info;
+	struct assoofs_inode_info *parent_inode_info;
+	struct super_block *sb;
+
+	struct buffer_head *bh;
+	struct assoofs_dir_record_entry *record;
+	uint64_t ino;
+	unsigned int slot;
+	int64_t bytes, inodes;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	sb = dentry->d_sb;						//sacamos el superbloque del dentry
+
+	//Si una instantanea comparte el bloque del padre, se copia antes de marcar la entrada
+	if(assoofs_unshare_block(dir)){
+		return -ENOSPC;
+	}
+
+    inode = dentry->d_inode;				//sacamos el nodo del dentry
+    inode_info = inode->i_private;			//sacamos el campo info del nodo
+    parent_inode_info = dir->i_private;		//sacamos el campo info del padre
+
+    //Lo que aportaba a los totales de sus antepasados desaparece con el
+    assoofs_usage_of(inode_info, &bytes, &inodes);
+    assoofs_usage_update(dentry, -bytes, -inodes);
+
+	//Las paginas sucias no pueden llegar a un bloque que ya es de otro
+	truncate_inode_pages(&inode->i_data, 0);
+
+	//El inodo queda REMOVED y su bloque y su numero vuelven a los mapas de bits
+	assoofs_release_inode(sb, inode_info);
+
+	//La dentry no se tira: el VFS la deja negativa (d_delete) y un lookup repetido del nombre no nos llega
+
+	//Marcamos como borrada la entrada del hijo en el bloque del padre
+	bh = assoofs_bread(sb, parent_inode_info->data_block_number);//PARA LEER LA INFO DEL BLOQUE PADRE
+
+	//Si la cache de nombres sabe en que posicion esta la entrada no hace falta recorrer el bloque
+	record = (struct assoofs_dir_record_entry *)bh->b_data;
+	if(assoofs_dcache_lookup(sb, parent_inode_info->inode_no, dentry->d_name.name, &ino, &slot) == 1 &&
+			slot < ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(*record) && record[slot].state_flag == ASSOOFS_STATE_ALIVE &&
+			record[slot].inode_no == inode->i_ino && !strcmp(record[slot].filename, dentry->d_name.name)){
+		record[slot].state_flag = ASSOOFS_STATE_REMOVED;
+	}else{
+		//Si no, se recorren las entradas vivas con la cuenta de hijos de antes del borrado
+		record = assoofs_find_record(bh, parent_inode_info, dentry->d_name.name);
+		if(record && record->inode_no == inode->i_ino){
+			record->state_flag = ASSOOFS_STATE_REMOVED;
+		}
+	}
+
+	assoofs_sync_buffer(sb, bh);		//FORZAMOS LA SINCRONIZACION. Todos los cambios que esten en dirty, se trasladaran a disco
+	brelse(bh);
+
+    //Con la entrada ya marcada, reduzco en 1 el numero de hijos del padre y lo guardamos
+    parent_inode_info->dir_children_count--;
+    assoofs_save_inode_info(sb, parent_inode_info);
+
+	assoofs_dcache_remove(sb, parent_inode_info->inode_no, dentry->d_name.name);
+	if(S_ISDIR(inode_info->mode)){
+		assoofs_dcache_forget_dir(sb, inode_info->inode_no);		//Sus entradas ya no se van a buscar
+	}
+	trace_assoofs_remove(dir, dentry->d_name.name, inode->i_ino, inode_info->mode);
+
+    return 0;
+}
+
+/* =========================================================== *
+ *  CONFIGURAR UN BLOQUE LIBRE EN EL MAPA DE BITS
+ * =========================================================== */
+/*
+ * Quien llama tiene assoofs_sb_lock. Si el bloque esta compartido
+ * con otros ficheros solo se descuenta una referencia.
+ */
+void assoofs_set_a_freeblock(struct super_block *sb, uint64_t data_block_number){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct assoofs_super_block_info *super_info = ASSOOFS_SB(sb);
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	//Un bloque compartido por un reflink solo pierde una referencia: sigue en uso
+	if(super_info->block_refcount[data_block_number]){
+		super_info->block_refcount[data_block_number]--;
+		return;
+	}
+
+	//Solo cuenta si el bloque estaba realmente ocupado
+	if(!(super_info->free_blocks & (1ULL << data_block_number))){
+		percpu_counter_inc(&ASSOOFS_FS(sb)->free_blocks);
+	}
+
+	super_info->free_blocks |= (1ULL << data_block_number);
+	atomic64_inc(&ASSOOFS_FS(sb)->frees);
+	trace_assoofs_free_block(sb, data_block_number, super_info->free_blocks);
+
+	//Con discard el bloque espera al siguiente lote; si ya hay uno programado se une a el
+	if(READ_ONCE(ASSOOFS_FS(sb)->discard)){
+		ASSOOFS_FS(sb)->discard_pending |= 1ULL << data_block_number;
+		schedule_delayed_work(&ASSOOFS_FS(sb)->discard_work, ASSOOFS_DISCARD_DELAY);
+	}
+
+}
+
+/* =========================================================== *
+ *  CONSECUCION DE UN NUMERO DE INODO LIBRE
+ * =========================================================== */
+/*
+ * Los numeros de inodo salen de su propio mapa de bits y ya no
+ * dependen del bloque de datos. Se devuelve la posicion libre mas
+ * baja del tramo del almacen del grupo goal (o del siguiente con
+ * sitio), asi que cada grupo sigue compacto tras crear y borrar.
+ */
+int assoofs_sb_get_a_freeinode(struct super_block *sb, unsigned int goal, uint64_t *inode_no){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct assoofs_super_block_info *assoofs_sb;
+	uint64_t slot;
+
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	//--------------------------  MUTEX DEL SUPER BLOQUE  ---------------------------//
+	assoofs_lock(sb, &assoofs_sb_lock);
+
+	assoofs_sb = ASSOOFS_SB(sb);
+
+	if(!assoofs_sb->free_inodes){
+		mutex_unlock(&assoofs_sb_lock);
+		return -1;		//No queda ninguna posicion libre en el almacen
+	}
+
+	slot = __ffs64(assoofs_group_free(assoofs_sb->free_inodes, goal));		//Primer bit a 1 del tramo, en una sola instruccion
+	assoofs_sb->free_inodes &= ~(1ULL << slot);
+	if(slot >= assoofs_sb->inodes_count){
+		assoofs_sb->inodes_count = slot + 1;
+	}
+	assoofs_save_sb_info(sb);
+	percpu_counter_dec(&ASSOOFS_FS(sb)->free_inodes);
+
+	mutex_unlock(&assoofs_sb_lock);
+
+	*inode_no = ASSOOFS_SLOT_INODE(slot);
+	return 0;
+}
+
+/* =========================================================== *
+ *  CONFIGURAR UN INODO LIBRE EN EL MAPA DE BITS
+ * =========================================================== */
+void assoofs_set_a_freeinode(struct super_block *sb, uint64_t inode_no){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct assoofs_super_block_info *super_info = ASSOOFS_SB(sb);
+	uint64_t slot = ASSOOFS_INODE_SLOT(inode_no);
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	//Solo cuenta si la posicion estaba realmente ocupada
+	if(!(super_info->free_inodes & (1ULL << slot))){
+		percpu_counter_inc(&ASSOOFS_FS(sb)->free_inodes);
+	}
+
+	super_info->free_inodes |= (1ULL << slot);
+}
+
+/* =========================================================== *
+ *  LIBERACION DE UN INODO
+ * =========================================================== */
+/*
+ * Marca el inodo como REMOVED en el almacen y devuelve su bloque
+ * de datos y su numero a los mapas de bits del superbloque. Lo
+ * usan el borrado y el rename que sustituye a otro fichero.
+ */
+static void assoofs_release_inode(struct super_block *sb, struct assoofs_inode_info *inode_info){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+	uint64_t pending;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	//-----------------------  MUTEX DEL ALMACEN DE INODOS  -------------------------//
+	assoofs_lock(sb, &assoofs_inodes_block_lock);		//Ordena el borrado frente a assoofs_log_commit
+
+	inode_info->state_flag = ASSOOFS_STATE_REMOVED;
+	assoofs_save_inode_info(sb, inode_info);
+
+	//Modo log: el bloque nuevo que aun no se habia confirmado tambien queda libre
+	spin_lock(&fsi->log_lock);
+	pending = fsi->log_pending[inode_info->inode_no];
+	fsi->log_pending[inode_info->inode_no] = 0;
+	spin_unlock(&fsi->log_lock);
+
+	//--------------------------  MUTEX DEL SUPER BLOQUE  ---------------------------//
+	assoofs_lock(sb, &assoofs_sb_lock);
+
+	//Actualizamos los mapas de bits del superbloque: bloque de datos y numero de inodo quedan libres
+	assoofs_set_a_freeblock(sb, inode_info->data_block_number);
+	if(pending){
+		assoofs_set_a_freeblock(sb, pending);
+	}
+	assoofs_set_a_freeinode(sb, inode_info->inode_no);
+
+	//Reducimos el contador de inodos del superbloque -1
+	ASSOOFS_SB(sb)->real_inodes_count--;
+
+	//Guardamos la informacion modificada en el superbloque
+	assoofs_save_sb_info(sb);
+
+	mutex_unlock(&assoofs_sb_lock);
+	mutex_unlock(&assoofs_inodes_block_lock);
+}
+
+/* =========================================================== *
+ *  BUSQUEDA DE UNA ENTRADA VIVA EN UN DIRECTORIO
+ * =========================================================== */
+static struct assoofs_dir_record_entry *assoofs_find_record(struct buffer_head *bh, struct assoofs_inode_info *dir_info, const char *name){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct assoofs_dir_record_entry *record = (struct assoofs_dir_record_entry *)bh->b_data;
+	struct assoofs_dir_record_entry *end = record + ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(*record);
+	uint64_t alive = 0;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	//Igual que en lookup: las dir_children_count entradas vivas, saltando las borradas
+	for(; record < end && alive < dir_info->dir_children_count; record++){
+		if(record->state_flag != ASSOOFS_STATE_ALIVE){
+			continue;
+		}
+		if(!strcmp(record->filename, name)){
+			return record;
+		}
+		alive++;
+	}
+	return NULL;
+}
+
+/* =========================================================== *
+ *  ADICION DE UNA ENTRADA A UN DIRECTORIO
+ * =========================================================== */
+/*
+ * La nueva entrada va detras de las entradas vivas o, si ya no
+ * queda sitio al final del bloque, en la primera entrada borrada:
+ * las busquedas recorren el bloque hasta contar todas las vivas,
+ * asi que les da igual donde este. Devuelve NULL si el bloque esta
+ * lleno. No toca dir_children_count ni escribe el bloque: eso lo
+ * hace quien llama.
+ */
+static struct assoofs_dir_record_entry *assoofs_add_record(struct buffer_head *bh, struct assoofs_inode_info *dir_info, const char *name, uint64_t inode_no){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct assoofs_dir_record_entry *record = (struct assoofs_dir_record_entry *)bh->b_data;
+	struct assoofs_dir_record_entry *end = record + ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(*record);
+	uint64_t alive = 0;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	for(; record < end && alive < dir_info->dir_children_count; record++){
+		if(record->state_flag == ASSOOFS_STATE_ALIVE){
+			alive++;
+		}
+	}
+
+	if(record == end){
+		for(record = (struct assoofs_dir_record_entry *)bh->b_data; record < end && record->state_flag == ASSOOFS_STATE_ALIVE; record++){
+		}
+	}
+
+	if(record == end){
+		return NULL;		//No cabe ninguna entrada mas en el bloque del directorio
+	}
+
+	memset(record, 0, sizeof(*record));
+	strcpy(record->filename, name);
+	record->inode_no = inode_no;
+	record->state_flag = ASSOOFS_STATE_ALIVE;
+	return record;
+}
+
+/* =========================================================== *
+ *  MOVIMIENTO DE UN ARCHIVO DE SITIO
+ * =========================================================== */
+/* 
+ * El rename solo reescribe entradas de directorio: el inodo y sus
+ * datos no se tocan. Dentro del mismo directorio se cambia el
+ * nombre de la entrada (un bloque); entre directorios se anade la
+ * entrada en el destino y despues se marca REMOVED la del origen
+ * (dos bloques). Si el corte llega entre ambas escrituras queda
+ * el inodo enlazado dos veces, que assoofs-fsck sabe arreglar.
+ *
+ * Flags soportadas:
+ *   RENAME_NOREPLACE: -EEXIST si el destino existe
+ *   RENAME_EXCHANGE:  intercambia los inodos de las dos entradas
+ * Sin flags, un destino existente se sustituye y se libera.
+ */
+static int assoofs_move(struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir, struct dentry *new_dentry, unsigned int flags){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct super_block *sb = old_dir->i_sb;
+	struct assoofs_inode_info *old_dir_info = old_dir->i_private;
+	struct assoofs_inode_info *new_dir_info = new_dir->i_private;
+	struct assoofs_inode_info *moved_info = old_dentry->d_inode->i_private;
+	struct assoofs_inode_info *victim_info = NULL;
+	struct assoofs_dir_record_entry *old_record, *new_record;
+	struct buffer_head *old_bh, *new_bh;
+	int same_dir = old_dir == new_dir;
+	int64_t bytes, inodes, victim_bytes, victim_inodes;
+	int ret = 0;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	if(flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE)){
+		return -EINVAL;
+	}
+
+	if(strlen(new_dentry->d_name.name) >= ASSOOFS_FILENAME_MAXLEN){
+		return -ENAMETOOLONG;
+	}
+
+	if(new_dentry->d_inode){
+		if(flags & RENAME_NOREPLACE){
+			return -EEXIST;
+		}
+		victim_info = new_dentry->d_inode->i_private;
+		if(!(flags & RENAME_EXCHANGE) && S_ISDIR(victim_info->mode) && victim_info->dir_children_count){
+			return -ENOTEMPTY;
+		}
+	}else if(flags & RENAME_EXCHANGE){
+		return -ENOENT;
+	}
+
+	//Los bloques de directorio compartidos con una instantanea se copian antes de tocarlos
+	if(assoofs_unshare_block(old_dir) || assoofs_unshare_block(new_dir)){
+		return -ENOSPC;
+	}
+
+	trace_assoofs_rename(old_dir, old_dentry, new_dir, new_dentry);
+
+	old_bh = assoofs_bread(sb, old_dir_info->data_block_number);
+	new_bh = same_dir ? old_bh : assoofs_bread(sb, new_dir_info->data_block_number);
+
+	old_record = assoofs_find_record(old_bh, old_dir_info, old_dentry->d_name.name);
+	new_record = victim_info ? assoofs_find_record(new_bh, new_dir_info, new_dentry->d_name.name) : NULL;
+	if(!old_record || (victim_info && !new_record)){
+		ret = -ENOENT;
+		goto out;
+	}
+
+	if(flags & RENAME_EXCHANGE){
+		//Cada nombre pasa a apuntar al inodo del otro; los contadores no cambian
+		swap(old_record->inode_no, new_record->inode_no);
+		assoofs_sync_buffer(sb, new_bh);
+		if(!same_dir){
+			assoofs_sync_buffer(sb, old_bh);
+		}
+		assoofs_dcache_remove(sb, old_dir_info->inode_no, old_dentry->d_name.name);
+		assoofs_dcache_remove(sb, new_dir_info->inode_no, new_dentry->d_name.name);
+		assoofs_dcache_add(sb, old_dir_info->inode_no, old_dentry->d_name.name, old_record->inode_no, ASSOOFS_RECORD_SLOT(old_bh, old_record));
+		assoofs_dcache_add(sb, new_dir_info->inode_no, new_dentry->d_name.name, new_record->inode_no, ASSOOFS_RECORD_SLOT(new_bh, new_record));
+
+		//Entre directorios distintos cada lado cambia lo que aportaba uno por lo que aporta el otro
+		if(!same_dir){
+			assoofs_usage_of(moved_info, &bytes, &inodes);
+			assoofs_usage_of(victim_info, &victim_bytes, &victim_inodes);
+			assoofs_usage_update(old_dentry, victim_bytes - bytes, victim_inodes - inodes);
+			assoofs_usage_update(new_dentry, bytes - victim_bytes, inodes - victim_inodes);
+		}
+		goto out;
+	}
+
+	if(new_record){
+		//El destino existe: su entrada pasa a apuntar a nuestro inodo
+		new_record->inode_no = old_record->inode_no;
+	}else if(same_dir){
+		//Mismo directorio y destino nuevo: basta con cambiar el nombre
+		memset(old_record->filename, 0, sizeof(old_record->filename));
+		strcpy(old_record->filename, new_dentry->d_name.name);
+		assoofs_sync_buffer(sb, old_bh);
+		assoofs_dcache_remove(sb, old_dir_info->inode_no, old_dentry->d_name.name);
+		assoofs_dcache_add(sb, old_dir_info->inode_no, new_dentry->d_name.name, old_record->inode_no, ASSOOFS_RECORD_SLOT(old_bh, old_record));
+		goto out;
+	}else{
+		new_record = assoofs_add_record(new_bh, new_dir_info, new_dentry->d_name.name, old_record->inode_no);
+		if(!new_record){
+			ret = -ENOSPC;
+			goto out;
+		}
+	}
+
+	//Primero el destino y despues el origen
+	if(!same_dir){
+		assoofs_sync_buffer(sb, new_bh);
+	}
+	old_record->state_flag = ASSOOFS_STATE_REMOVED;
+	assoofs_sync_buffer(sb, old_bh);
+
+	//La cache de nombres sigue a las entradas: el nombre nuevo con la posicion de su entrada
+	assoofs_dcache_remove(sb, old_dir_info->inode_no, old_dentry->d_name.name);
+	assoofs_dcache_remove(sb, new_dir_info->inode_no, new_dentry->d_name.name);
+	assoofs_dcache_add(sb, new_dir_info->inode_no, new_dentry->d_name.name, new_record->inode_no, ASSOOFS_RECORD_SLOT(new_bh, new_record));
+
+	//-----------------------  MUTEX DEL ALMACEN DE INODOS  -------------------------//
+	assoofs_lock(sb, &assoofs_inodes_block_lock);
+
+	old_dir_info->dir_children_count--;
+	if(!victim_info){
+		new_dir_info->dir_children_count++;
+	}
+	assoofs_save_inode_info(sb, old_dir_info);
+	if(!same_dir && !victim_info){
+		assoofs_save_inode_info(sb, new_dir_info);
+	}
+
+	mutex_unlock(&assoofs_inodes_block_lock);
+
+	//Los totales: lo movido pasa de los antepasados del origen a los del destino y lo sustituido desaparece
+	if(!same_dir){
+		assoofs_usage_of(moved_info, &bytes, &inodes);
+		assoofs_usage_update(old_dentry, -bytes, -inodes);
+		assoofs_usage_update(new_dentry, bytes, inodes);
+	}
+	if(victim_info){
+		assoofs_usage_of(victim_info, &victim_bytes, &victim_inodes);
+		assoofs_usage_update(new_dentry, -victim_bytes, -victim_inodes);
+	}
+
+	//El inodo sustituido ya no tiene ninguna entrada
+	if(victim_info){
+		truncate_inode_pages(&new_dentry->d_inode->i_data, 0);
+		assoofs_release_inode(sb, victim_info);
+		if(S_ISDIR(victim_info->mode)){
+			assoofs_dcache_forget_dir(sb, victim_info->inode_no);
+		}
+	}
+
+out:
+	if(!same_dir){
+		brelse(new_bh);
+	}
+	brelse(old_bh);
+	return ret;
+}
+
+/* =========================================================== *
+ *  GUARDADO DE INFORMACION EN EL SUPERBLOQUE    
+ * =========================================================== */
+void assoofs_save_sb_info(struct super_block *sb){
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	//La informacion persistente del superbloque vive dentro de sb_bh desde el montaje,
+	//asi que basta con llevar ese mismo buffer a disco
+	assoofs_sync_buffer(sb, ASSOOFS_FS(sb)->sb_bh);
+}
+
+/* =========================================================== *
+ *  VENTANA DE BLOQUES RESERVADOS DE ESTA CPU
+ * =========================================================== */
+/*
+ * Camino rapido de assoofs_sb_get_a_freeblock: el bloque mas bajo
+ * de la ventana dentro del grupo goal, sin assoofs_sb_lock y sin
+ * escribir el superbloque (en el mapa de bits del disco ya figura
+ * como ocupado).
+ */
+static int assoofs_window_take(struct super_block *sb, unsigned int goal, uint64_t *block){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct assoofs_block_window *window = raw_cpu_ptr(ASSOOFS_FS(sb)->windows);
+	uint64_t free;
+	int found = 0;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	spin_lock(&window->lock);
+	free = window->free & ASSOOFS_GROUP_MASK(goal);
+	if(free){
+		*block = __ffs64(free);
+		window->free &= ~(1ULL << *block);
+		found = 1;
+	}
+	spin_unlock(&window->lock);
+	return found;
+}
+
+/* =========================================================== *
+ *  DEVOLUCION DE LAS RESERVAS AL MAPA DE BITS
+ * =========================================================== */
+/*
+ * Vacia las ventanas de todas las CPU y devuelve sus bloques al
+ * mapa de bits global. Quien llama tiene assoofs_sb_lock y se
+ * encarga de guardar el superbloque si devuelve 1.
+ */
+static int assoofs_return_reservations(struct super_block *sb){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+	struct assoofs_block_window *window;
+	struct assoofs_prealloc *pa;
+	uint64_t returned = 0;
+	int cpu;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	for_each_possible_cpu(cpu){
+		window = per_cpu_ptr(fsi->windows, cpu);
+		spin_lock(&window->lock);
+		returned |= window->free;
+		window->free = 0;
+		spin_unlock(&window->lock);
+	}
+
+	//Y las preasignaciones de los ficheros abiertos en modo log, que vuelven a empezar con otra reserva
+	spin_lock(&fsi->prealloc_lock);
+	list_for_each_entry(pa, &fsi->prealloc, list){
+		returned |= pa->blocks;
+		pa->blocks = 0;
+	}
+	spin_unlock(&fsi->prealloc_lock);
+
+	if(!returned){
+		return 0;
+	}
+
+	fsi->sb_info->free_blocks |= returned;
+	trace_assoofs_reserve(sb, returned, 0);
+	return 1;
+}
+
+/* =========================================================== *
+ *  CONSECUCION DE UN BLOQUE LIBRE EN EL SUPERBLOQUE    
+ * =========================================================== */
+/*
+ * El bloque sale del grupo goal (el del directorio del fichero) o,
+ * si esta lleno, del siguiente grupo con sitio, de modo que los
+ * datos de un directorio, su bloque y sus inodos quedan cerca.
+ *
+ * Cada CPU tiene una ventana de hasta ASSOOFS_RESERVE_WINDOW
+ * bloques contiguos sacados del mapa de bits de una vez, sin pasar
+ * de un grupo a otro. Mientras quede alguno en el grupo pedido,
+ * reservar no toca el cerrojo global ni el disco y los ficheros
+ * creados desde la misma CPU quedan seguidos.
+ *
+ * Si no, se toma assoofs_sb_lock, se saca el primer bloque libre
+ * del grupo y los contiguos que le siguen y se guarda el
+ * superbloque una sola vez para todos. Si el mapa esta vacio se
+ * recuperan antes las reservas de las demas CPU.
+ */
+int assoofs_sb_get_a_freeblock(struct super_block *sb, unsigned int goal, uint64_t *block){
+	
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+	struct assoofs_super_block_info *assoofs_sb;
+	struct assoofs_block_window *window;
+	uint64_t free, run = 0;
+	int i, n;
+
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	if(assoofs_window_take(sb, goal, block)){
+		goto out;
+	}
+
+	//--------------------------  MUTEX DEL SUPER BLOQUE  ---------------------------//
+    assoofs_lock(sb, &assoofs_sb_lock);
+
+	assoofs_sb = ASSOOFS_SB(sb);		//OBTENEMOS LA INFORMACION PERSISTENTE DEL SUPERBLOQUE
+
+	//LOS BLOQUES 0 Y 1 (SUPERBLOQUE Y ALMACEN DE INODOS) NUNCA SE RESERVAN, NI LOS QUE SE DESCARTAN
+	free = assoofs_allocatable(sb);
+	if(!free && assoofs_return_reservations(sb)){
+		free = assoofs_allocatable(sb);
+	}
+	if(!free){
+		mutex_unlock(&assoofs_sb_lock);
+		return -1;		//No queda ningun bloque libre, ni en el mapa ni en las ventanas
+	}
+
+	//EL PRIMER BLOQUE LIBRE DEL GRUPO Y LOS QUE LE SIGUEN CONTIGUOS, HASTA LLENAR LA VENTANA
+	free = assoofs_group_free(free, goal);
+	i = __ffs64(free);
+	for(n = i; n < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED && n < i + ASSOOFS_RESERVE_WINDOW && (free & (1ULL << n)); n++){
+		run |= 1ULL << n;
+	}
+
+	assoofs_sb->free_blocks &= ~run;
+	assoofs_save_sb_info(sb);
+	trace_assoofs_reserve(sb, run, 1);
+
+	//El primero es para nosotros y el resto queda en la ventana de esta CPU
+	*block = i;
+	window = raw_cpu_ptr(fsi->windows);
+	spin_lock(&window->lock);
+	window->free |= run & ~(1ULL << i);
+	spin_unlock(&window->lock);
+
+	mutex_unlock(&assoofs_sb_lock);
+
+out:
+	atomic64_inc(&fsi->allocs);
+	percpu_counter_dec(&fsi->free_blocks);
+	trace_assoofs_alloc_block(sb, *block, READ_ONCE(fsi->sb_info->free_blocks));
+	return 0;
+}
+
+/* =========================================================== *
+ *  GRUPO DE UN DIRECTORIO NUEVO
+ * =========================================================== */
+/*
+ * Los ficheros se quedan en el grupo de su directorio y cada
+ * directorio nuevo va al grupo con mas bloques libres, para que
+ * los directorios se repartan y cada uno tenga sitio alrededor
+ * para su contenido. Con empate gana el primero despues del grupo
+ * del padre: varios mkdir seguidos acaban en grupos distintos.
+ */
+static unsigned int assoofs_dir_group(struct super_block *sb, unsigned int parent_group){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	unsigned int i, g, best = parent_group;
+	uint64_t free;
+	int n, most = -1;
+
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	//--------------------------  MUTEX DEL SUPER BLOQUE  ---------------------------//
+	assoofs_lock(sb, &assoofs_sb_lock);
+
+	free = assoofs_allocatable(sb);
+	for(i = 1; i <= ASSOOFS_GROUPS; i++){
+		g = (parent_group + i) % ASSOOFS_GROUPS;
+		n = hweight64(free & ASSOOFS_GROUP_MASK(g));
+		if(n > most){
+			most = n;
+			best = g;
+		}
+	}
+
+	mutex_unlock(&assoofs_sb_lock);
+	return best;
+}
+
+/* =========================================================== *
+ *  SIGUIENTE BLOQUE LIBRE DEL LOG
+ * =========================================================== */
+/*
+ * En modo log los bloques de datos se dan en orden: el primero
+ * libre a partir de la cabeza del log, que avanza y da la vuelta
+ * al llegar al final. No usa las ventanas por CPU, que repartirian
+ * el log entre las CPUs.
+ *
+ * assoofs_log_reserve saca de una vez hasta want bloques contiguos
+ * desde ese punto (las preasignaciones, ver assoofs_log_prealloc);
+ * con poco espacio se queda en una cuarta parte de lo libre para
+ * no dejar sin sitio a los demas ficheros.
+ */
+static int assoofs_log_reserve(struct super_block *sb, unsigned int want, uint64_t *run){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+	struct assoofs_super_block_info *assoofs_sb = ASSOOFS_SB(sb);
+	uint64_t free, ahead;
+	unsigned int i, n;
+
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	//--------------------------  MUTEX DEL SUPER BLOQUE  ---------------------------//
+	assoofs_lock(sb, &assoofs_sb_lock);
+
+	free = assoofs_allocatable(sb);
+	if(!free && assoofs_return_reservations(sb)){
+		free = assoofs_allocatable(sb);
+	}
+	if(!free){
+		mutex_unlock(&assoofs_sb_lock);
+		return -1;
+	}
+
+	//Primero lo que queda por delante de la cabeza; si no hay nada, se da la vuelta
+	ahead = free & ~((1ULL << fsi->log_head) - 1);
+	i = __ffs64(ahead ? ahead : free);
+	want = clamp_t(unsigned int, hweight64(free) / 4, 1, want);
+	for(n = i, *run = 0; n < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED && n < i + want && (free & (1ULL << n)); n++){
+		*run |= 1ULL << n;
+	}
+	fsi->log_head = n % ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED;
+
+	assoofs_sb->free_blocks &= ~*run;
+	assoofs_save_sb_info(sb);
+
+	mutex_unlock(&assoofs_sb_lock);
+	return 0;
+}
+
+static int assoofs_log_get_a_freeblock(struct super_block *sb, uint64_t *block){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+	uint64_t run;
+
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	if(assoofs_log_reserve(sb, 1, &run)){
+		return -1;
+	}
+	*block = __ffs64(run);
+
+	atomic64_inc(&fsi->allocs);
+	percpu_counter_dec(&fsi->free_blocks);
+	trace_assoofs_alloc_block(sb, *block, READ_ONCE(fsi->sb_info->free_blocks));
+	return 0;
+}
+
+/* =========================================================== *
+ *  ADICION DE INFORMACION A UN NODO   
+ * =========================================================== */
+void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode){
+	
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct buffer_head *bh;
+	struct assoofs_inode_info *inode_info;
+	struct assoofs_super_block_info *assoofs_sb = ASSOOFS_SB(sb);
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+    //-----------------------  MUTEX DEL ALMACEN DE INODOS  -------------------------//
+    assoofs_lock(sb, &assoofs_inodes_block_lock);
+
+    bh = assoofs_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);		//Leer de disco el bloque con el almacen de inodos
+
+    //La posicion del almacen la fija el numero de inodo, reservado antes en el mapa de bits
+    inode_info = (struct assoofs_inode_info *)bh->b_data + ASSOOFS_INODE_SLOT(inode->inode_no);
+	
+	//--------------------------  MUTEX DEL SUPER BLOQUE  ---------------------------//
+    assoofs_lock(sb, &assoofs_sb_lock);
+
+	memcpy(inode_info, inode, sizeof(struct assoofs_inode_info));
+
+	assoofs_sync_buffer(sb, bh);		//SINCRONIZAMOS
+	brelse(bh);					//liberamos memoria del bufferhead
+
+	assoofs_sb->real_inodes_count++;		
+	assoofs_save_sb_info(sb);
+
+	mutex_unlock(&assoofs_sb_lock);
+	mutex_unlock(&assoofs_inodes_block_lock);
+}
+
+/* =========================================================== *
+ *  GUARDADO DE LA INFORMACION DE UN INODO    
+ * =========================================================== */
+int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info){
+	
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct buffer_head *bh;
+	struct assoofs_inode_info *inode_pos;
+
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	//ACCEDEMOS A DISCO PARA LEER EL BLOQUE QUE CONTIENE EL ALMACEN DE INODOS
+	bh = assoofs_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+
+	//--------------------------  MUTEX DEL SUPER BLOQUE  ---------------------------//
+    assoofs_lock(sb, &assoofs_sb_lock);
+
+	inode_pos = assoofs_search_inode_info(sb, (struct assoofs_inode_info *)bh->b_data, inode_info);  //BUSCAMOS LA POSICION DE UN NODO EN CONCRETO
+	if(!inode_pos){
+		brelse(bh);
+		mutex_unlock(&assoofs_sb_lock);
+		return -1;
+	}
+
+	memcpy(inode_pos, inode_info, sizeof(*inode_pos));    //METEMOS LA INFORMACION EN LA INFORMACION DEL INODO
+	assoofs_sync_buffer(sb, bh);		//SINCRONIZAMOS
+	brelse(bh);					//liberamos memoria del bufferheadinodes_count
+
+	mutex_unlock(&assoofs_sb_lock);
+	return 0;
+}
+
+/* =========================================================== *
+ *  BÚSQUEDA DE INFORMACIÓN DEL INODO    
+ * =========================================================== */
+struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *start, struct assoofs_inode_info *search){
+	
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	uint64_t slot = ASSOOFS_INODE_SLOT(search->inode_no);
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	//YA NO HAY QUE RECORRER EL ALMACEN: EL INODO N ESTA EN LA POSICION N - 1
+	if (slot >= ASSOOFS_SB(sb)->inodes_count){
+		return NULL;
+	}
+	start += slot;
+
+	if (start->inode_no == search->inode_no){
+		return start;  //si es el nodo que estabamos buscando lo devolvemos
+	}else{
+		return NULL; //si no, devolvemos null en senial de que no lo hemos encontrado
+	}
+}
+
+/* =========================================================== *
+ *  TOTALES RECURSIVOS DE LOS DIRECTORIOS (VERSION 6)
+ * =========================================================== */
+/*
+ * Cada directorio guarda en usage_bytes y usage_inodes todo lo
+ * que cuelga de el, a cualquier profundidad, asi que du o una
+ * comprobacion de cuota no tienen que recorrer el subarbol. Cada
+ * cambio se suma a la cadena de antepasados de la dentry que lo
+ * produce (sin contarla a ella): no hay que buscarlos, porque
+ * cada dentry tiene fijado a su padre y sus inodos estan en
+ * memoria con su i_private.
+ */
+static void assoofs_usage_of(struct assoofs_inode_info *inode_info, int64_t *bytes, int64_t *inodes){
+	//Lo que aporta un objeto a sus antepasados: el mismo y, si es un directorio, todo lo que tiene debajo
+	if(S_ISDIR(inode_info->mode)){
+		*bytes = inode_info->usage_bytes;
+		*inodes = inode_info->usage_inodes + 1;
+	}else{
+		*bytes = inode_info->file_size;
+		*inodes = 1;
+	}
+}
+
+static void assoofs_usage_update(struct dentry *dentry, int64_t bytes, int64_t inodes){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct super_block *sb = dentry->d_sb;
+	struct dentry *chain[ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED];
+	struct assoofs_inode_info *dir_info, *table;
+	struct buffer_head *bh;
+	uint64_t slot;
+	int depth = 0, i;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	if((!bytes && !inodes) || sb_rdonly(sb)){
+		return;
+	}
+
+	//Cada antepasado con su referencia: un rename no los puede soltar mientras se actualizan
+	while(!IS_ROOT(dentry) && depth < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
+		dentry = dget_parent(dentry);
+		chain[depth++] = dentry;
+	}
+
+	//-----------------------  MUTEX DEL ALMACEN DE INODOS  -------------------------//
+	assoofs_lock(sb, &assoofs_inodes_block_lock);
+
+	bh = assoofs_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+	table = (struct assoofs_inode_info *)bh->b_data;
+
+	//--------------------------  MUTEX DEL SUPER BLOQUE  ---------------------------//
+	assoofs_lock(sb, &assoofs_sb_lock);		//El mismo que assoofs_save_inode_info: nadie copia un i_private a medias
+
+	//Memoria y almacen a la vez, y un solo sync del bloque para toda la cadena
+	for(i = 0; i < depth; i++){
+		dir_info = d_inode(chain[i])->i_private;
+		dir_info->usage_bytes += bytes;
+		dir_info->usage_inodes += inodes;
+		slot = ASSOOFS_INODE_SLOT(dir_info->inode_no);
+		if(slot < ASSOOFS_SB(sb)->inodes_count && table[slot].inode_no == dir_info->inode_no){
+			table[slot].usage_bytes = dir_info->usage_bytes;
+			table[slot].usage_inodes = dir_info->usage_inodes;
+		}
+	}
+	assoofs_sync_buffer(sb, bh);
+
+	mutex_unlock(&assoofs_sb_lock);
+	brelse(bh);
+	mutex_unlock(&assoofs_inodes_block_lock);
+
+	//Fuera de los cerrojos: el ultimo dput puede llegar a desalojar un inodo
+	for(i = 0; i < depth; i++){
+		dput(chain[i]);
+	}
+	trace_assoofs_usage(sb, bytes, inodes, depth);
+}
+
+/* =========================================================== *
+ *  CONSECUCIÓN DE LOS INODOS QUE NECESITAMOS
+ * =========================================================== */
+static struct inode *assoofs_get_inode(struct super_block *sb, int ino){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct assoofs_inode_info *inode_info;
+	struct inode *inode;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	//PASO 1, recolectamos la información persistente del nodo
+	inode_info = assoofs_get_inode_info(sb, ino);
+
+	//Creamos el inodo
+	inode = new_inode(sb);
+
+	//Asignamos parametros al inodo que hemos creado
+	inode->i_ino = ino;
+	inode->i_sb = sb;
+	inode->i_op = &assoofs_inode_ops;
+
+	//DEPENDIENDO DEL TIPO DE ARCHIVO QUE SEA SE LE ASIGNAN UNAS OPERACIONES U OTRAS
+	if (S_ISDIR(inode_info->mode)){
+		inode->i_fop = &assoofs_dir_operations;
+	}else if (S_ISREG(inode_info->mode)){
+		inode->i_fop = &assoofs_file_operations;
+		inode->i_mapping->a_ops = &assoofs_aops;
+		inode->i_size = inode_info->file_size;
+	}else{
+		printk(KERN_ERR "Unknown inode type. Neither a directory nor a file.");
+	}
+
+	//SETEAMOS EL TIEPO Y DEVOLVEMOS EL INODO
+	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+	inode->i_private = inode_info;
+	return inode;
+}
+
+/* =========================================================== *
+ *  IMAGENES EMPAQUETADAS DE SOLO LECTURA
+ * =========================================================== */
+/*
+ * Con ASSOOFS_FEATURE_PACKED (mkassoofs -p) no hay mapas de bits,
+ * entradas borradas ni nombres de 255 bytes fijos: la tabla de
+ * inodos se lee entera al montar (fsi->packed), cada inodo apunta a
+ * un byte de la imagen y los directorios son listas de entradas de
+ * tamano variable. Solo se monta en solo lectura y tiene sus propias
+ * operaciones, asi que el resto del modulo nunca ve estos inodos.
+ */
+static struct dentry *assoofs_packed_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags);
+static int assoofs_packed_iterate(struct file *filp, struct dir_context *ctx);
+static int assoofs_packed_readpage(struct file *file, struct page *page);
+static long assoofs_packed_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+
+static const struct inode_operations assoofs_packed_dir_inode_ops = {
+    .lookup = assoofs_packed_lookup,
+};
+
+static const struct file_operations assoofs_packed_dir_operations = {
+    .owner = THIS_MODULE,
+    .llseek = generic_file_llseek,
+    .read = generic_read_dir,
+    .iterate_shared = assoofs_packed_iterate,      //Nada cambia: varios readdir a la vez sin el cerrojo del inodo
+    .unlocked_ioctl = assoofs_packed_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+};
+
+static const struct file_operations assoofs_packed_file_operations = {
+    .llseek = generic_file_llseek,
+    .read_iter = generic_file_read_iter,
+    .mmap = generic_file_readonly_mmap,
+    .splice_read = generic_file_splice_read,
+    .unlocked_ioctl = assoofs_packed_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+};
+
+static const struct address_space_operations assoofs_packed_aops = {
+    .readpage = assoofs_packed_readpage,
+};
+
+//Entradas de un directorio como mucho: 64 objetos con el nombre mas largo
+#define ASSOOFS_PACKED_DIR_MAX (ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED * (sizeof(struct assoofs_packed_dirent) + ASSOOFS_FILENAME_MAXLEN))
+
+//Copia len bytes de la imagen a partir del byte offset, bloque a bloque
+static int assoofs_packed_read(struct super_block *sb, uint64_t offset, void *buf, size_t len) {
+    struct buffer_head *bh;
+    size_t n;
+
+    while (len) {
+        bh = assoofs_bread(sb, offset / ASSOOFS_DEFAULT_BLOCK_SIZE);
+        if (!bh)
+            return -EIO;
+        n = min_t(size_t, len, ASSOOFS_DEFAULT_BLOCK_SIZE - offset % ASSOOFS_DEFAULT_BLOCK_SIZE);
+        memcpy(buf, bh->b_data + offset % ASSOOFS_DEFAULT_BLOCK_SIZE, n);
+        brelse(bh);
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+//Las entradas de un directorio en un buffer nuevo (kfree al terminar)
+static char *assoofs_packed_dir(struct super_block *sb, struct assoofs_packed_inode *dir) {
+    char *buf = kmalloc(dir->size ? dir->size : 1, GFP_KERNEL);
+
+    if (!buf)
+        return ERR_PTR(-ENOMEM);
+    if (assoofs_packed_read(sb, dir->offset, buf, dir->size)) {
+        kfree(buf);
+        return ERR_PTR(-EIO);
+    }
+    return buf;
+}
+
+//Siguiente entrada a partir de p, o NULL si no queda otra entera antes de end
+static struct assoofs_packed_dirent *assoofs_packed_next(char *p, char *end) {
+    struct assoofs_packed_dirent *de = (struct assoofs_packed_dirent *)p;
+
+    if (p + sizeof(*de) > end || p + sizeof(*de) + de->name_len > end)
+        return NULL;
+    return de;
+}
+
+/* =========================================================== *
+ *  IMAGEN EMPAQUETADA: TABLA DE INODOS
+ * =========================================================== */
+/*
+ * Se lee al montar y se comprueba que cada inodo apunte dentro de
+ * la imagen; a partir de ahi ningun acceso vuelve a comprobarlo.
+ */
+static int assoofs_packed_load(struct super_block *sb){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+	struct assoofs_packed_inode *pi;
+	uint64_t count = fsi->sb_info->inodes_count;
+	uint64_t end = fsi->sb_info->blocks_count * ASSOOFS_DEFAULT_BLOCK_SIZE;
+	uint64_t i;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	if(!count || count > ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED || ASSOOFS_PACKED_INODES_OFFSET + count * sizeof(*pi) > end){
+		printk(KERN_ERR "assoofs packed image has a bad inode count (%llu).\n", count);
+		return -1;
+	}
+
+	fsi->packed = kmalloc_array(count, sizeof(*pi), GFP_KERNEL);
+	if(!fsi->packed || assoofs_packed_read(sb, ASSOOFS_PACKED_INODES_OFFSET, fsi->packed, count * sizeof(*pi))){
+		return -1;
+	}
+
+	for(i = 0; i < count; i++){
+		pi = &fsi->packed[i];
+		if(S_ISREG(pi->mode) && pi->size <= ASSOOFS_PACKED_INLINE){
+			continue;		//Los datos van en el propio inodo
+		}
+		if((!S_ISREG(pi->mode) && !S_ISDIR(pi->mode)) || (S_ISREG(pi->mode) && pi->size > ASSOOFS_DEFAULT_BLOCK_SIZE) ||
+		   (S_ISDIR(pi->mode) && pi->size > ASSOOFS_PACKED_DIR_MAX) || pi->offset > end || pi->size > end - pi->offset){
+			printk(KERN_ERR "assoofs packed image: inode %llu is corrupted.\n", i + ASSOOFS_ROOTDIR_INODE_NUMBER);
+			return -1;
+		}
+	}
+
+	if(!S_ISDIR(fsi->packed[0].mode)){
+		printk(KERN_ERR "assoofs packed image: the root inode is not a directory.\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* =========================================================== *
+ *  IMAGEN EMPAQUETADA: OBTENER UN INODO
+ * =========================================================== */
+static struct inode *assoofs_packed_get_inode(struct super_block *sb, struct inode *dir, uint64_t ino){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+	struct assoofs_packed_inode *pi;
+	struct inode *inode;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	if(ino < ASSOOFS_ROOTDIR_INODE_NUMBER || ino > fsi->sb_info->inodes_count){
+		return NULL;
+	}
+	pi = &fsi->packed[ASSOOFS_INODE_SLOT(ino)];
+
+	inode = new_inode(sb);
+	if(!inode){
+		return NULL;
+	}
+	inode->i_ino = ino;
+	inode_init_owner(inode, dir, pi->mode);
+
+	if(S_ISDIR(pi->mode)){
+		inode->i_op = &assoofs_packed_dir_inode_ops;
+		inode->i_fop = &assoofs_packed_dir_operations;
+	}else{
+		inode->i_fop = &assoofs_packed_file_operations;
+		inode->i_mapping->a_ops = &assoofs_packed_aops;
+	}
+	inode->i_size = pi->size;
+
+	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+	inode->i_private = pi;
+	return inode;
+}
+
+/* =========================================================== *
+ *  IMAGEN EMPAQUETADA: LOOKUP
+ * =========================================================== */
+static struct dentry *assoofs_packed_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct super_block *sb = dir->i_sb;
+	struct assoofs_packed_inode *pi = dir->i_private;
+	struct assoofs_packed_dirent *de;
+	struct inode *inode = NULL;
+	char *buf, *p;
+	uint64_t ino = 0;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	buf = assoofs_packed_dir(sb, pi);
+	if(IS_ERR(buf)){
+		return ERR_CAST(buf);
+	}
+
+	for(p = buf; (de = assoofs_packed_next(p, buf + pi->size)); p += sizeof(*de) + de->name_len){
+		if(de->name_len == dentry->d_name.len && !memcmp(de->name, dentry->d_name.name, de->name_len)){
+			ino = de->inode_no;
+			break;
+		}
+	}
+	kfree(buf);
+
+	if(ino){
+		inode = assoofs_packed_get_inode(sb, dir, ino);
+		if(!inode){
+			return ERR_PTR(-EIO);
+		}
+		atomic64_inc(&ASSOOFS_FS(sb)->lookup_hit);
+	}else{
+		atomic64_inc(&ASSOOFS_FS(sb)->lookup_miss);		//Dentry negativa, como en assoofs_lookup
+	}
+	trace_assoofs_lookup(dir, dentry->d_name.name, ino);
+
+	d_add(dentry, inode);
+	return NULL;
+}
+
+/* =========================================================== *
+ *  IMAGEN EMPAQUETADA: ITERATE
+ * =========================================================== */
+/*
+ * ctx->pos es 0 y 1 para . y .., y despues 2 mas el byte de la
+ * siguiente entrada dentro de la lista del directorio.
+ */
+static int assoofs_packed_iterate(struct file *filp, struct dir_context *ctx){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct inode *inode = file_inode(filp);
+	struct assoofs_fs_info *fsi = ASSOOFS_FS(inode->i_sb);
+	struct assoofs_packed_inode *pi = inode->i_private;
+	struct assoofs_packed_dirent *de;
+	char *buf, *p;
+	int emitted = 0;
+	unsigned char type;
+
+
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
+
+	if(!dir_emit_dots(filp, ctx) || ctx->pos - 2 >= pi->size){
+		return 0;
+	}
+
+	buf = assoofs_packed_dir(inode->i_sb, pi);
+	if(IS_ERR(buf)){
+		return PTR_ERR(buf);
+	}
+
+	for(p = buf + ctx->pos - 2; (de = assoofs_packed_next(p, buf + pi->size)); p += sizeof(*de) + de->name_len){
+		type = DT_UNKNOWN;
+		if(de->inode_no >= ASSOOFS_ROOTDIR_INODE_NUMBER && de->inode_no <= fsi->sb_info->inodes_count){
+			type = S_ISDIR(fsi->packed[ASSOOFS_INODE_SLOT(de->inode_no)].mode) ? DT_DIR : DT_REG;
+		}
+		if(!dir_emit(ctx, de->name, de->name_len, de->inode_no, type)){
+			break;
+		}
+		ctx->pos += sizeof(*de) + de->name_len;
+		emitted++;
+	}
+
+	kfree(buf);
+	trace_assoofs_iterate(inode, emitted);
+	return 0;
+}
+
+/* =========================================================== *
+ *  IMAGEN EMPAQUETADA: LECTURA DE UNA PAGINA
+ * =========================================================== */
+/*
+ * Los datos no estan alineados a bloque, asi que no hay get_block:
+ * se copian del bloque del dispositivo (o del propio inodo) a la
+ * pagina y el resto se deja a cero.
+ */
+static int assoofs_packed_readpage(struct file *file, struct page *page){
+
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct inode *inode = page->mapping->host;
+	struct assoofs_packed_inode *pi = inode->i_private;
+	void *kaddr;
+	int ret = 0;
 
-	//IMPRESION DE LA TRAZA CORRESPONDIENTE AL USO DE ESTA FUNCION
-	printk(KERN_INFO B "New file request" RC "\n"); 
 
     /* ++++++++++++++++++++++++++++++++++++++++++++ /
      *      PROCECEMOS CON EL DESARROLLO           * 
     / ++++++++++++++++++++++++++++++++++++++++++++ */
 
-    sb = dir->i_sb;			//OBTENEMOS UN PUNTERO AL SUPERBLOQUE DESDE DIR
-
-    //-----------------------  MUTEX DEL ALMACEN DE INODOS  -------------------------//
-    mutex_lock_interruptible(&assoofs_inodes_block_lock);
+	kaddr = kmap(page);
+	memset(kaddr, 0, PAGE_SIZE);
+	if(page->index == 0 && pi->size){
+		if(pi->size <= ASSOOFS_PACKED_INLINE){
+			memcpy(kaddr, pi->data, pi->size);
+		}else{
+			ret = assoofs_packed_read(inode->i_sb, pi->offset, kaddr, min_t(size_t, pi->size, PAGE_SIZE));
+		}
+	}
+	flush_dcache_page(page);
+	kunmap(page);
 
-    count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count;
-    						//OBTENGO EL NUMERO DE INODOS DE LA INFORMACION PERSISTENTE DEL SUPERBLOQUE
+	if(ret){
+		SetPageError(page);
+	}else{
+		SetPageUptodate(page);
+	}
+	unlock_page(page);
+	return ret;
+}
 
-    mutex_unlock(&assoofs_inodes_block_lock);
+//En una imagen empaquetada solo tiene sentido preguntar lo que ocupa algo
+static long assoofs_packed_ioctl(struct file *file, unsigned int cmd, unsigned long arg){
+	struct assoofs_packed_inode *pi = file_inode(file)->i_private;
+	struct assoofs_usage usage;
 
-    if(count >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
-    	printk(KERN_ERR "There are too much inodes in the filesystem. Erase some of them to create one more\n");
-    	printk(KERN_INFO "\n");
-    	return -1;
-    }
+	if(cmd != ASSOOFS_IOC_GET_USAGE){
+		return -ENOTTY;
+	}
 
-    inode = new_inode(sb);
-    printk(KERN_INFO "Node created correctly\n");
+	usage.bytes = S_ISDIR(pi->mode) ? pi->usage_bytes : pi->size;
+	usage.inodes = S_ISDIR(pi->mode) ? pi->usage_inodes : 0;
+	return copy_to_user((void __user *)arg, &usage, sizeof(usage)) ? -EFAULT : 0;
+}
 
-    assoofs_sb_get_a_freeblock(sb, &block_number);  //Para asignarle un bloque vacío
+/* =========================================================== *
+ *  OPERACIONES SOBRE EL SUPERBLOQUE  
+ * =========================================================== */
+static void assoofs_put_super(struct super_block *sb);
+static int assoofs_sync_fs(struct super_block *sb, int wait);
+static int assoofs_statfs(struct dentry *dentry, struct kstatfs *buf);
+static void assoofs_evict_inode(struct inode *inode);
+static int assoofs_show_options(struct seq_file *m, struct dentry *root);
+static int assoofs_remount(struct super_block *sb, int *flags, char *data);
+static const struct super_operations assoofs_sops = {
+    .drop_inode = generic_delete_inode,
+    .evict_inode = assoofs_evict_inode,
+    .put_super = assoofs_put_super,
+    .sync_fs = assoofs_sync_fs,
+    .statfs = assoofs_statfs,
+    .show_options = assoofs_show_options,
+    .remount_fs = assoofs_remount,
+};
 
-    inode->i_ino = block_number-1;  //NECESARIO PARA EL REMOVE, ASIGNAMOS SIEMPRE EL NUMERO DE BLOQUE LIBRE - 1
+/* =========================================================== *
+ *  REMONTAJE
+ * =========================================================== */
+/*
+ * Las instantaneas y las imagenes empaquetadas no tienen nada que
+ * se pueda escribir: mount -o remount,rw se rechaza en ambos casos.
+ */
+static int assoofs_remount(struct super_block *sb, int *flags, char *data) {
+	struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
 
-    inode->i_sb = sb;
-    inode->i_op = &assoofs_inode_ops;
-    inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+	sync_filesystem(sb);
+	if(!(*flags & SB_RDONLY) && (fsi->snapshot || fsi->packed)){
+		return -EROFS;
+	}
+	return 0;
+}
 
-    //una vez asignado esto, vamos a almacenar el campo i_private del nodo, que contendrá datos persistentes que habrá que llevar a disco
-    inode_info = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);
-    printk(KERN_INFO "Space in cache reserved correctly\n");	
+/* =========================================================== *
+ *  EXPULSION DE UN INODO DE MEMORIA
+ * =========================================================== */
+/*
+ * Los inodos no se quedan en cache (generic_delete_inode), asi que
+ * las paginas sucias de un fichero vivo se llevan a disco aqui antes
+ * de tirarlas; de un fichero borrado se tiran sin mas.
+ */
+static void assoofs_evict_inode(struct inode *inode) {
+	struct assoofs_inode_info *inode_info = inode->i_private;
 
-    inode_info->inode_no = inode->i_ino;		
-    inode_info->mode = mode;
-    inode_info->file_size = 0;
-    inode_info->data_block_number = block_number;  //Para asignarle un bloque vacío
-    inode_info->state_flag = ASSOOFS_STATE_ALIVE;	//necesario para el remove
+	//En una imagen empaquetada i_private es otra estructura y no hay nada que escribir
+	if(ASSOOFS_FS(inode->i_sb)->packed){
+		inode_info = NULL;
+	}
 
-    inode->i_private = inode_info;
+	if(inode_info && S_ISREG(inode_info->mode) && inode_info->state_flag == ASSOOFS_STATE_ALIVE){
+		filemap_write_and_wait(inode->i_mapping);
+		if(ASSOOFS_FS(inode->i_sb)->log_mode){
+			assoofs_log_commit(inode);		//Por si writepage ya escribio la pagina y nadie lo confirmo
+		}
+	}
+	truncate_inode_pages_final(&inode->i_data);
+	clear_inode(inode);
+}
 
-    inode->i_fop=&assoofs_file_operations;
-    inode_init_owner(inode, dir, mode);
-    d_add(dentry, inode);
+/* =========================================================== *
+ *  SINCRONIZACION DEL SUPERBLOQUE
+ * =========================================================== */
+/*
+ * Vuelca los contadores por CPU en el superbloque. El mapa de
+ * bits y los contadores de inodos ya se escriben en cada cambio,
+ * asi que aqui solo hay que llevar a disco los dos totales.
+ */
+static int assoofs_sync_fs(struct super_block *sb, int wait) {
+	struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
 
-    assoofs_add_inode_info(sb, inode_info);							//Para guardar la informacion persistente del nuevo nodo en disco
+	assoofs_lock(sb, &assoofs_sb_lock);
 
-    //AHORA PASO 2
-    //MODIFICAR EL CONTENIDO DEL DIRECTORIO PADRE AÑADIENDO UNA ENTRADA PARA EL NUEVO ARCHIVO O DIRECTORIO
-	parent_inode_info = dir->i_private;
-										//cogemos la informacion del directorio padre, que alguna funcion ya lo habra seteado
-	bh = sb_bread(sb, parent_inode_info->data_block_number);
-										//leemos del disco la parte de losdatos y la metemos en dir_contents. 
-	dir_contents = (struct assoofs_dir_record_entry *)bh->b_data;
-										//APUNTA AL PRINCIPIO DEL DIRECTORIO PADRE
-	
-	for(i=0; i < parent_inode_info->dir_children_count; i++){
-		if(dir_contents->state_flag == ASSOOFS_STATE_REMOVED){
-			i--;
-		}
-		dir_contents++;
-	}
-										//Para avanzar vamos sumando cosas. Cuando le sumamos el num de elementos avanzamos al final del directorio padre
-	dir_contents->inode_no = inode_info->inode_no; // inode_info es la información persistente del inodo creado en el paso 2.
-										//Colocamos lo que hemos hecho antes con inode info
-	strcpy(dir_contents->filename, dentry->d_name.name);
-										//Tenemos que copiar el nombre del fichero
-	dir_contents->state_flag = ASSOOFS_STATE_ALIVE;
-										//NECESARIO PARA EL REMOVE
+	//Los bloques reservados sin usar vuelven al mapa antes de escribirlo
+	assoofs_return_reservations(sb);
 
-	//Escribir en disco
-	mark_buffer_dirty(bh);		//PONEMOS EL BIT A SUCIO
-	sync_dirty_buffer(bh);		//FORZAMOS LA SINCRONIZACION. Todos los cambios que esten en dirty, se trasladaran a disco
-	printk(KERN_INFO "File created and stored correctly\n");
-	brelse(bh);					//liberamos memoria del bufferhead
+	fsi->sb_info->free_blocks_count = percpu_counter_sum_positive(&fsi->free_blocks);
+	fsi->sb_info->free_inodes_count = percpu_counter_sum_positive(&fsi->free_inodes);
 
-	//-----------------------  MUTEX DEL ALMACEN DE INODOS  -------------------------//
-    mutex_lock_interruptible(&assoofs_inodes_block_lock);
+	if(wait){
+		assoofs_sync_buffer(sb, fsi->sb_bh);
+	}else{
+		mark_buffer_dirty(fsi->sb_bh);
+	}
 
-	parent_inode_info->dir_children_count++;			//AUMENTAMOS EN UNO ELCONTADOR DE HIJOS DEL PADRE
-	assoofs_save_inode_info(sb, parent_inode_info);		//CON ESTA FUNCION PASAMOS A DISCO LA INFORMACION DEL PADRE
+	mutex_unlock(&assoofs_sb_lock);
+	return 0;
+}
 
-	mutex_unlock(&assoofs_inodes_block_lock);
-	printk(KERN_INFO "\n");
-	return 0;	//PARA INDICAR QUE TODO HA SALIDO BIEN
+/* =========================================================== *
+ *  ESTADISTICAS DE OCUPACION (df)
+ * =========================================================== */
+/*
+ * No toma ningun cerrojo: los libres salen de los contadores por
+ * CPU, blocks_count solo crece y el resto son constantes del
+ * formato.
+ */
+static int assoofs_statfs(struct dentry *dentry, struct kstatfs *buf) {
+	struct super_block *sb = dentry->d_sb;
+	struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+	u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
+
+	buf->f_type = ASSOOFS_MAGIC;
+	buf->f_bsize = ASSOOFS_DEFAULT_BLOCK_SIZE;
+	buf->f_blocks = READ_ONCE(fsi->sb_info->blocks_count);
+	buf->f_bfree = percpu_counter_sum_positive(&fsi->free_blocks);
+	buf->f_bavail = buf->f_bfree;
+	buf->f_files = fsi->packed ? fsi->sb_info->inodes_count : ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED;
+	buf->f_ffree = percpu_counter_sum_positive(&fsi->free_inodes);
+	buf->f_namelen = ASSOOFS_FILENAME_MAXLEN - 1;		//El '\0' tambien va en la entrada
+	buf->f_fsid.val[0] = (u32)id;
+	buf->f_fsid.val[1] = (u32)(id >> 32);
+	return 0;
 }
 
 /* =========================================================== *
- *  CREACION DE UN DIRECTORIO    
+ *  DESCARTE DE BLOQUES LIBRES (discard Y FITRIM)
  * =========================================================== */
-static int assoofs_mkdir(struct inode *dir , struct dentry *dentry, umode_t mode) {
+/*
+ * Descarta los bloques de candidates que sigan libres, juntando
+ * los contiguos en una sola peticion y saltando los tramos de
+ * menos de minlen bloques. Durante el descarte los bloques estan
+ * en discard_busy para que nadie los reserve y escriba en ellos
+ * antes de que llegue el discard; assoofs_sb_lock no se tiene
+ * mientras se espera al dispositivo.
+ */
+static int assoofs_discard(struct super_block *sb, uint64_t candidates, uint64_t minlen, uint64_t *trimmed){
 
 	/* ++++++++++++++++++++++++++++++++++++++++++++ /
 	 *       DECLARACION FUNCIONES                 *
 	/ ++++++++++++++++++++++++++++++++++++++++++++ */
-    struct inode *inode;
-    struct super_block *sb;
-    uint64_t count;
-    struct assoofs_inode_info *inode_info;
-    struct assoofs_inode_info *parent_inode_info;
-	struct assoofs_dir_record_entry *dir_contents;
-	struct buffer_head *bh;
-	uint64_t block_number;
-	int i;
+	struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+	uint64_t blocks, rest, start, len;
+	int ret = 0, err;
 
-	//IMPRESION DE LA TRAZA CORRESPONDIENTE AL USO DE ESTA FUNCION
-	printk(KERN_INFO B "New directory request" RC "\n");
 
     /* ++++++++++++++++++++++++++++++++++++++++++++ /
      *      PROCECEMOS CON EL DESARROLLO           * 
     / ++++++++++++++++++++++++++++++++++++++++++++ */
 
-    sb = dir->i_sb;			//OBTENEMOS UN PUNTERO AL SUPERBLOQUE DESDE DIR
-    count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count;
-    						//OBTENGO EL NUMERO DE INODOS DE LA INFORMACION PERSISTENTE DEL SUPERBLOQUE
+	//--------------------------  MUTEX DEL SUPER BLOQUE  ---------------------------//
+	assoofs_lock(sb, &assoofs_sb_lock);
+	blocks = candidates & assoofs_allocatable(sb);
+	fsi->discard_busy |= blocks;
+	mutex_unlock(&assoofs_sb_lock);
 
-    if(count >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
-    	printk(KERN_ERR "There are too much inodes in the filesystem. Erase some of them to create one more\n");
-    	printk(KERN_INFO "\n");
-    	return -1;
-    }
+	for(rest = blocks; rest; rest &= ~(ASSOOFS_BLOCKS_MASK(start + len) & ~ASSOOFS_BLOCKS_MASK(start))){
+		start = __ffs64(rest);
+		for(len = 1; start + len < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED && (rest & (1ULL << (start + len))); len++);
+		if(len < minlen){
+			continue;
+		}
 
-    inode = new_inode(sb);
-    printk(KERN_INFO "Node created correctly\n");
+		err = sb_issue_discard(sb, start, len, GFP_NOFS, 0);
+		atomic64_inc(&fsi->discards);
+		trace_assoofs_discard(sb, start, len, err);
+		if(err){
+			ret = err;
+			break;
+		}
+		atomic64_add(len, &fsi->discarded_blocks);
+		if(trimmed){
+			*trimmed += len;
+		}
+	}
 
-    assoofs_sb_get_a_freeblock(sb, &block_number);  //Para asignarle un bloque vacío
+	assoofs_lock(sb, &assoofs_sb_lock);
+	fsi->discard_busy &= ~blocks;
+	mutex_unlock(&assoofs_sb_lock);
+	return ret;
+}
 
-    inode->i_ino = block_number-1;  //NECESARIO PARA EL REMOVE, ASIGNAMOS SIEMPRE EL NUMERO DE BLOQUE LIBRE - 1
+//Lote de discard: todo lo liberado desde el anterior, fuera del camino de assoofs_remove
+static void assoofs_discard_worker(struct work_struct *work) {
+	struct assoofs_fs_info *fsi = container_of(to_delayed_work(work), struct assoofs_fs_info, discard_work);
+	uint64_t pending;
 
-    inode->i_sb = sb;
-    inode->i_op = &assoofs_inode_ops;
-    inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+	mutex_lock(&assoofs_sb_lock);
+	pending = fsi->discard_pending;
+	fsi->discard_pending = 0;
+	mutex_unlock(&assoofs_sb_lock);
 
-    //una vez asignado esto, vamos a almacenar el campo i_private del nodo, que contendrá datos persistentes que habrá que llevar a disco
-    
-    inode_info = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);
-    printk(KERN_INFO "Space in cache reserved correctly\n");	
+	assoofs_discard(fsi->sb, pending, 1, NULL);		//Los errores quedan en la traza; fstrim puede repetirlo
+}
 
-    inode_info->inode_no = inode->i_ino;	
-    inode_info->file_size = 0;
-    inode_info->data_block_number = block_number;  //Para asignarle un bloque vacío
-    inode->i_fop=&assoofs_dir_operations;
-	inode_info->dir_children_count = 0;
-	inode_info->mode = S_IFDIR | mode;
-	inode_info->state_flag = ASSOOFS_STATE_ALIVE;		//necesario para el remove
+//FITRIM (fstrim): todo el espacio libre dentro del rango, en tramos contiguos de al menos minlen bytes
+static int assoofs_fitrim(struct super_block *sb, struct fstrim_range __user *arg){
 
-	inode->i_private = inode_info;
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct request_queue *q = bdev_get_queue(sb->s_bdev);
+	struct fstrim_range range;
+	uint64_t size = READ_ONCE(ASSOOFS_SB(sb)->blocks_count) * ASSOOFS_DEFAULT_BLOCK_SIZE;
+	uint64_t first, last, minlen, trimmed = 0;
+	int ret;
 
-    inode_init_owner(inode, dir, inode_info->mode);
-    d_add(dentry, inode);
 
-    assoofs_add_inode_info(sb, inode_info);							//Para guardar la informacion persistente del nuevo nodo en disco
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
 
-    //AHORA PASO 2
-    //MODIFICAR EL CONTENIDO DEL DIRECTORIO PADRE AÑADIENDO UNA ENTRADA PARA EL NUEVO ARCHIVO O DIRECTORIO
-	parent_inode_info = dir->i_private;
-										//cogemos la informacion del directorio padre, que alguna funcion ya lo habra seteado
-	bh = sb_bread(sb, parent_inode_info->data_block_number);
-										//leemos del disco la parte de losdatos y la metemos en dir_contents. 
-	dir_contents = (struct assoofs_dir_record_entry *)bh->b_data;
-										//APUNTA AL PRINCIPIO DEL DIRECTORIO PADRE
-	for(i=0; i < parent_inode_info->dir_children_count; i++){
-		if(dir_contents->state_flag == ASSOOFS_STATE_REMOVED){
-			i--;
-		}
-		dir_contents++;
+	if(!blk_queue_discard(q)){
+		return -EOPNOTSUPP;
+	}
+	if(copy_from_user(&range, arg, sizeof(range))){
+		return -EFAULT;
+	}
+	if(range.start >= size){
+		return -EINVAL;
 	}
 
-	dir_contents->inode_no = inode_info->inode_no; // inode_info es la información persistente del inodo creado en el paso 2.
-										//Colocamos lo que hemos hecho antes con inode info
-	strcpy(dir_contents->filename, dentry->d_name.name);
-										//Tenemos que copiar el nombre del fichero
-	dir_contents->state_flag = ASSOOFS_STATE_ALIVE;
-										//NECESARIO PARA EL REMOVE
-	
-	//Escribir en disco
-	mark_buffer_dirty(bh);		//PONEMOS EL BIT A SUCIO
-	printk(KERN_INFO "Directory created and stored correctly\n");
-	sync_dirty_buffer(bh);		//FORZAMOS LA SINCRONIZACION. Todos los cambios que esten en dirty, se trasladaran a disco
-	brelse(bh);					//liberamos memoria del bufferhead
+	first = div_u64(range.start, ASSOOFS_DEFAULT_BLOCK_SIZE);
+	last = range.len >= size - range.start ? div_u64(size, ASSOOFS_DEFAULT_BLOCK_SIZE) : div_u64(range.start + range.len, ASSOOFS_DEFAULT_BLOCK_SIZE);
+	minlen = DIV_ROUND_UP_ULL(max_t(uint64_t, range.minlen, q->limits.discard_granularity), ASSOOFS_DEFAULT_BLOCK_SIZE);
 
-	parent_inode_info->dir_children_count++;			//AUMENTAMOS EN UNO ELCONTADOR DE HIJOS DEL PADRE
-	assoofs_save_inode_info(sb, parent_inode_info);		//CON ESTA FUNCION PASAMOS A DISCO LA INFORMACION DEL PADRE
-	printk(KERN_INFO "\n");
-	return 0;	//PARA INDICAR QUE TODO HA SALIDO BIEN
+	ret = assoofs_discard(sb, ASSOOFS_BLOCKS_MASK(last) & ~ASSOOFS_BLOCKS_MASK(first), max_t(uint64_t, minlen, 1), &trimmed);
+
+	range.len = trimmed * ASSOOFS_DEFAULT_BLOCK_SIZE;
+	if(copy_to_user(arg, &range, sizeof(range))){
+		return -EFAULT;
+	}
+	return ret;
 }
 
 /* =========================================================== *
- *  BORRADO DE UN ARCHIVO    
+ *  INSTANTANEAS
  * =========================================================== */
-/* 
- * Para borrar un archivo nos vamos a limitar a poner en sus
- * dentry e inode_info las flags de REMOVED o ALIVE
- *
- * Despues de esto solamente tendremos que bajar el contador
- * de inodos del superbloque, bajar el contador de hijos
- * del padre y borrar el inodo
+/*
+ * Una instantanea es una copia del almacen de inodos en un bloque
+ * libre mas una referencia extra (block_refcount) en el bloque de
+ * cada inodo vivo. No se copia ningun dato: el sistema vivo sigue
+ * escribiendo y assoofs_unshare_block copia un bloque de fichero o
+ * de directorio la primera vez que lo modifica. El coste es fijo:
+ * un bloque y como mucho ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED
+ * contadores.
  *
- * Todo esto al mismo tiempo que guardamos la informacion en memoria
- * y en disco, y borramos el inodo del mapa de bits ocupados.
- *
- * Al final ejecutaremos ddrop sobre la dentry para borrarla
- * 
+ * Quien llama congela el sistema (freeze_super): no hay escrituras
+ * a medias y las paginas sucias ya estan en disco.
  */
-static int assoofs_remove(struct inode *dir, struct dentry *dentry){
+static int assoofs_snapshot_create(struct super_block *sb, uint32_t *id){
 
 	/* ++++++++++++++++++++++++++++++++++++++++++++ /
 	 *       DECLARACION FUNCIONES                 *
 	/ ++++++++++++++++++++++++++++++++++++++++++++ */
-	struct inode *inode;
+	struct assoofs_super_block_info *assoofs_sb = ASSOOFS_SB(sb);
 	struct assoofs_inode_info *inode_info;
-	struct assoofs_inode_info *parent_inode_info;
-	struct super_block *sb;
-	struct assoofs_super_block_info *super_info;
-
-	int i;
-	struct buffer_head *bh;
-	struct buffer_head *bh2;
-	struct assoofs_dir_record_entry *record;
-	struct assoofs_dir_record_entry *record2;
+	struct buffer_head *store_bh, *snap_bh;
+	unsigned int refs[ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED] = { 0 };
+	uint64_t block, count, i;
+	int slot, ret = 0;
 
-	//IMPRESION DE LA TRAZA CORRESPONDIENTE AL USO DE ESTA FUNCION
-	printk(KERN_INFO B "Remove node request" RC "\n");
 
     /* ++++++++++++++++++++++++++++++++++++++++++++ /
      *      PROCECEMOS CON EL DESARROLLO           * 
     / ++++++++++++++++++++++++++++++++++++++++++++ */
 
-	sb = dentry->d_sb;						//sacamos el superbloque del dentry
-    super_info = sb->s_fs_info;				//sacamos el superinfo del superbloque
+	//Junto al almacen vivo, en el grupo 0
+	if(assoofs_sb_get_a_freeblock(sb, 0, &block)){
+		return -ENOSPC;
+	}
 
-    inode = dentry->d_inode;				//sacamos el nodo del dentry
-    inode_info = inode->i_private;			//sacamos el campo info del nodo
-    parent_inode_info = dir->i_private;		//sacamos el campo info del padre
+	//-----------------------  MUTEX DEL ALMACEN DE INODOS  -------------------------//
+	assoofs_lock(sb, &assoofs_inodes_block_lock);
 
-    //Vamos a poner a REMOVED la flag del dentry del hijo que esta en el padre
-    inode_info->state_flag = ASSOOFS_STATE_REMOVED;
+	store_bh = assoofs_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+	snap_bh = assoofs_bread(sb, block);
+	memcpy(snap_bh->b_data, store_bh->b_data, ASSOOFS_DEFAULT_BLOCK_SIZE);
+	brelse(store_bh);
 
-    //Reduzco en 1 el numero de hijos del padre
-    parent_inode_info->dir_children_count--;
+	//--------------------------  MUTEX DEL SUPER BLOQUE  ---------------------------//
+	assoofs_lock(sb, &assoofs_sb_lock);
 
-    //Guardamos la informacion del padre y del hijo en el superbloque
-    assoofs_save_inode_info(sb, inode_info);
-    assoofs_save_inode_info(sb, parent_inode_info);
+	for(slot = 0; slot < ASSOOFS_MAX_SNAPSHOTS && assoofs_sb->snapshot_store[slot]; slot++);
+	if(slot == ASSOOFS_MAX_SNAPSHOTS){
+		ret = -ENOSPC;
+		goto failed;
+	}
+
+	//Primero se comprueba que ningun contador se desborde y despues se suman todos
+	inode_info = (struct assoofs_inode_info *)snap_bh->b_data;
+	count = min_t(uint64_t, assoofs_sb->inodes_count, ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED);
+	for(i = 0; i < count; i++){
+		if(inode_info[i].state_flag != ASSOOFS_STATE_ALIVE || inode_info[i].data_block_number >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
+			continue;
+		}
+		if(assoofs_sb->block_refcount[inode_info[i].data_block_number] + ++refs[inode_info[i].data_block_number] > ASSOOFS_MAX_BLOCK_REFCOUNT){
+			ret = -EMLINK;
+			goto failed;
+		}
+	}
+	for(i = 0; i < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++){
+		assoofs_sb->block_refcount[i] += refs[i];
+	}
 
-	//Actualizamos el bitmap del superbloque, pasndole el super info y el numero de bloque a liberar
-	assoofs_set_a_freeblock(super_info, inode_info->data_block_number);
+	//La copia va a disco antes que el superbloque que la apunta
+	assoofs_sync_buffer(sb, snap_bh);
+	brelse(snap_bh);
 
-	//Reducimos el contador de inodos del superbloque -1
-	super_info->real_inodes_count--;
+	assoofs_sb->snapshot_store[slot] = block;
+	assoofs_sb->snapshot_inodes_count[slot] = count;
+	assoofs_sb->snapshot_time[slot] = ktime_get_real_seconds();
+	assoofs_save_sb_info(sb);
 
-	//Guardamos la informacion modificada en el superbloque
+	mutex_unlock(&assoofs_sb_lock);
+	mutex_unlock(&assoofs_inodes_block_lock);
+
+	*id = slot + 1;
+	trace_assoofs_snapshot(sb, *id, block, 1);
+	return 0;
+
+failed:
+	brelse(snap_bh);
+	assoofs_set_a_freeblock(sb, block);
 	assoofs_save_sb_info(sb);
+	mutex_unlock(&assoofs_sb_lock);
+	mutex_unlock(&assoofs_inodes_block_lock);
+	return ret;
+}
 
-	//Una vez hecho todo esto, procedemos a dropear la dentry
-	d_drop(dentry);
+//Borrar una instantanea: cada bloque pierde la referencia que ella tenia y su almacen queda libre
+static int assoofs_snapshot_delete(struct super_block *sb, uint32_t id){
 
-	//zona de testeo
-	bh = sb_bread(sb, parent_inode_info->data_block_number);//PARA LEER LA INFO DEL BLOQUE PADRE
+	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+	 *       DECLARACION FUNCIONES                 *
+	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct assoofs_super_block_info *assoofs_sb = ASSOOFS_SB(sb);
+	struct assoofs_inode_info *inode_info;
+	struct buffer_head *bh;
+	uint64_t block, i;
 
-	//voy a recorrerlos records dentro del directorio
-	record = (struct assoofs_dir_record_entry *)bh->b_data;
-	for (i=0; i < parent_inode_info->dir_children_count; i++) {
-		if (!strcmp(record->filename, dentry->d_name.name) && record->inode_no == inode->i_ino) {		//COMPROBAR INFO DEL FICHERO CON EL QUE NOS PASAN (0 SI SON IGUALES, !=0 SI NO SON IGUALES)
-			printk(KERN_INFO "Inode dir_record_entry to remove found\n");
-			record->state_flag = ASSOOFS_STATE_REMOVED;
-		}
 
-		if(record->state_flag == ASSOOFS_STATE_REMOVED){
-			i--;
-		}
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
+     *      PROCECEMOS CON EL DESARROLLO           * 
+    / ++++++++++++++++++++++++++++++++++++++++++++ */
 
-		record++;
+	if(id < 1 || id > ASSOOFS_MAX_SNAPSHOTS){
+		return -EINVAL;
 	}
 
-	mark_buffer_dirty(bh);		//PONEMOS EL BIT A SUCIO
-	printk(KERN_INFO "STORED\n");
-	sync_dirty_buffer(bh);		//FORZAMOS LA SINCRONIZACION. Todos los cambios que esten en dirty, se trasladaran a disco
-	brelse(bh);		
-	
-	bh2 = sb_bread(sb, parent_inode_info->data_block_number);//PARA LEER LA INFO DEL BLOQUE PADRE
+	//--------------------------  MUTEX DEL SUPER BLOQUE  ---------------------------//
+	assoofs_lock(sb, &assoofs_sb_lock);
 
-	printk(KERN_INFO "Lookup in: parent_ino=%llu, parent_block=%llu, children=%lld\n", parent_inode_info->inode_no, parent_inode_info->data_block_number, parent_inode_info->dir_children_count);
+	block = assoofs_sb->snapshot_store[id - 1];
+	if(!block){
+		mutex_unlock(&assoofs_sb_lock);
+		return -ENOENT;
+	}
 
-	//voy a recorrerlos records dentro del directorio
-	record2 = (struct assoofs_dir_record_entry *)bh->b_data;
-	for (i=0; i < parent_inode_info->dir_children_count; i++) {
-		if(record2->state_flag == ASSOOFS_STATE_ALIVE){
-			printk(KERN_INFO B "Have file: " RC " '%s' (" Y "ino" RC ":%llu) --> "R" ALIVE" RC "\n", record2->filename, record2->inode_no);
-		}else{
-			printk(KERN_INFO B "Have file: " RC " '%s' (" Y "ino" RC ":%llu) --> "B" DEAD" RC "\n", record2->filename, record2->inode_no);
-			i--;
+	bh = assoofs_bread(sb, block);
+	inode_info = (struct assoofs_inode_info *)bh->b_data;
+	for(i = 0; i < min_t(uint64_t, assoofs_sb->snapshot_inodes_count[id - 1], ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED); i++){
+		if(inode_info[i].state_flag == ASSOOFS_STATE_ALIVE && inode_info[i].data_block_number < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
+			assoofs_set_a_freeblock(sb, inode_info[i].data_block_number);
 		}
-		record2++;
 	}
+	brelse(bh);
 
-	printk(KERN_INFO "\n");
+	assoofs_sb->snapshot_store[id - 1] = 0;
+	assoofs_sb->snapshot_inodes_count[id - 1] = 0;
+	assoofs_sb->snapshot_time[id - 1] = 0;
+	assoofs_set_a_freeblock(sb, block);
+	assoofs_save_sb_info(sb);
 
-	printk(KERN_INFO "\n");
-    return 0;
+	mutex_unlock(&assoofs_sb_lock);
+
+	trace_assoofs_snapshot(sb, id, block, 0);
+	return 0;
 }
 
 /* =========================================================== *
- *  CONFIGURAR UN BLOQUE LIBRE EN EL MAPA DE BITS
+ *  CRECIMIENTO EN LINEA
  * =========================================================== */
-void assoofs_set_a_freeblock(struct assoofs_super_block_info *super_info, uint64_t data_block_number){
+/*
+ * El dispositivo ha crecido por debajo del montaje (LVM, losetup
+ * -c): los bloques nuevos pasan a estar libres en el mapa de bits
+ * y en los contadores. No se mueve nada; el almacen de inodos y
+ * su mapa ya cubren los ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED
+ * objetos, asi que solo crece la zona de datos, y como mucho
+ * hasta ese mismo limite. Encoger no se permite.
+ */
+static int assoofs_resize(struct super_block *sb, uint64_t *blocks){
 
 	/* ++++++++++++++++++++++++++++++++++++++++++++ /
 	 *       DECLARACION FUNCIONES                 *
 	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+	struct assoofs_super_block_info *assoofs_sb = ASSOOFS_SB(sb);
+	uint64_t device = assoofs_device_blocks(sb), old, added;
 
-	//IMPRESION DE LA TRAZA CORRESPONDIENTE AL USO DE ESTA FUNCION
-	printk(KERN_INFO B "Set a freeblock request" RC "\n");
 
     /* ++++++++++++++++++++++++++++++++++++++++++++ /
      *      PROCECEMOS CON EL DESARROLLO           * 
     / ++++++++++++++++++++++++++++++++++++++++++++ */
 
-	printk(KERN_INFO "BITMAP ORIGINAL: %llu\n", super_info->free_blocks);
-	super_info->free_blocks |= (1 << data_block_number);
-	printk(KERN_INFO "BITMAP CHANGED: %llu\n", super_info->free_blocks);
+	if(!*blocks){
+		*blocks = min_t(uint64_t, device, ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED);
+	}
+	if(*blocks > ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
+		return -EFBIG;
+	}
+	if(*blocks > device){
+		return -EINVAL;
+	}
+
+	//--------------------------  MUTEX DEL SUPER BLOQUE  ---------------------------//
+	assoofs_lock(sb, &assoofs_sb_lock);
+
+	old = assoofs_sb->blocks_count;
+	if(*blocks < old){
+		mutex_unlock(&assoofs_sb_lock);
+		return -EINVAL;
+	}
+
+	added = ASSOOFS_BLOCKS_MASK(*blocks) & ~ASSOOFS_BLOCKS_MASK(old);
+	assoofs_sb->free_blocks |= added;
+	assoofs_sb->free_blocks_count += hweight64(added);
+	WRITE_ONCE(assoofs_sb->blocks_count, *blocks);
+	percpu_counter_add(&fsi->free_blocks, hweight64(added));
+	assoofs_save_sb_info(sb);
+
+	mutex_unlock(&assoofs_sb_lock);
 
-	printk(KERN_INFO "\n");
+	trace_assoofs_resize(sb, old, *blocks);
+	return 0;
 }
 
-/* =========================================================== *
- *  MOVIMIENTO DE UN ARCHIVO DE SITIO
- * =========================================================== */
-/* 
- * Para mover un archivo nos vamos a limitar a borrarlo de su
- * origen y crearlo en su destino con los parametros que nos
- * pasen
- * 
- */
-static int assoofs_move(struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir, struct dentry *new_dentry, unsigned int num){
+static long assoofs_ioctl(struct file *file, unsigned int cmd, unsigned long arg){
 
 	/* ++++++++++++++++++++++++++++++++++++++++++++ /
 	 *       DECLARACION FUNCIONES                 *
 	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct assoofs_inode_info *inode_info = file_inode(file)->i_private;
+	struct assoofs_usage usage;
+	uint64_t blocks;
+	uint32_t id;
+	int ret;
 
-	struct inode *inode;
-	struct assoofs_inode_info *inode_info;
-
-	//IMPRESION DE LA TRAZA CORRESPONDIENTE AL USO DE ESTA FUNCION
-	printk(KERN_INFO B "Move node request" RC "\n");
 
     /* ++++++++++++++++++++++++++++++++++++++++++++ /
      *      PROCECEMOS CON EL DESARROLLO           * 
     / ++++++++++++++++++++++++++++++++++++++++++++ */
-	
-	inode = old_dentry->d_inode;
-	inode_info = inode->i_private;
-
-	if(inode_info->mode == S_IFREG){  //si es un fichero regular
-		printk(KERN_INFO Y "Move file\n" RC);
-		assoofs_remove(old_dir, old_dentry);
-		assoofs_create(new_dir, new_dentry, S_IFREG, 1);
-	}else{							  //si es un directorio
-		printk(KERN_INFO Y "Move directory\n" RC);
-		assoofs_remove(old_dir, old_dentry);
-		assoofs_mkdir(new_dir, new_dentry, S_IFDIR);
+
+	//Los totales los puede leer cualquiera, tambien en solo lectura o en una instantanea
+	if(cmd == ASSOOFS_IOC_GET_USAGE){
+		if(S_ISDIR(inode_info->mode)){
+			usage.bytes = inode_info->usage_bytes;
+			usage.inodes = inode_info->usage_inodes;
+		}else{
+			usage.bytes = inode_info->file_size;		//Un fichero no tiene nada debajo: solo sus bytes
+			usage.inodes = 0;
+		}
+		return copy_to_user((struct assoofs_usage __user *)arg, &usage, sizeof(usage)) ? -EFAULT : 0;
 	}
-	return 0;
 
-	printk(KERN_INFO "\n");
-    return 0;
-}
+	switch(cmd){
+	case ASSOOFS_IOC_SNAP_CREATE:
+	case ASSOOFS_IOC_SNAP_DELETE:
+	case ASSOOFS_IOC_RESIZE:
+	case FITRIM:
+		break;
+	default:
+		return -ENOTTY;
+	}
 
-/* =========================================================== *
- *  GUARDADO DE INFORMACION EN EL SUPERBLOQUE    
- * =========================================================== */
-void assoofs_save_sb_info(struct super_block *vsb){
-	
-	/* ++++++++++++++++++++++++++++++++++++++++++++ /
-	 *       DECLARACION FUNCIONES                 *
-	/ ++++++++++++++++++++++++++++++++++++++++++++ */
-	struct buffer_head *bh;				//LEEMOS DEL DISCO
-	struct assoofs_super_block *sb;
+	if(!capable(CAP_SYS_ADMIN)){
+		return -EPERM;
+	}
+
+	//Descartar espacio libre no cambia nada del sistema: vale tambien en solo lectura
+	if(cmd == FITRIM){
+		return assoofs_fitrim(sb, (struct fstrim_range __user *)arg);
+	}
+
+	if(ASSOOFS_FS(sb)->snapshot || sb_rdonly(sb) || __mnt_is_readonly(file->f_path.mnt)){
+		return -EROFS;
+	}
+
+	if(cmd == ASSOOFS_IOC_RESIZE){
+		if(get_user(blocks, (uint64_t __user *)arg)){
+			return -EFAULT;
+		}
+		ret = assoofs_resize(sb, &blocks);
+		if(!ret && put_user(blocks, (uint64_t __user *)arg)){
+			ret = -EFAULT;
+		}
+		return ret;
+	}
+
+	if(cmd == ASSOOFS_IOC_SNAP_DELETE){
+		if(get_user(id, (uint32_t __user *)arg)){
+			return -EFAULT;
+		}
+		return assoofs_snapshot_delete(sb, id);
+	}
 
-	//IMPRESION DE LA TRAZA CORRESPONDIENTE AL USO DE ESTA FUNCION
-	printk(KERN_INFO B "Save sb info request" RC "\n");
+	//Congelar espera a las escrituras en curso y lleva a disco todo lo sucio
+	ret = freeze_super(sb);
+	if(ret){
+		return ret;
+	}
+	ret = assoofs_snapshot_create(sb, &id);
+	thaw_super(sb);
 
-    /* ++++++++++++++++++++++++++++++++++++++++++++ /
-     *      PROCECEMOS CON EL DESARROLLO           * 
-    / ++++++++++++++++++++++++++++++++++++++++++++ */
+	if(!ret && put_user(id, (uint32_t __user *)arg)){
+		ret = -EFAULT;
+	}
+	return ret;
+}
 
-	sb = vsb->s_fs_info; // Información persistente del superbloque en memoria
+/* =========================================================== *
+ *  FSYNC DE FICHEROS Y DIRECTORIOS
+ * =========================================================== */
+/*
+ * Con commit=N los metadatos del fichero (su inodo, su entrada en
+ * el directorio) pueden estar todavia sucios en los buffers del
+ * dispositivo: se escriben antes que los datos, y el flush de
+ * generic_file_fsync cubre ambos.
+ */
+static int assoofs_fsync(struct file *file, loff_t start, loff_t end, int datasync) {
+	struct super_block *sb = file_inode(file)->i_sb;
+	int ret;
 
-	bh = sb_bread(vsb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);		//COGEMOS DE DONDE ESTA GUARDADO EN MEMORIA
-	bh->b_data = (char *)sb; // Sobreescribo los datos de disco con la información en memoria
+	//Modo log: las paginas escritas desde writepage (reclaim) aun no estan confirmadas en el almacen
+	if(ASSOOFS_FS(sb)->log_mode && S_ISREG(file_inode(file)->i_mode)){
+		ret = file_write_and_wait_range(file, start, end);
+		if(!ret){
+			ret = assoofs_log_commit(file_inode(file));
+		}
+		if(ret){
+			return ret;
+		}
+	}
 
-	//Escribir en disco
-	mark_buffer_dirty(bh);		//PONEMOS EL BIT A SUCIO
-	sync_dirty_buffer(bh);		//FORZAMOS LA SINCRONIZACION. Todos los cambios que esten en dirty, se trasladaran a disco
-	printk(KERN_INFO "Super_Block_Info saved correctly\n");
-	printk(KERN_INFO "\n");
-	brelse(bh);					//liberamos memoria del bufferhead
+	if(READ_ONCE(ASSOOFS_FS(sb)->commit_interval)){
+		ret = sync_blockdev(sb->s_bdev);
+		if(ret){
+			return ret;
+		}
+	}
+	return generic_file_fsync(file, start, end, datasync);
 }
 
 /* =========================================================== *
- *  CONSECUCION DE UN BLOQUE LIBRE EN EL SUPERBLOQUE    
+ *  OPCIONES DE MONTAJE EN /proc/mounts
  * =========================================================== */
-int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block){
-	
-	/* ++++++++++++++++++++++++++++++++++++++++++++ /
-	 *       DECLARACION FUNCIONES                 *
-	/ ++++++++++++++++++++++++++++++++++++++++++++ */
-	struct assoofs_super_block_info *assoofs_sb;		
-	int i;					
+static int assoofs_show_options(struct seq_file *m, struct dentry *root) {
+	struct assoofs_fs_info *fsi = ASSOOFS_FS(root->d_sb);
 
-	//IMPRESION DE LA TRAZA CORRESPONDIENTE AL USO DE ESTA FUNCION
-	printk(KERN_INFO B "Get a free block request" RC "\n");
+	if(fsi->commit_interval){
+		seq_printf(m, ",commit=%u", fsi->commit_interval);
+	}
+	if(fsi->log_mode){
+		seq_puts(m, ",log");
+	}
+	if(fsi->snapshot){
+		seq_printf(m, ",snapshot=%u", fsi->snapshot);
+	}
+	if(fsi->discard){
+		seq_puts(m, ",discard");
+	}
+	return 0;
+}
 
-	/* ++++++++++++++++++++++++++++++++++++++++++++ /
-     *      PROCECEMOS CON EL DESARROLLO           * 
-    / ++++++++++++++++++++++++++++++++++++++++++++ */
+/* =========================================================== *
+ *  ESTADISTICAS DEL MONTAJE EN DEBUGFS
+ * =========================================================== */
+static int assoofs_stats_show(struct seq_file *m, void *v) {
+	struct assoofs_fs_info *fsi = m->private;
+	struct assoofs_prealloc *pa;
+	uint64_t reserved = 0;
+	unsigned int g;
+	int cpu;
+
+	for_each_possible_cpu(cpu){
+		reserved += hweight64(READ_ONCE(per_cpu_ptr(fsi->windows, cpu)->free));
+	}
+	spin_lock(&fsi->prealloc_lock);
+	list_for_each_entry(pa, &fsi->prealloc, list){
+		reserved += hweight64(pa->blocks);
+	}
+	spin_unlock(&fsi->prealloc_lock);
+
+	seq_printf(m, "bread %lld\n", atomic64_read(&fsi->bread));
+	seq_printf(m, "sync_writes %lld\n", atomic64_read(&fsi->sync_writes));
+	seq_printf(m, "lookup_hit %lld\n", atomic64_read(&fsi->lookup_hit));
+	seq_printf(m, "lookup_miss %lld\n", atomic64_read(&fsi->lookup_miss));
+	seq_printf(m, "allocs %lld\n", atomic64_read(&fsi->allocs));
+	seq_printf(m, "frees %lld\n", atomic64_read(&fsi->frees));
+	seq_printf(m, "lock_wait_ns %lld\n", atomic64_read(&fsi->lock_wait_ns));
+	seq_printf(m, "writepages %lld\n", atomic64_read(&fsi->writepages));
+	seq_printf(m, "delayed_writes %lld\n", atomic64_read(&fsi->delayed_writes));
+	seq_printf(m, "commits %lld\n", atomic64_read(&fsi->commits));
+	seq_printf(m, "log_commits %lld\n", atomic64_read(&fsi->log_commits));
+	seq_printf(m, "discards %lld\n", atomic64_read(&fsi->discards));
+	seq_printf(m, "discarded_blocks %lld\n", atomic64_read(&fsi->discarded_blocks));
+	seq_printf(m, "reserved_blocks %llu\n", reserved);
+	seq_printf(m, "prealloc_hits %lld\n", atomic64_read(&fsi->prealloc_hits));
+	seq_printf(m, "dcache_entries %ld\n", atomic_long_read(&fsi->dcache_count));
+	for(g = 0; g < ASSOOFS_GROUPS; g++){
+		seq_printf(m, "group%u_free_blocks %u\n", g, (unsigned int)hweight64(READ_ONCE(fsi->sb_info->free_blocks) & ASSOOFS_GROUP_MASK(g)));
+		seq_printf(m, "group%u_free_inodes %u\n", g, (unsigned int)hweight64(READ_ONCE(fsi->sb_info->free_inodes) & ASSOOFS_GROUP_MASK(g)));
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(assoofs_stats);
 
-	//--------------------------  MUTEX DEL SUPER BLOQUE  ---------------------------//
-    mutex_lock_interruptible(&assoofs_sb_lock);
-
-	assoofs_sb = sb->s_fs_info;		//OBTENEMOS LA INFORMACION PERSISTENTE DEL SUPERBLOQUE
-
-	//RECORREMOS EL MAPA DE BITS EN BUSCA DE UN BLOQUE LIBRE (BIT = 1)
-	for (i = 2; i < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++)
-		if (assoofs_sb->free_blocks & (1 << i)){
-			break; // cuando aparece el primer bit 1 en free_block dejamos de recorrer el mapa de bits, i tiene la posición del primer bloque libre
-		}else if(i == ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED -1){
-			printk(KERN_INFO R "There is not any free block available" RC "\n");
-			printk(KERN_INFO "\n");
-			return -1; //Esto es cuando estamos evaluando el ultimo bit y esta lleno, pues devolvemos un -1 para notificar que no hay ninguno libre
+/* =========================================================== *
+ *  DESMONTAJE: LIBERAR LA INFORMACION DEL MONTAJE
+ * =========================================================== */
+static void assoofs_put_super(struct super_block *sb) {
+	struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+	unsigned long dir;
+
+	//Lo que quede se escribe ya en sincrono: el commit pendiente no puede llegar despues de liberar fsi
+	WRITE_ONCE(fsi->commit_interval, 0);
+	cancel_delayed_work_sync(&fsi->commit_work);
+
+	//Igual con el lote de discard pendiente, que se envia ya
+	WRITE_ONCE(fsi->discard, false);
+	flush_delayed_work(&fsi->discard_work);
+
+	//sync_fs ya devolvio las reservas; por si se ha reservado algo despues
+	if(!sb_rdonly(sb)){
+		assoofs_lock(sb, &assoofs_sb_lock);
+		if(assoofs_return_reservations(sb)){
+			assoofs_save_sb_info(sb);
 		}
+		mutex_unlock(&assoofs_sb_lock);
+	}
 
-	//LA I DEBE SER SIEMPRE MENOR QUE EL NUMERO MAXIMO DE ARCHIVOS EN EL SISTEMA
-	*block = i; // Escribimos el valor de i en la dirección de memoria indicada como segundo argumento en la función
-
-	assoofs_sb->free_blocks &= ~(1 << i);
-	assoofs_save_sb_info(sb);
-
-	mutex_unlock(&assoofs_sb_lock);
+	debugfs_remove_recursive(fsi->debugfs);
 
-	return 0;
-	printk(KERN_INFO "\n");
+	//Fuera el shrinker antes de vaciar la cache de nombres; las entradas se liberan tras un periodo de gracia
+	unregister_shrinker(&fsi->dcache_shrinker);
+	spin_lock(&fsi->dcache_lock);
+	for_each_set_bit(dir, fsi->dcache_dirs, ASSOOFS_DCACHE_DIRS){
+		assoofs_dcache_drop_dir(fsi, dir);
+	}
+	spin_unlock(&fsi->dcache_lock);
+
+	free_percpu(fsi->windows);
+	percpu_counter_destroy(&fsi->free_blocks);
+	percpu_counter_destroy(&fsi->free_inodes);
+	kfree(fsi->packed);
+	brelse(fsi->sb_bh);			//Soltamos el bloque del superbloque que teniamos fijado
+	kfree(fsi);
+	sb->s_fs_info = NULL;
 }
 
 /* =========================================================== *
- *  ADICION DE INFORMACION A UN NODO   
+ *  CONSECUCION DE INFORMACION DE LOS INODOS   
  * =========================================================== */
-void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode){
-	
+struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no){
+
 	/* ++++++++++++++++++++++++++++++++++++++++++++ /
 	 *       DECLARACION FUNCIONES                 *
 	/ ++++++++++++++++++++++++++++++++++++++++++++ */
-    uint64_t inodes_count;
+	struct assoofs_fs_info *fsi = ASSOOFS_FS(sb);
+	struct assoofs_inode_info *inode_info = NULL;
+	struct assoofs_inode_info *buffer = NULL;
+	uint64_t slot = ASSOOFS_INODE_SLOT(inode_no);
+	uint64_t count = fsi->snapshot ? fsi->sb_info->snapshot_inodes_count[fsi->snapshot - 1] : fsi->sb_info->inodes_count;
 	struct buffer_head *bh;
-	struct assoofs_inode_info *inode_info;
-	struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
 
-	//IMPRESION DE LA TRAZA CORRESPONDIENTE AL USO DE ESTA FUNCION
-	printk(KERN_INFO B "Add inode info request" RC "\n");
 
     /* ++++++++++++++++++++++++++++++++++++++++++++ /
      *      PROCECEMOS CON EL DESARROLLO           * 
     / ++++++++++++++++++++++++++++++++++++++++++++ */
 
-    inodes_count = assoofs_sb->inodes_count;   //obtenemos el count desde inode_info
-
-    //-----------------------  MUTEX DEL ALMACEN DE INODOS  -------------------------//
-    mutex_lock_interruptible(&assoofs_inodes_block_lock);
-
-    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);		//Leer de disco el bloque con el almacen de inodos
-
-    inode_info = (struct assoofs_inode_info *)bh->b_data;		//RECORRER ENTERO PARA APUNTAR AL FINAL
-	
-	//--------------------------  MUTEX DEL SUPER BLOQUE  ---------------------------//
-    mutex_lock_interruptible(&assoofs_sb_lock);
-
-	//creo que esta linea me da fallo
-	inode_info += assoofs_sb->inodes_count;
-
-    //inode_info += inode->data_block_number;
-	memcpy(inode_info, inode, sizeof(struct assoofs_inode_info));
-
-	mark_buffer_dirty(bh);		//LO MARCAMOS COMO SUCIO
-	sync_dirty_buffer(bh);		//SINCRONIZAMOS
-	printk(KERN_INFO "Node_Info added correctly\n");
-	brelse(bh);					//liberamos memoria del bufferhead
+	//ACCEDEMOS A DISCO PARA LEER EL BLOQUE QUE CONTIENE EL ALMACEN DE INODOS (EL DE LA INSTANTANEA SI SE HA MONTADO UNA)
+	bh = assoofs_bread(sb, fsi->inode_store);
+	inode_info = (struct assoofs_inode_info *)bh->b_data;
 
-	assoofs_sb->inodes_count++;
-	assoofs_sb->real_inodes_count++;		
-	assoofs_save_sb_info(sb);
+	//EL INODO N ESTA EN LA POSICION N - 1 DEL ALMACEN, SIN RECORRERLO
+	if(inode_no >= ASSOOFS_ROOTDIR_INODE_NUMBER && slot < count){
+		inode_info += slot;
+		if(inode_info->inode_no == inode_no){
+   			buffer = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);	   //RESERVO MEMORIA EN EL KERNEL
+			memcpy(buffer, inode_info, sizeof(*buffer));					   //COPIO EN BUFFER EL CONTENIDO DEL INODO 
+		}
+	}
 
-	mutex_unlock(&assoofs_sb_lock);
-	mutex_unlock(&assoofs_inodes_block_lock);
-	printk(KERN_INFO "\n");
+	//LIBERAR RECURSOS Y DEVOLVER LA INFORMACIÓN DEL INODO SI ESTABA EN EL ALMACÉN
+	brelse(bh);			//LIBERAR EL FUFFER HEAD
+	return buffer;		//DEVOLVER LA INFORMACIÓN DEL INODO QUE BUSCAMOS
+						//SI NO LO ENCUENTRA DEVUELVE BUFFER = NULL
 }
 
 /* =========================================================== *
- *  GUARDADO DE LA INFORMACION DE UN INODO    
+ *  ACTUALIZACION DE IMAGENES DE LA VERSION 1
  * =========================================================== */
-int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info){
-	
+/*
+ * En la version 1 las entradas del almacen se anadian al final y
+ * los inodos borrados se quedaban para siempre. Aqui se reescribe
+ * el almacen dejando solo las entradas vivas, cada una en la
+ * posicion inodo - 1, y se construye el mapa de inodos libres.
+ * Los numeros de inodo no cambian, asi que los directorios siguen
+ * siendo validos tal cual.
+ */
+static int assoofs_upgrade_v1(struct super_block *sb){
+
 	/* ++++++++++++++++++++++++++++++++++++++++++++ /
 	 *       DECLARACION FUNCIONES                 *
 	/ ++++++++++++++++++++++++++++++++++++++++++++ */
+	struct assoofs_super_block_info *assoofs_sb = ASSOOFS_SB(sb);
+	struct assoofs_inode_info_v5 *old, *table;
 	struct buffer_head *bh;
-	struct assoofs_inode_info *inode_pos;
+	uint64_t used = 0, count, slot, i;
 
-	//IMPRESION DE LA TRAZA CORRESPONDIENTE AL USO DE ESTA FUNCION
-	printk(KERN_INFO B "Save inode info request" RC "\n");
 
-	/* ++++++++++++++++++++++++++++++++++++++++++++ /
+    /* ++++++++++++++++++++++++++++++++++++++++++++ /
      *      PROCECEMOS CON EL DESARROLLO           * 
     / ++++++++++++++++++++++++++++++++++++++++++++ */
 
-	//ACCEDEMOS A DISCO PARA LEER EL BLOQUE QUE CONTIENE EL ALMACEN DE INODOS
-	bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+	if(sb_rdonly(sb)){
+		printk(KERN_ERR "assoofs version 1 image must be mounted read-write once to be upgraded.\n");
+		return -1;
+	}
 
-	//--------------------------  MUTEX DEL SUPER BLOQUE  ---------------------------//
-    mutex_lock_interruptible(&assoofs_sb_lock);
+	old = kmalloc(ASSOOFS_DEFAULT_BLOCK_SIZE, GFP_KERNEL);
+	if(!old){
+		return -1;
+	}
 
-	inode_pos = assoofs_search_inode_info(sb, (struct assoofs_inode_info *)bh->b_data, inode_info);  //BUSCAMOS LA POSICION DE UN NODO EN CONCRETO
+	bh = assoofs_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+	table = (struct assoofs_inode_info_v5 *)bh->b_data;
+	memcpy(old, table, ASSOOFS_DEFAULT_BLOCK_SIZE);
+	memset(table, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
 
-	memcpy(inode_pos, inode_info, sizeof(*inode_pos));    //METEMOS LA INFORMACION EN LA INFORMACION DEL INODO
-	mark_buffer_dirty(bh);		//LO MARCAMOS COMO SUCIO
-	sync_dirty_buffer(bh);		//SINCRONIZAMOS
-	printk(KERN_INFO "Node_Info saved correctly\n");
-	brelse(bh);					//liberamos memoria del bufferheadinodes_count
+	count = min_t(uint64_t, assoofs_sb->inodes_count, ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(*old));
+	for(i = 0; i < count; i++){
+		if(old[i].state_flag != ASSOOFS_STATE_ALIVE || old[i].inode_no < ASSOOFS_ROOTDIR_INODE_NUMBER){
+			continue;
+		}
+		slot = ASSOOFS_INODE_SLOT(old[i].inode_no);
+		if(slot >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
+			continue;
+		}
+		table[slot] = old[i];
+		used |= 1ULL << slot;
+	}
 
-	mutex_unlock(&assoofs_sb_lock);
-	printk(KERN_INFO "\n");
+	assoofs_sync_buffer(sb, bh);
+	brelse(bh);
+	kfree(old);
+
+	assoofs_sb->free_inodes = ~used;
+	assoofs_sb->inodes_count = used ? fls64(used) : 0;
+	assoofs_sb->real_inodes_count = hweight64(used);
+	assoofs_sb->version = ASSOOFS_VERSION_INODE_BITMAP;
+	assoofs_save_sb_info(sb);
 	return 0;
 }
 
 /* =========================================================== *
- *  BÚSQUEDA DE INFORMACIÓN DEL INODO    
+ *  ACTUALIZACION A LA VERSION 6 (TOTALES POR DIRECTORIO)
  * =========================================================== */
-struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *start, struct assoofs_inode_info *search){
-	
+/*
+ * Pasa un almacen (el vivo o el de una instantanea) de inodos de
+ * 40 bytes a los de 56 y calcula los totales de cada directorio:
+ * se saca el padre de cada inodo leyendo los directorios y cada
+ * inodo suma lo suyo a toda la cadena de antepasados. Es lo unico
+ * que recorre el arbol entero, y solo una vez por imagen.
+ */
+static int assoofs_upgrade_store_v6(struct super_block *sb, uint64_t store, uint64_t count){
+
 	/* ++++++++++++++++++++++++++++++++++++++++++++ /
 	 *       DECLARACION FUNCIONES                 *
 	/ ++++++++++++++++++++++++++++++++++++++++++++ */
-	uint64_t count = 0;
+	struct assoofs_inode_info_v5 *old;
+	struct assoofs_inode_info *table;
+	struct assoofs_dir_record_entry *record;
+	struct buffer_head *bh, *dir_bh;
+	int parent[ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED];
+	uint64_t i, j, alive, slot, bytes;
+	int p, depth;
 
-	//IMPRESION DE LA TRAZA CORRESPONDIENTE AL USO DE ESTA FUNCION
-	printk(KERN_INFO B "Search inode info request" RC "\n");
 
     /* ++++++++++++++++++++++++++++++++++++++++++++ /
-     *      PROCECEMOS CON EL DESARROLLO           * 
+     *      PROCECEMOS CON EL DESARROLLO           *
     / ++++++++++++++++++++++++++++++++++++++++++++ */
 
-	//BUSCAMOS EL ALMACEN DE INODOS HASTA ENCONTRAR LOS DATOS DEL INDOO SEARCH
-	while (start->inode_no != search->inode_no && count < ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count) {
-		count++;
-		start++;
+	old = kmalloc(ASSOOFS_DEFAULT_BLOCK_SIZE, GFP_KERNEL);
+	if(!old){
+		return -1;
 	}
 
-	if (start->inode_no == search->inode_no){
-		printk(KERN_INFO RC "Node_information (" Y "ino_no:" RC " %llu) --> " G "found" RC "\n", start->inode_no);
-		printk(KERN_INFO "\n");
-		return start;  //si es el nodo que estabamos buscando lo devolvemos
-	}else{
-		printk(KERN_INFO "Node_information --> " R "not found" RC "\n");
-		printk(KERN_INFO "\n");
-		return NULL; //si no, devolvemos null en senial de que no lo hemos encontrado
+	bh = assoofs_bread(sb, store);
+	memcpy(old, bh->b_data, ASSOOFS_DEFAULT_BLOCK_SIZE);
+	memset(bh->b_data, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+	table = (struct assoofs_inode_info *)bh->b_data;
+
+	count = min_t(uint64_t, count, ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED);
+	for(i = 0; i < count; i++){
+		table[i].mode = old[i].mode;
+		table[i].inode_no = old[i].inode_no;
+		table[i].data_block_number = old[i].data_block_number;
+		table[i].file_size = old[i].file_size;
+		table[i].state_flag = old[i].state_flag;
+		parent[i] = -1;
+	}
+
+	//Padre de cada inodo vivo, segun las entradas vivas de cada directorio
+	for(i = 0; i < count; i++){
+		if(table[i].state_flag != ASSOOFS_STATE_ALIVE || !S_ISDIR(table[i].mode) || table[i].data_block_number >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
+			continue;
+		}
+		dir_bh = assoofs_bread(sb, table[i].data_block_number);
+		record = (struct assoofs_dir_record_entry *)dir_bh->b_data;
+		for(j = 0, alive = 0; j < ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(*record) && alive < table[i].dir_children_count; j++){
+			if(record[j].state_flag != ASSOOFS_STATE_ALIVE){
+				continue;
+			}
+			alive++;
+			slot = ASSOOFS_INODE_SLOT(record[j].inode_no);
+			if(record[j].inode_no > ASSOOFS_ROOTDIR_INODE_NUMBER && slot < count){
+				parent[slot] = i;
+			}
+		}
+		brelse(dir_bh);
+	}
+
+	for(i = 0; i < count; i++){
+		if(table[i].state_flag != ASSOOFS_STATE_ALIVE){
+			continue;
+		}
+		bytes = S_ISREG(table[i].mode) ? table[i].file_size : 0;
+		for(p = parent[i], depth = 0; p >= 0 && depth < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; p = parent[p], depth++){
+			table[p].usage_bytes += bytes;
+			table[p].usage_inodes++;
+		}
 	}
+
+	assoofs_sync_buffer(sb, bh);
+	brelse(bh);
+	kfree(old);
+	return 0;
 }
 
-/* =========================================================== *
- *  CONSECUCIÓN DE LOS INODOS QUE NECESITAMOS
- * =========================================================== */
-static struct inode *assoofs_get_inode(struct super_block *sb, int ino){
+static int assoofs_upgrade_v6(struct super_block *sb){
 
 	/* ++++++++++++++++++++++++++++++++++++++++++++ /
 	 *       DECLARACION FUNCIONES                 *
 	/ ++++++++++++++++++++++++++++++++++++++++++++ */
-	struct assoofs_inode_info *inode_info;
-	struct inode *inode;
+	struct assoofs_super_block_info *assoofs_sb = ASSOOFS_SB(sb);
+	int n;
 
-	//IMPRESION DE LA TRAZA CORRESPONDIENTE AL USO DE ESTA FUNCION
-	printk(KERN_INFO B "Get inode request" RC "\n");
 
     /* ++++++++++++++++++++++++++++++++++++++++++++ /
-     *      PROCECEMOS CON EL DESARROLLO           * 
+     *      PROCECEMOS CON EL DESARROLLO           *
     / ++++++++++++++++++++++++++++++++++++++++++++ */
 
-	//PASO 1, recolectamos la información persistente del nodo
-	inode_info = assoofs_get_inode_info(sb, ino);
-
-	//Creamos el inodo
-	inode = new_inode(sb);
-
-	//Asignamos parametros al inodo que hemos creado
-	inode->i_ino = ino;
-	inode->i_sb = sb;
-	inode->i_op = &assoofs_inode_ops;
+	//El almacen cambia de formato: no se puede leer sin reescribirlo
+	if(sb_rdonly(sb)){
+		printk(KERN_ERR "assoofs version %llu image must be mounted read-write once to be upgraded.\n", assoofs_sb->version);
+		return -1;
+	}
 
-	//DEPENDIENDO DEL TIPO DE ARCHIVO QUE SEA SE LE ASIGNAN UNAS OPERACIONES U OTRAS
-	if (S_ISDIR(inode_info->mode)){
-		inode->i_fop = &assoofs_dir_operations;
-		printk(KERN_INFO "Is a directory\n");
-	}else if (S_ISREG(inode_info->mode)){
-		inode->i_fop = &assoofs_file_operations;
-		printk(KERN_INFO "Is a file\n");
-	}else{
-		printk(KERN_ERR "Unknown inode type. Neither a directory nor a file.");
+	if(assoofs_upgrade_store_v6(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER, assoofs_sb->inodes_count)){
+		return -1;
+	}
+	for(n = 0; n < ASSOOFS_MAX_SNAPSHOTS; n++){
+		if(assoofs_sb->snapshot_store[n] && assoofs_upgrade_store_v6(sb, assoofs_sb->snapshot_store[n], assoofs_sb->snapshot_inodes_count[n])){
+			return -1;
+		}
 	}
 
-	//SETEAMOS EL TIEPO Y DEVOLVEMOS EL INODO
-	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
-	inode->i_private = inode_info;
-	printk(KERN_INFO "\n");
-	return inode;
+	assoofs_sb->version = ASSOOFS_VERSION_USAGE;
+	assoofs_save_sb_info(sb);
+	return 0;
 }
 
 /* =========================================================== *
- *  OPERACIONES SOBRE EL SUPERBLOQUE  
+ *  OPCIONES DE MONTAJE
  * =========================================================== */
-static const struct super_operations assoofs_sops = {
-    .drop_inode = generic_delete_inode,
+/*
+ *   commit=N   metadatos escritos como mucho N segundos despues
+ *              de cambiarlos (0, por defecto: en el momento)
+ *   log        datos escritos fuera de sitio y en orden, a partir
+ *              de la cabeza del log (ver assoofs_log_relocate)
+ *   snapshot=N monta la instantanea N en lugar del sistema vivo;
+ *              exige montar en solo lectura
+ *   discard    los bloques liberados se descartan en el dispositivo
+ *              (thin provisioning, SSD) en lotes asincronos
+ */
+struct assoofs_mount_options {
+	unsigned int commit_interval;
+	bool log_mode;
+	unsigned int snapshot;
+	bool discard;
 };
 
-/* =========================================================== *
- *  CONSECUCION DE INFORMACION DE LOS INODOS   
- * =========================================================== */
-struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no){
+enum {
+	Opt_commit,
+	Opt_log,
+	Opt_snapshot,
+	Opt_discard,
+	Opt_nodiscard,
+	Opt_err,
+};
+
+static const match_table_t assoofs_tokens = {
+	{Opt_commit, "commit=%u"},
+	{Opt_log, "log"},
+	{Opt_snapshot, "snapshot=%u"},
+	{Opt_discard, "discard"},
+	{Opt_nodiscard, "nodiscard"},
+	{Opt_err, NULL},
+};
+
+static int assoofs_parse_options(char *options, struct assoofs_mount_options *opts){
 
 	/* ++++++++++++++++++++++++++++++++++++++++++++ /
 	 *       DECLARACION FUNCIONES                 *
 	/ ++++++++++++++++++++++++++++++++++++++++++++ */
-	struct assoofs_super_block_info *afs_sb = sb->s_fs_info;
-	struct assoofs_inode_info *inode_info = NULL;
-	struct assoofs_inode_info *buffer = NULL;
-	int i;
-	struct buffer_head *bh;
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+	int option;
 
-	//IMPRESION DE LA TRAZA CORRESPONDIENTE AL USO DE ESTA FUNCION
-	printk(KERN_INFO B "Get inode info request" RC "\n");
 
     /* ++++++++++++++++++++++++++++++++++++++++++++ /
      *      PROCECEMOS CON EL DESARROLLO           * 
     / ++++++++++++++++++++++++++++++++++++++++++++ */
 
-	//ACCEDEMOS A DISCO PARA LEER EL BLOQUE QUE CONTIENE EL ALMACEN DE INODOS
-	bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
-	inode_info = (struct assoofs_inode_info *)bh->b_data;
+	while(options && (p = strsep(&options, ",")) != NULL){
+		if(!*p){
+			continue;
+		}
 
-	//RECORREMOS EL ALMACÉN DE INODOS EN BUSCA DEL inode_no
-	for(i = 0; i < afs_sb->inodes_count; i++){
-		
-		if(inode_info->inode_no == inode_no){
-			if(inode_info->state_flag == ASSOOFS_STATE_ALIVE){
-				printk(KERN_INFO G "Alive" Y "-Node" RC " found (ino_number: %llu)\n", inode_no);
-				
+		switch(match_token(p, assoofs_tokens, args)){
+		case Opt_commit:
+			if(match_int(&args[0], &option) || option < 0 || option > ASSOOFS_MAX_COMMIT_INTERVAL){
+				printk(KERN_ERR "assoofs: commit must be between 0 and %d seconds.\n", ASSOOFS_MAX_COMMIT_INTERVAL);
+				return -EINVAL;
 			}
-
-			if(inode_info->state_flag == ASSOOFS_STATE_REMOVED){
-				printk(KERN_INFO R "Removed" Y "-Node" RC " found (ino_number: %llu)\n", inode_no);
+			opts->commit_interval = option;
+			break;
+		case Opt_log:
+			opts->log_mode = true;
+			break;
+		case Opt_snapshot:
+			if(match_int(&args[0], &option) || option < 1 || option > ASSOOFS_MAX_SNAPSHOTS){
+				printk(KERN_ERR "assoofs: snapshot must be between 1 and %d.\n", ASSOOFS_MAX_SNAPSHOTS);
+				return -EINVAL;
 			}
-
-   			buffer = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);	   //RESERVO MEMORIA EN EL KERNEL
-			memcpy(buffer, inode_info, sizeof(*buffer));					   //COPIO EN BUFFER EL CONTENIDO DEL INODO 
+			opts->snapshot = option;
+			break;
+		case Opt_discard:
+			opts->discard = true;
 			break;
+		case Opt_nodiscard:
+			opts->discard = false;
+			break;
+		default:
+			printk(KERN_ERR "assoofs: unknown mount option \"%s\".\n", p);
+			return -EINVAL;
 		}
-		inode_info++;
 	}
-
-	//LIBERAR RECURSOS Y DEVOLVER LA INFORMACIÓN DEL INODO SI ESTABA EN EL ALMACÉN
-	brelse(bh);			//LIBERAR EL FUFFER HEAD
-	printk(KERN_INFO "\n");
-	return buffer;		//DEVOLVER LA INFORMACIÓN DEL INODO QUE BUSCAMOS
-						//SI NO LO ENCUENTRA DEVUELVE BUFFER = NULL
+	return 0;
 }
 
 /* =========================================================== *
@@ -1010,23 +4045,47 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
 	struct inode *root_inode;									//AQUÍ VAMOS A GUARDAR EL INODO DEL ROOT
 	struct buffer_head *bh; 									//Aquí tendremos toda la información de un bloque
     struct assoofs_super_block_info *assoofs_sb;				//Puntero al superbloque (info) 
+    struct assoofs_fs_info *fsi;								//Informacion del montaje
+    struct assoofs_mount_options opts = { 0 };
+    int cpu;
 
-    //IMPRESION DE LA TRAZA CORRESPONDIENTE AL USO DE ESTA FUNCION
-    printk(KERN_INFO B "Fill_super request" RC "\n");
 
     /* ++++++++++++++++++++++++++++++++++++++++++++ /
      *      PROCECEMOS CON EL DESARROLLO           * 
     / ++++++++++++++++++++++++++++++++++++++++++++ */
 
+    if(assoofs_parse_options(data, &opts)){
+    	return -EINVAL;
+    }
+
     // 1.- Leer la información persistente del superbloque del dispositivo de bloques  
 
     	/* ++++++++++++++++++++++++++++++++++++++++++++ /
     	   *       LEER BLOQUES DE DISCO              * /
     	/ ++++++++++++++++++++++++++++++++++++++++++++ */ 
 
-    printk(KERN_INFO "Reading the blocks in the disk\n");
 
-    bh = sb_bread(sb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);			//Llamada a sb_bread, superbloque block read (superbloque, numero de bloque del superbloque)
+    fsi = kzalloc(sizeof(*fsi), GFP_KERNEL);
+    if(!fsi){
+    	return -ENOMEM;
+    }
+    sb->s_fs_info = fsi;
+    fsi->sb = sb;
+    INIT_DELAYED_WORK(&fsi->commit_work, assoofs_commit);
+    INIT_DELAYED_WORK(&fsi->discard_work, assoofs_discard_worker);
+    spin_lock_init(&fsi->log_lock);
+    spin_lock_init(&fsi->prealloc_lock);
+    INIT_LIST_HEAD(&fsi->prealloc);
+
+    //La cache de paginas traduce a bloques con s_blocksize: tiene que ser el de assoofs
+    if(!sb_set_blocksize(sb, ASSOOFS_DEFAULT_BLOCK_SIZE)){
+    	printk(KERN_ERR "assoofs needs a device with %d byte blocks.\n", ASSOOFS_DEFAULT_BLOCK_SIZE);
+    	kfree(fsi);
+    	sb->s_fs_info = NULL;
+    	return -EINVAL;
+    }
+
+    bh = assoofs_bread(sb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);			//Llamada a sb_bread, superbloque block read (superbloque, numero de bloque del superbloque)
     assoofs_sb = (struct assoofs_super_block_info *)bh->b_data; //Sacar el contenido del bloque (b_data)(Campo binario) (Meto en assoofs_sb la info del superbloque)
     			//Hacemos el cast para que se identifiquen los campos de info del superbloque	
     			//data es un void *				
@@ -1037,24 +4096,21 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
     	   *         COMPROBAR PARAMETROS             * /
     	/ ++++++++++++++++++++++++++++++++++++++++++++ */ 
 
-    printk(KERN_INFO "Checking parameters\n");
-    printk(KERN_INFO "The magic number obtained in disk is %llu\n", assoofs_sb->magic);
      if(assoofs_sb->magic != ASSOOFS_MAGIC){
     	printk(KERN_ERR "The filesystem that you want to mount is not assoofs. MAGIC_NUMBER mismatch.\n");
-    	printk(KERN_INFO "\n");
-    	brelse(bh);
-    	return -1;
+    	goto failed;
     }
 
-    printk(KERN_INFO "The block size obtained in disk is %lld\n", assoofs_sb->block_size);
     if(assoofs_sb->block_size != ASSOOFS_DEFAULT_BLOCK_SIZE){
     	printk(KERN_ERR "assoofs seems to be formated using a wrong block size. BLOCK_SIZE mismatch.\n");
-    	printk(KERN_INFO "\n");
-    	brelse(bh);
-    	return -1;
+    	goto failed;
+    }
+
+    if(assoofs_sb->version > ASSOOFS_VERSION){
+    	printk(KERN_ERR "assoofs on-disk version %llu is newer than this module (%d).\n", assoofs_sb->version, ASSOOFS_VERSION);
+    	goto failed;
     }
 
-    printk(KERN_INFO B "Recognised assoofs filesystem. (MAGIC_NUMBER = %llu & BLOCK_SIZE = %lld)" RC "\n", assoofs_sb->magic, assoofs_sb->block_size);
 
     // 3.- Escribir la información persistente leída del dispositivo de bloques en el superbloque sb, incluído el campo s_op con las operaciones que soporta.
 
@@ -1065,8 +4121,119 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
     sb->s_magic = ASSOOFS_MAGIC; 					//ASIGNAMOS EL NUMERO MAGICO AL NUEVO SUPERBLOQUE
     sb->s_maxbytes = ASSOOFS_DEFAULT_BLOCK_SIZE;	//ASIGNAMOS EL TAMAÑO DE BLOQUE
     sb->s_op = &assoofs_sops;						//ASIGNAMOS LAS OPERACIONES AL SUPERBLOQUE
-    sb->s_fs_info = assoofs_sb;
-    printk(KERN_INFO "Assigned parameters and operations\n");
+    fsi->sb_info = assoofs_sb;						//EL BLOQUE DEL SUPERBLOQUE QUEDA FIJADO HASTA EL put_super
+    fsi->sb_bh = bh;
+
+    //Las imagenes de la version 1 se pasan al almacen indexado antes de nada
+    if(assoofs_sb->version < ASSOOFS_VERSION_INODE_BITMAP && assoofs_upgrade_v1(sb)){
+    	goto failed;
+    }
+
+    //En la version 2 las referencias de los bloques eran relleno: ningun bloque esta compartido
+    if(assoofs_sb->version < ASSOOFS_VERSION_REFCOUNT){
+    	memset(assoofs_sb->block_refcount, 0, sizeof(assoofs_sb->block_refcount));
+    	assoofs_sb->version = ASSOOFS_VERSION_REFCOUNT;
+    	if(!sb_rdonly(sb)){
+    		assoofs_save_sb_info(sb);
+    	}
+    }
+
+    //Hasta la version 3 tampoco habia instantaneas
+    if(assoofs_sb->version < ASSOOFS_VERSION_SNAPSHOT){
+    	memset(assoofs_sb->snapshot_store, 0, sizeof(assoofs_sb->snapshot_store));
+    	memset(assoofs_sb->snapshot_inodes_count, 0, sizeof(assoofs_sb->snapshot_inodes_count));
+    	memset(assoofs_sb->snapshot_time, 0, sizeof(assoofs_sb->snapshot_time));
+    	assoofs_sb->version = ASSOOFS_VERSION_SNAPSHOT;
+    	if(!sb_rdonly(sb)){
+    		assoofs_save_sb_info(sb);
+    	}
+    }
+
+    //Hasta la version 4 el sistema ocupaba siempre 64 bloques aunque el dispositivo fuera mas pequeno
+    if(assoofs_sb->version < ASSOOFS_VERSION_BLOCKS_COUNT){
+    	assoofs_sb->blocks_count = min_t(uint64_t, assoofs_device_blocks(sb), ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED);
+    	assoofs_sb->free_blocks &= ASSOOFS_BLOCKS_MASK(assoofs_sb->blocks_count);
+    	assoofs_sb->version = ASSOOFS_VERSION_BLOCKS_COUNT;
+    	if(!sb_rdonly(sb)){
+    		assoofs_save_sb_info(sb);
+    	}
+    }
+
+    //Hasta la version 5 los inodos no llevaban los totales de los directorios
+    if(assoofs_sb->version < ASSOOFS_VERSION_USAGE && assoofs_upgrade_v6(sb)){
+    	goto failed;
+    }
+
+    //Hasta la version 6 no habia caracteristicas opcionales
+    if(assoofs_sb->version < ASSOOFS_VERSION_FEATURES){
+    	assoofs_sb->features = 0;
+    	assoofs_sb->version = ASSOOFS_VERSION_FEATURES;
+    	if(!sb_rdonly(sb)){
+    		assoofs_save_sb_info(sb);
+    	}
+    }
+
+    if(assoofs_sb->features & ~ASSOOFS_FEATURES_KNOWN){
+    	printk(KERN_ERR "assoofs image uses unknown features (%#llx).\n", assoofs_sb->features & ~ASSOOFS_FEATURES_KNOWN);
+    	goto failed;
+    }
+
+    //Imagen empaquetada (mkassoofs -p): sin mapas de bits que actualizar, solo se puede leer tal cual
+    if(assoofs_sb->features & ASSOOFS_FEATURE_PACKED){
+    	if(!sb_rdonly(sb) || opts.snapshot || opts.log_mode){
+    		printk(KERN_ERR "assoofs packed images can only be mounted read-only, without snapshot= or log.\n");
+    		goto failed;
+    	}
+    	if(assoofs_packed_load(sb)){
+    		goto failed;
+    	}
+    }
+
+    //Una imagen empaquetada no tiene mapa de bits de bloques y puede pasar de 64
+    if((!fsi->packed && assoofs_sb->blocks_count > ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED) || assoofs_sb->blocks_count > assoofs_device_blocks(sb)){
+    	printk(KERN_ERR "assoofs has %llu blocks but the device only holds %llu.\n", assoofs_sb->blocks_count, assoofs_device_blocks(sb));
+    	goto failed;
+    }
+
+    //Una instantanea se monta sobre la copia de su almacen de inodos, sin escribir nunca
+    fsi->inode_store = ASSOOFS_INODESTORE_BLOCK_NUMBER;
+    if(opts.snapshot){
+    	if(!sb_rdonly(sb)){
+    		printk(KERN_ERR "assoofs snapshots can only be mounted read-only.\n");
+    		goto failed;
+    	}
+    	if(!assoofs_sb->snapshot_store[opts.snapshot - 1]){
+    		printk(KERN_ERR "assoofs snapshot %u does not exist.\n", opts.snapshot);
+    		goto failed;
+    	}
+    	fsi->snapshot = opts.snapshot;
+    	fsi->inode_store = assoofs_sb->snapshot_store[opts.snapshot - 1];
+    }
+
+    //Los libres se recalculan de los mapas de bits: los campos del disco pueden venir de antes de un corte
+    if(percpu_counter_init(&fsi->free_blocks, hweight64(assoofs_sb->free_blocks), GFP_KERNEL) ||
+       percpu_counter_init(&fsi->free_inodes, hweight64(assoofs_sb->free_inodes), GFP_KERNEL)){
+    	goto failed;
+    }
+
+    //Ventanas de bloques reservados por CPU, vacias al montar
+    fsi->windows = alloc_percpu(struct assoofs_block_window);
+    if(!fsi->windows){
+    	goto failed;
+    }
+    for_each_possible_cpu(cpu){
+    	spin_lock_init(&per_cpu_ptr(fsi->windows, cpu)->lock);
+    }
+
+    //Cache de nombres de los directorios, vacia al montar y vaciada por el shrinker bajo presion de memoria
+    spin_lock_init(&fsi->dcache_lock);
+    hash_init(fsi->dcache);
+    fsi->dcache_shrinker.count_objects = assoofs_dcache_count;
+    fsi->dcache_shrinker.scan_objects = assoofs_dcache_scan;
+    fsi->dcache_shrinker.seeks = DEFAULT_SEEKS;
+    if(register_shrinker(&fsi->dcache_shrinker)){
+    	goto failed;
+    }
 
     // 4.- Crear el inodo raíz y asignarle operaciones sobre inodos (i_op) y sobre directorios (i_fop)
     
@@ -1074,34 +4241,55 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
     	   *    CREAR EL INODO RAIZ Y ASIGN. PARAM    * /
     	/ ++++++++++++++++++++++++++++++++++++++++++++ */
     
-    root_inode = new_inode(sb);			//Inicializamos el nodo con parametros del supoerbloque
-    inode_init_owner(root_inode, NULL, S_IFDIR); //Con esto seteamos propietario y permisos
+    if(fsi->packed){
+    	root_inode = assoofs_packed_get_inode(sb, NULL, ASSOOFS_ROOTDIR_INODE_NUMBER);
+    }else{
+    	root_inode = new_inode(sb);			//Inicializamos el nodo con parametros del supoerbloque
+    	inode_init_owner(root_inode, NULL, S_IFDIR); //Con esto seteamos propietario y permisos
     				//inodo, inodo padre, tipo de inodo (IFREG para ficheros regulares)
 
-    //Ahora pasamos a asignarle informacion necesaria a nuestro inodo
-    root_inode->i_ino = ASSOOFS_ROOTDIR_INODE_NUMBER;		//NUMERO DE INODO DEL ROOT
-    root_inode->i_sb = sb;									//PUNTERO AL SUPERBLOQUE
-    root_inode->i_op = &assoofs_inode_ops;					//DIRECCION VARIABLE DE INODE OPERATIONS
-    root_inode->i_fop = &assoofs_dir_operations;			//DIRECCION DE OPERACINOES DE DIRECTORIOS
+    	//Ahora pasamos a asignarle informacion necesaria a nuestro inodo
+    	root_inode->i_ino = ASSOOFS_ROOTDIR_INODE_NUMBER;		//NUMERO DE INODO DEL ROOT
+    	root_inode->i_sb = sb;									//PUNTERO AL SUPERBLOQUE
+    	root_inode->i_op = &assoofs_inode_ops;					//DIRECCION VARIABLE DE INODE OPERATIONS
+    	root_inode->i_fop = &assoofs_dir_operations;			//DIRECCION DE OPERACINOES DE DIRECTORIOS
     											//EN CASO DE SER FICHERO HAY OTRA FUNCION
-    root_inode->i_atime = root_inode->i_mtime = root_inode->i_ctime = current_time(root_inode);	//FECHAS Y HORA
-    root_inode->i_private = assoofs_get_inode_info(sb, ASSOOFS_ROOTDIR_INODE_NUMBER);	//INFORMACIÓN PERSISTENTE EN ELNODO
+    	root_inode->i_atime = root_inode->i_mtime = root_inode->i_ctime = current_time(root_inode);	//FECHAS Y HORA
+    	root_inode->i_private = assoofs_get_inode_info(sb, ASSOOFS_ROOTDIR_INODE_NUMBER);	//INFORMACIÓN PERSISTENTE EN ELNODO
+    }
 
     //GUARDAMOS EL INODO EN EL ARBOL DE INODOS (ESPECIAL YA QUE ES EL ROOT)
     sb->s_root = d_make_root(root_inode);
-    printk(KERN_INFO "Created the root inode with all the parameters and the README.txt file\n");
 
     if(!sb->s_root){
-    	brelse(bh);
-    	printk(KERN_INFO "\n");
-    	return -1;
+    	goto failed;
     }
 
-    printk(KERN_INFO G "Super_Block prepared to work" RC "\n");
+    //Estadisticas del montaje en /sys/kernel/debug/assoofs/<dispositivo>/stats
+    fsi->debugfs = debugfs_create_dir(sb->s_id, assoofs_debugfs_root);
+    debugfs_create_file("stats", 0444, fsi->debugfs, fsi, &assoofs_stats_fops);
 
-    brelse(bh);
-    printk(KERN_INFO "\n");
+    //Hasta aqui (actualizaciones de formato incluidas) las escrituras han sido sincronas
+    fsi->commit_interval = opts.commit_interval;
+    fsi->log_mode = opts.log_mode;
+
+    if(opts.discard && !blk_queue_discard(bdev_get_queue(sb->s_bdev))){
+    	printk(KERN_WARNING "assoofs: the device does not support discard, ignoring the discard option.\n");
+    	opts.discard = false;
+    }
+    fsi->discard = opts.discard;
     return 0;
+
+failed:
+    unregister_shrinker(&fsi->dcache_shrinker);		//No hace nada si no llego a registrarse
+    free_percpu(fsi->windows);
+    percpu_counter_destroy(&fsi->free_blocks);
+    percpu_counter_destroy(&fsi->free_inodes);
+    kfree(fsi->packed);
+    brelse(bh);
+    kfree(fsi);
+    sb->s_fs_info = NULL;
+    return -1;
 }
 
 /* =========================================================== *
@@ -1114,8 +4302,6 @@ static struct dentry *assoofs_mount(struct file_system_type *fs_type, int flags,
 	/ ++++++++++++++++++++++++++++++++++++++++++++ */	
 	struct dentry *ret;
 
-	//IMPRESION DE LA TRAZA CORRESPONDIENTE AL USO DE ESTA FUNCION
-    printk(KERN_INFO B "Mount request" RC "\n");
 
     /* ++++++++++++++++++++++++++++++++++++++++++++ /
      *      PROCECEMOS CON EL DESARROLLO           * 
@@ -1123,7 +4309,6 @@ static struct dentry *assoofs_mount(struct file_system_type *fs_type, int flags,
     ret = mount_bdev(fs_type, flags, dev_name, data, assoofs_fill_super);        //Función que monta el dispositivo
                                                                     //Esta función es la que se encargará de llenar nuestro superbloque con la información correspondiente
     // Control de errores a partir del valor de ret. En este caso se puede utilizar la macro IS_ERR: if (IS_ERR(ret)) ...
-    printk(KERN_INFO "\n");
     return ret;
 }
 
@@ -1147,19 +4332,26 @@ static int __init assoofs_init(void) {
 	/ ++++++++++++++++++++++++++++++++++++++++++++ */
 	int ret;
 
-	//IMPRESION DE LA TRAZA CORRESPONDIENTE AL USO DE ESTA FUNCION
-    printk(KERN_INFO B "Init request" RC "\n");
 
     /* ++++++++++++++++++++++++++++++++++++++++++++ /
      *      PROCECEMOS CON EL DESARROLLO           * 
     / ++++++++++++++++++++++++++++++++++++++++++++ */
-    ret = register_filesystem(&assoofs_type);
-    
     //configuramos la cache inicializandola como sigue
     assoofs_inode_cache = kmem_cache_create("assoofs_inode_cache", sizeof(struct assoofs_inode_info), 0, (SLAB_RECLAIM_ACCOUNT|SLAB_MEM_SPREAD), NULL);
+    if(!assoofs_inode_cache){
+    	return -ENOMEM;
+    }
+
+    //Raiz de las estadisticas de los montajes en debugfs
+    assoofs_debugfs_root = debugfs_create_dir("assoofs", NULL);
+
+    ret = register_filesystem(&assoofs_type);
+    if(ret){
+    	debugfs_remove_recursive(assoofs_debugfs_root);
+    	kmem_cache_destroy(assoofs_inode_cache);
+    }
 
     // Control de errores a partir del valor de ret
-    printk(KERN_INFO "\n");
     return ret;
 }
 
@@ -1173,27 +4365,19 @@ static void __exit assoofs_exit(void) {
 	/ ++++++++++++++++++++++++++++++++++++++++++++ */
 	int ret;
 
-	//IMPRESION DE LA TRAZA CORRESPONDIENTE AL USO DE ESTA FUNCION
-    printk(KERN_INFO B "Exit request" RC "\n");
 
     /* ++++++++++++++++++++++++++++++++++++++++++++ /
      *      PROCECEMOS CON EL DESARROLLO           * 
     / ++++++++++++++++++++++++++++++++++++++++++++ */
     
-    //procedemos a liberar la cache cuando desmontamos el modulo
-    kmem_cache_destroy(assoofs_inode_cache);
     ret = unregister_filesystem(&assoofs_type);
+    if(ret){
+    	printk(KERN_ERR "assoofs could not be unregistered (%d)\n", ret);
+    }
 
-    //Traza de salida
-    printk(KERN_INFO B "I hope you have enjoyed assoofs file_system" RC "\n");
-    printk(KERN_INFO B "Have a nice day" RC "\n");
-   
-    // Control de errores a partir del valor de ret
-    if(ret == 0)
-    	printk(KERN_INFO G "Exit successfully" RC "\n");
-    else
-    	printk(KERN_INFO R "Exit with errors" RC "\n");
-     printk(KERN_INFO "\n");
+    //procedemos a liberar la cache y debugfs cuando desmontamos el modulo
+    debugfs_remove_recursive(assoofs_debugfs_root);
+    kmem_cache_destroy(assoofs_inode_cache);
 }
 
 module_init(assoofs_init);
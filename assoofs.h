@@ -1,27 +1,86 @@
+#ifndef ASSOOFS_H
+#define ASSOOFS_H
+
+#include <linux/ioctl.h>
+
 #define ASSOOFS_MAGIC 0x20200406
+//Version 2: mapa de bits de inodos libres y almacen indexado por numero de inodo
+//Version 3: contador de referencias por bloque para los reflink
+//Version 4: instantaneas de solo lectura
+//Version 5: numero de bloques del sistema en el superbloque (crecimiento en linea)
+//Version 6: totales recursivos de bytes e inodos en cada directorio (inodos de 56 bytes)
+//Version 7: campo features en el superbloque (imagenes empaquetadas)
+#define ASSOOFS_VERSION_INODE_BITMAP 2
+#define ASSOOFS_VERSION_REFCOUNT 3
+#define ASSOOFS_VERSION_SNAPSHOT 4
+#define ASSOOFS_VERSION_BLOCKS_COUNT 5
+#define ASSOOFS_VERSION_USAGE 6
+#define ASSOOFS_VERSION_FEATURES 7
+#define ASSOOFS_VERSION ASSOOFS_VERSION_FEATURES
 #define ASSOOFS_DEFAULT_BLOCK_SIZE 4096
 #define ASSOOFS_FILENAME_MAXLEN 255
 #define ASSOOFS_LAST_RESERVED_BLOCK ASSOOFS_ROOTDIR_BLOCK_NUMBER
 #define ASSOOFS_LAST_RESERVED_INODE ASSOOFS_ROOTDIR_INODE_NUMBER
-const int ASSOOFS_SUPERBLOCK_BLOCK_NUMBER = 0;
-const int ASSOOFS_INODESTORE_BLOCK_NUMBER = 1;
-const int ASSOOFS_ROOTDIR_BLOCK_NUMBER = 2;
-const int ASSOOFS_ROOTDIR_INODE_NUMBER = 1;
-const int ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED = 64;
+//Macros en lugar de const int para poder incluir la cabecera desde varios ficheros
+#define ASSOOFS_SUPERBLOCK_BLOCK_NUMBER 0
+#define ASSOOFS_INODESTORE_BLOCK_NUMBER 1
+#define ASSOOFS_ROOTDIR_BLOCK_NUMBER 2
+#define ASSOOFS_ROOTDIR_INODE_NUMBER 1
+#define ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED 64
+
+//Desde la version 2 el inodo N ocupa siempre la posicion N - 1 del almacen
+#define ASSOOFS_INODE_SLOT(ino) ((ino) - ASSOOFS_ROOTDIR_INODE_NUMBER)
+#define ASSOOFS_SLOT_INODE(slot) ((slot) + ASSOOFS_ROOTDIR_INODE_NUMBER)
+
+//Bits del mapa de bloques que caen dentro de un sistema de n bloques
+#define ASSOOFS_BLOCKS_MASK(n) ((n) >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED ? ~0ULL : (1ULL << (n)) - 1)
+
+//Grupos de bloques: los mapas de bits de bloques y de inodos se usan por tramos de 16 bits.
+//El grupo g son los bloques [16g, 16g + 16) y las posiciones [16g, 16g + 16) del almacen
+#define ASSOOFS_GROUP_SIZE 16
+#define ASSOOFS_GROUPS (ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED / ASSOOFS_GROUP_SIZE)
+#define ASSOOFS_GROUP_OF(n) ((n) / ASSOOFS_GROUP_SIZE)
+#define ASSOOFS_GROUP_MASK(g) (((1ULL << ASSOOFS_GROUP_SIZE) - 1) << ((g) * ASSOOFS_GROUP_SIZE))
+
+//Un bloque compartido admite como mucho 255 referencias extra
+#define ASSOOFS_MAX_BLOCK_REFCOUNT 255
+
+//Instantaneas: una copia del almacen de inodos que comparte todos los bloques con el sistema vivo.
+//Se numeran de 1 a ASSOOFS_MAX_SNAPSHOTS; la N ocupa la posicion N - 1 de los campos del superbloque
+#define ASSOOFS_MAX_SNAPSHOTS 4
+#define ASSOOFS_IOC_SNAP_CREATE _IOR('A', 1, uint32_t)     //Devuelve el numero de la nueva instantanea
+#define ASSOOFS_IOC_SNAP_DELETE _IOW('A', 2, uint32_t)
+//Crecer hasta el numero de bloques pedido (0 = todo el dispositivo); devuelve el numero final
+#define ASSOOFS_IOC_RESIZE _IOWR('A', 3, uint64_t)
+//Lo que ocupa todo lo que cuelga de un directorio (de un fichero, sus bytes), sin recorrerlo
+#define ASSOOFS_IOC_GET_USAGE _IOR('A', 4, struct assoofs_usage)
+
+//Caracteristicas del superbloque (features, version 7): no se monta una imagen con alguna desconocida
+#define ASSOOFS_FEATURE_PACKED 0x1          //Imagen empaquetada de solo lectura (mkassoofs -p)
+#define ASSOOFS_FEATURES_KNOWN ASSOOFS_FEATURE_PACKED
 
 //Constantes necesarias para el remove
 #define ASSOOFS_STATE_ALIVE 1
 #define ASSOOFS_STATE_REMOVED 0
 
-//El relleno original de 4056 bytes lo he cambiado por 4048 debido al nuevo campo introducido
+//El relleno original de 4056 bytes lo he cambiado por 3848 debido a los nuevos campos introducidos
 struct assoofs_super_block_info {
     uint64_t version;
     uint64_t magic;
     uint64_t block_size;    
-    uint64_t inodes_count;			//Lleva una cuenta irreal de los inodos, todos los creados
+    uint64_t inodes_count;			//Posiciones del almacen de inodos en uso (la mas alta + 1)
     uint64_t free_blocks;
     uint64_t real_inodes_count;		//Lleva la cuenta real de los nodos vivos en el sistema
-    char padding[4048];
+    uint64_t free_blocks_count;		//Bloques libres segun el ultimo sync (el modulo lo recalcula al montar)
+    uint64_t free_inodes_count;		//Inodos que aun se pueden crear segun el ultimo sync
+    uint64_t free_inodes;			//Mapa de bits de posiciones libres del almacen (bit = 1 libre), version 2
+    uint8_t block_refcount[ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED];	//Referencias extra de cada bloque (0 = un solo dueno), version 3
+    uint64_t snapshot_store[ASSOOFS_MAX_SNAPSHOTS];			//Bloque con la copia del almacen de cada instantanea (0 = no existe), version 4
+    uint64_t snapshot_inodes_count[ASSOOFS_MAX_SNAPSHOTS];	//inodes_count al tomarla
+    uint64_t snapshot_time[ASSOOFS_MAX_SNAPSHOTS];			//Segundos desde 1970 al tomarla
+    uint64_t blocks_count;			//Bloques del sistema (como mucho ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED); los de detras nunca estan libres, version 5
+    uint64_t features;				//ASSOOFS_FEATURE_*, version 7
+    char padding[3848];
 };
 
 struct assoofs_dir_record_entry {
@@ -39,4 +98,57 @@ struct assoofs_inode_info {
         uint64_t dir_children_count;
     };
     uint64_t state_flag;                //atributo que controla si un inodo esta borrado o esta vivo
-};
\ No newline at end of file
+    uint64_t usage_bytes;               //Directorios: bytes de todos los ficheros que cuelgan de el, a cualquier profundidad, version 6
+    uint64_t usage_inodes;              //Directorios: ficheros y directorios que cuelgan de el, sin contarse a si mismo, version 6
+};
+
+//Inodo de las versiones 1 a 5, sin los totales; solo para actualizar imagenes antiguas
+struct assoofs_inode_info_v5 {
+    mode_t mode;
+    uint64_t inode_no;
+    uint64_t data_block_number;
+    union {
+        uint64_t file_size;
+        uint64_t dir_children_count;
+    };
+    uint64_t state_flag;
+};
+
+struct assoofs_usage {
+    uint64_t bytes;
+    uint64_t inodes;
+};
+
+/*
+ * Imagen empaquetada (ASSOOFS_FEATURE_PACKED), de solo lectura. Sin
+ * mapas de bits ni entradas borradas, y todo se direcciona por byte:
+ *   bloque 0    superbloque; inodes_count inodos, blocks_count bloques
+ *   byte 4096   tabla de inodos, el inodo N en la posicion N - 1
+ *   despues     las entradas de cada directorio, de tamano variable
+ *   despues     los datos de los ficheros en el orden de acceso previsto;
+ *               ninguno cruza un limite de bloque y los ficheros pequenos
+ *               rellenan el final de los bloques anteriores
+ * Los ficheros de hasta ASSOOFS_PACKED_INLINE bytes van dentro del inodo.
+ */
+#define ASSOOFS_PACKED_INODES_OFFSET ASSOOFS_DEFAULT_BLOCK_SIZE
+#define ASSOOFS_PACKED_INLINE 16
+
+struct assoofs_packed_inode {
+    uint32_t mode;                      //Tipo y permisos
+    uint32_t size;                      //Fichero: bytes; directorio: bytes de sus entradas
+    uint32_t usage_bytes;               //Directorios: los mismos totales que en assoofs_inode_info
+    uint32_t usage_inodes;
+    union {
+        uint64_t offset;                //Byte de la imagen donde empiezan los datos o las entradas
+        char data[ASSOOFS_PACKED_INLINE];   //Ficheros de hasta ASSOOFS_PACKED_INLINE bytes
+    };
+};
+
+//Entrada de directorio empaquetada: 5 bytes y el nombre, sin terminador
+struct assoofs_packed_dirent {
+    uint32_t inode_no;
+    uint8_t name_len;
+    char name[];
+} __attribute__((packed));
+
+#endif
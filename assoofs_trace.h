@@ -0,0 +1,371 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM assoofs
+
+#if !defined(_ASSOOFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ASSOOFS_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/fs.h>
+
+/**************************************************************
+* Puntos de traza de assoofs. Sustituyen a las trazas con printk
+* de las operaciones frecuentes: desactivados no cuestan nada
+* (static keys) y se activan con perf trace, bpftrace o desde
+* /sys/kernel/tracing/events/assoofs/
+***************************************************************/
+
+//Lectura o escritura de un fichero
+DECLARE_EVENT_CLASS(assoofs_rw_class,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len),
+	TP_ARGS(inode, pos, len),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(loff_t, pos)
+		__field(size_t, len)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->pos = pos;
+		__entry->len = len;
+	),
+	TP_printk("dev %d:%d ino %lu pos %lld len %zu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->ino, __entry->pos, __entry->len)
+);
+
+DEFINE_EVENT(assoofs_rw_class, assoofs_read,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len),
+	TP_ARGS(inode, pos, len));
+
+DEFINE_EVENT(assoofs_rw_class, assoofs_write,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len),
+	TP_ARGS(inode, pos, len));
+
+//Lote de paginas sucias de un fichero llevado a disco
+TRACE_EVENT(assoofs_writepages,
+	TP_PROTO(struct inode *inode, long written, int ret),
+	TP_ARGS(inode, written, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(long, written)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->written = written;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d:%d ino %lu pages %ld ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->ino, __entry->written, __entry->ret)
+);
+
+//Busqueda de un nombre en un directorio
+TRACE_EVENT(assoofs_lookup,
+	TP_PROTO(struct inode *dir, const char *name, unsigned long ino),
+	TP_ARGS(dir, name, ino),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__field(unsigned long, ino)
+		__string(name, name)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->ino = ino;
+		__assign_str(name, name);
+	),
+	TP_printk("dev %d:%d dir %lu name %s ino %lu%s",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __get_str(name), __entry->ino, __entry->ino ? "" : " (miss)")
+);
+
+//Listado de un directorio
+TRACE_EVENT(assoofs_iterate,
+	TP_PROTO(struct inode *dir, int emitted),
+	TP_ARGS(dir, emitted),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__field(int, emitted)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->emitted = emitted;
+	),
+	TP_printk("dev %d:%d dir %lu emitted %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->dir, __entry->emitted)
+);
+
+//Cambios en el espacio de nombres: create, mkdir, unlink, rmdir
+DECLARE_EVENT_CLASS(assoofs_namespace_class,
+	TP_PROTO(struct inode *dir, const char *name, unsigned long ino, umode_t mode),
+	TP_ARGS(dir, name, ino, mode),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__field(unsigned long, ino)
+		__field(umode_t, mode)
+		__string(name, name)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->ino = ino;
+		__entry->mode = mode;
+		__assign_str(name, name);
+	),
+	TP_printk("dev %d:%d dir %lu name %s ino %lu mode 0%o",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __get_str(name), __entry->ino, __entry->mode)
+);
+
+DEFINE_EVENT(assoofs_namespace_class, assoofs_create,
+	TP_PROTO(struct inode *dir, const char *name, unsigned long ino, umode_t mode),
+	TP_ARGS(dir, name, ino, mode));
+
+DEFINE_EVENT(assoofs_namespace_class, assoofs_remove,
+	TP_PROTO(struct inode *dir, const char *name, unsigned long ino, umode_t mode),
+	TP_ARGS(dir, name, ino, mode));
+
+TRACE_EVENT(assoofs_rename,
+	TP_PROTO(struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir, struct dentry *new_dentry),
+	TP_ARGS(old_dir, old_dentry, new_dir, new_dentry),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, old_dir)
+		__field(unsigned long, new_dir)
+		__string(old_name, old_dentry->d_name.name)
+		__string(new_name, new_dentry->d_name.name)
+	),
+	TP_fast_assign(
+		__entry->dev = old_dir->i_sb->s_dev;
+		__entry->old_dir = old_dir->i_ino;
+		__entry->new_dir = new_dir->i_ino;
+		__assign_str(old_name, old_dentry->d_name.name);
+		__assign_str(new_name, new_dentry->d_name.name);
+	),
+	TP_printk("dev %d:%d %lu/%s -> %lu/%s",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->old_dir, __get_str(old_name),
+		  __entry->new_dir, __get_str(new_name))
+);
+
+//Reserva y liberacion de bloques en el mapa de bits
+DECLARE_EVENT_CLASS(assoofs_block_class,
+	TP_PROTO(struct super_block *sb, u64 block, u64 free_blocks),
+	TP_ARGS(sb, block, free_blocks),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, block)
+		__field(u64, free_blocks)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->block = block;
+		__entry->free_blocks = free_blocks;
+	),
+	TP_printk("dev %d:%d block %llu bitmap 0x%016llx",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->block, __entry->free_blocks)
+);
+
+DEFINE_EVENT(assoofs_block_class, assoofs_alloc_block,
+	TP_PROTO(struct super_block *sb, u64 block, u64 free_blocks),
+	TP_ARGS(sb, block, free_blocks));
+
+DEFINE_EVENT(assoofs_block_class, assoofs_free_block,
+	TP_PROTO(struct super_block *sb, u64 block, u64 free_blocks),
+	TP_ARGS(sb, block, free_blocks));
+
+//Ventana de bloques que una CPU saca del mapa de bits (taken = 1) o devuelve (taken = 0)
+TRACE_EVENT(assoofs_reserve,
+	TP_PROTO(struct super_block *sb, u64 blocks, int taken),
+	TP_ARGS(sb, blocks, taken),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, blocks)
+		__field(int, taken)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->blocks = blocks;
+		__entry->taken = taken;
+	),
+	TP_printk("dev %d:%d %s 0x%016llx",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->taken ? "reserve" : "return", __entry->blocks)
+);
+
+//Reflink: el destino pasa a compartir el bloque del origen
+TRACE_EVENT(assoofs_clone,
+	TP_PROTO(struct inode *src, struct inode *dst, u64 block),
+	TP_ARGS(src, dst, block),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, src)
+		__field(unsigned long, dst)
+		__field(u64, block)
+	),
+	TP_fast_assign(
+		__entry->dev = src->i_sb->s_dev;
+		__entry->src = src->i_ino;
+		__entry->dst = dst->i_ino;
+		__entry->block = block;
+	),
+	TP_printk("dev %d:%d ino %lu -> ino %lu block %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->src, __entry->dst, __entry->block)
+);
+
+//Copia en escritura de un bloque compartido
+TRACE_EVENT(assoofs_cow,
+	TP_PROTO(struct super_block *sb, u64 old_block, u64 new_block),
+	TP_ARGS(sb, old_block, new_block),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, old_block)
+		__field(u64, new_block)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->old_block = old_block;
+		__entry->new_block = new_block;
+	),
+	TP_printk("dev %d:%d block %llu -> %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->old_block, __entry->new_block)
+);
+
+//Instantanea creada (created = 1) o borrada (created = 0)
+TRACE_EVENT(assoofs_snapshot,
+	TP_PROTO(struct super_block *sb, u32 id, u64 store, int created),
+	TP_ARGS(sb, id, store, created),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u32, id)
+		__field(u64, store)
+		__field(int, created)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->id = id;
+		__entry->store = store;
+		__entry->created = created;
+	),
+	TP_printk("dev %d:%d %s snapshot %u store block %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->created ? "create" : "delete", __entry->id, __entry->store)
+);
+
+//Crecimiento en linea del sistema
+TRACE_EVENT(assoofs_resize,
+	TP_PROTO(struct super_block *sb, u64 old_blocks, u64 new_blocks),
+	TP_ARGS(sb, old_blocks, new_blocks),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, old_blocks)
+		__field(u64, new_blocks)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->old_blocks = old_blocks;
+		__entry->new_blocks = new_blocks;
+	),
+	TP_printk("dev %d:%d blocks %llu -> %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->old_blocks, __entry->new_blocks)
+);
+
+//Peticion de discard de un tramo de bloques libres (lote de discard o FITRIM)
+TRACE_EVENT(assoofs_discard,
+	TP_PROTO(struct super_block *sb, u64 start, u64 len, int ret),
+	TP_ARGS(sb, start, len, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, start)
+		__field(u64, len)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->start = start;
+		__entry->len = len;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d:%d blocks %llu+%llu ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->start, __entry->len, __entry->ret)
+);
+
+//Cambio en los totales recursivos de los depth directorios antepasados de una dentry
+TRACE_EVENT(assoofs_usage,
+	TP_PROTO(struct super_block *sb, s64 bytes, s64 inodes, int depth),
+	TP_ARGS(sb, bytes, inodes, depth),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(s64, bytes)
+		__field(s64, inodes)
+		__field(int, depth)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->bytes = bytes;
+		__entry->inodes = inodes;
+		__entry->depth = depth;
+	),
+	TP_printk("dev %d:%d bytes %+lld inodes %+lld depth %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->bytes, __entry->inodes, __entry->depth)
+);
+
+//Escritura sincrona de metadatos (superbloque, almacen de inodos)
+TRACE_EVENT(assoofs_sync_write,
+	TP_PROTO(struct super_block *sb, sector_t block),
+	TP_ARGS(sb, block),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(sector_t, block)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->block = block;
+	),
+	TP_printk("dev %d:%d block %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long long)__entry->block)
+);
+
+//Commit periodico de los metadatos (commit=N)
+TRACE_EVENT(assoofs_commit,
+	TP_PROTO(struct super_block *sb, s64 delayed_writes, int ret),
+	TP_ARGS(sb, delayed_writes, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(s64, delayed_writes)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->delayed_writes = delayed_writes;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d:%d delayed_writes %lld ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->delayed_writes, __entry->ret)
+);
+
+#endif /* _ASSOOFS_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE assoofs_trace
+#include <trace/define_trace.h>
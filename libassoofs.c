@@ -0,0 +1,883 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "libassoofs.h"
+
+/**************************************************************
+* Totales recursivos calculados desde cero: el padre de cada
+* inodo sale de las entradas de los directorios y cada inodo
+* suma lo suyo a toda su cadena de antepasados. Lo usan la
+* actualizacion a la version 6 y assoofs_image_usage_scan
+***************************************************************/
+
+static void scan_usage(const struct assoofs_image *img, const struct assoofs_inode_info *table, uint64_t count,
+                       struct assoofs_usage *usage) {
+    int parent[ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED], p, depth;
+    struct assoofs_dir_record_entry *record;
+    struct assoofs_dir_iter it;
+    uint64_t i, slot, bytes;
+
+    memset(usage, 0, ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED * sizeof(*usage));
+    if (count > ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)
+        count = ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED;
+
+    for (i = 0; i < count; i++)
+        parent[i] = -1;
+
+    for (i = 0; i < count; i++) {
+        if (table[i].state_flag != ASSOOFS_STATE_ALIVE || !S_ISDIR(table[i].mode) || assoofs_dir_iter_init(&it, img, &table[i]))
+            continue;
+        while ((record = assoofs_dir_iter_next(&it))) {
+            slot = ASSOOFS_INODE_SLOT(record->inode_no);
+            if (record->inode_no > ASSOOFS_ROOTDIR_INODE_NUMBER && slot < count)
+                parent[slot] = i;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (table[i].state_flag != ASSOOFS_STATE_ALIVE)
+            continue;
+        bytes = S_ISREG(table[i].mode) ? table[i].file_size : 0;
+        for (p = parent[i], depth = 0; p >= 0 && depth < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; p = parent[p], depth++) {
+            usage[p].bytes += bytes;
+            usage[p].inodes++;
+        }
+    }
+}
+
+//Inodos de 40 bytes (versiones 1 a 5) al formato de la version 6, con los totales de cada directorio
+static uint64_t convert_table(const struct assoofs_image *img, const struct assoofs_inode_info_v5 *old, uint64_t count,
+                              struct assoofs_inode_info *table) {
+    struct assoofs_usage usage[ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED];
+    uint64_t i;
+
+    if (count > ASSOOFS_INODES_PER_BLOCK)
+        count = ASSOOFS_INODES_PER_BLOCK;
+
+    memset(table, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    for (i = 0; i < count; i++) {
+        table[i].mode = old[i].mode;
+        table[i].inode_no = old[i].inode_no;
+        table[i].data_block_number = old[i].data_block_number;
+        table[i].file_size = old[i].file_size;
+        table[i].state_flag = old[i].state_flag;
+    }
+
+    //En la version 1 la posicion no dice el inodo: se queda sin totales hasta que se actualice
+    if (img->sb->version < ASSOOFS_VERSION_INODE_BITMAP)
+        return count;
+
+    scan_usage(img, table, count, usage);
+    for (i = 0; i < count && i < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++) {
+        table[i].usage_bytes = usage[i].bytes;
+        table[i].usage_inodes = usage[i].inodes;
+    }
+    return count;
+}
+
+//Una imagen anterior a la version 6 se lee a traves de una copia convertida del almacen, sin tocar la imagen
+static int legacy_view(struct assoofs_image *img, uint64_t store, uint64_t count) {
+    const struct assoofs_inode_info_v5 *old = assoofs_image_block(img, store);
+
+    if (!old)
+        return -1;
+    if (!img->legacy && !(img->legacy = malloc(ASSOOFS_DEFAULT_BLOCK_SIZE)))
+        return -1;
+    img->legacy_count = convert_table(img, old, count, img->legacy);
+    return 0;
+}
+
+/**************************************************************
+* Abrir una imagen (fichero o dispositivo de bloques) y
+* proyectarla en memoria. Se comprueban el numero magico y el
+* tamano de bloque igual que en assoofs_fill_super. Las imagenes
+* empaquetadas (mkassoofs -p) no tienen almacen de inodos ni
+* mapas de bits y se rechazan con EOPNOTSUPP
+***************************************************************/
+
+int assoofs_image_open(struct assoofs_image *img, const char *path, int flags) {
+    struct stat st;
+    uint64_t size;
+    int prot = PROT_READ;
+
+    memset(img, 0, sizeof(*img));
+    img->fd = open(path, (flags & ASSOOFS_IMAGE_RDWR) ? O_RDWR : O_RDONLY);
+    if (img->fd == -1)
+        return -1;
+
+    if (fstat(img->fd, &st))
+        goto err;
+
+    //Para un dispositivo de bloques st_size vale 0, hay que preguntarle al kernel
+    if (S_ISBLK(st.st_mode)) {
+        if (ioctl(img->fd, BLKGETSIZE64, &size))
+            goto err;
+    } else {
+        size = st.st_size;
+    }
+
+    if (size < (ASSOOFS_ROOTDIR_BLOCK_NUMBER + 1) * ASSOOFS_DEFAULT_BLOCK_SIZE) {
+        errno = EINVAL;
+        goto err;
+    }
+
+    if (flags & ASSOOFS_IMAGE_RDWR)
+        prot |= PROT_WRITE;
+
+    img->map = mmap(NULL, size, prot, MAP_SHARED, img->fd, 0);
+    if (img->map == MAP_FAILED) {
+        img->map = NULL;
+        goto err;
+    }
+
+    img->flags = flags;
+    img->size = size;
+    img->nblocks = size / ASSOOFS_DEFAULT_BLOCK_SIZE;
+    img->sb = (struct assoofs_super_block_info *)img->map;
+
+    if (img->sb->magic != ASSOOFS_MAGIC || img->sb->block_size != ASSOOFS_DEFAULT_BLOCK_SIZE) {
+        errno = EINVAL;
+        goto err;
+    }
+
+    if (img->sb->version >= ASSOOFS_VERSION_FEATURES && img->sb->features) {
+        errno = (img->sb->features & ~ASSOOFS_FEATURES_KNOWN) ? EINVAL : EOPNOTSUPP;
+        goto err;
+    }
+
+    if (img->sb->version < ASSOOFS_VERSION_USAGE && legacy_view(img, ASSOOFS_INODESTORE_BLOCK_NUMBER, img->sb->inodes_count))
+        goto err;
+
+    return 0;
+
+err:
+    assoofs_image_close(img);
+    return -1;
+}
+
+void assoofs_image_close(struct assoofs_image *img) {
+    int saved = errno;
+
+    free(img->legacy);
+    if (img->map)
+        munmap(img->map, img->size);
+    if (img->fd >= 0)
+        close(img->fd);
+    memset(img, 0, sizeof(*img));
+    img->fd = -1;
+    errno = saved;
+}
+
+//Forzar a disco los cambios hechos a traves de la proyeccion
+int assoofs_image_sync(struct assoofs_image *img) {
+    if (!(img->flags & ASSOOFS_IMAGE_RDWR))
+        return 0;
+    return msync(img->map, img->size, MS_SYNC);
+}
+
+/**************************************************************
+* Accesores sin copia
+***************************************************************/
+
+void *assoofs_image_block(const struct assoofs_image *img, uint64_t block) {
+    if (block >= img->nblocks) {
+        errno = ERANGE;
+        return NULL;
+    }
+    return img->map + block * ASSOOFS_DEFAULT_BLOCK_SIZE;
+}
+
+//Devuelve el almacen de inodos (el de la instantanea si hay una elegida) y en count el numero de entradas usadas
+struct assoofs_inode_info *assoofs_image_inode_table(const struct assoofs_image *img, uint64_t *count) {
+    if (img->legacy) {
+        if (count)
+            *count = img->legacy_count;
+        return img->legacy;
+    }
+
+    if (img->snapshot) {
+        if (count) {
+            *count = img->sb->snapshot_inodes_count[img->snapshot - 1];
+            if (*count > ASSOOFS_INODES_PER_BLOCK)
+                *count = ASSOOFS_INODES_PER_BLOCK;
+        }
+        return assoofs_image_block(img, img->sb->snapshot_store[img->snapshot - 1]);
+    }
+
+    if (count) {
+        *count = img->sb->inodes_count;
+        if (*count > ASSOOFS_INODES_PER_BLOCK)
+            *count = ASSOOFS_INODES_PER_BLOCK;
+    }
+    return assoofs_image_block(img, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+}
+
+/*
+ * Igual que assoofs_get_inode_info: desde la version 2 el inodo N
+ * esta en la posicion N - 1. En una imagen de la version 1 hay
+ * que recorrer el almacen y preferimos la entrada viva si hay varias
+ */
+struct assoofs_inode_info *assoofs_image_inode(const struct assoofs_image *img, uint64_t inode_no) {
+    struct assoofs_inode_info *inode, *found = NULL;
+    uint64_t count, i;
+
+    inode = assoofs_image_inode_table(img, &count);
+
+    if (img->sb->version >= ASSOOFS_VERSION_INODE_BITMAP) {
+        i = ASSOOFS_INODE_SLOT(inode_no);
+        if (inode_no >= ASSOOFS_ROOTDIR_INODE_NUMBER && i < count && inode[i].inode_no == inode_no)
+            return &inode[i];
+        errno = ENOENT;
+        return NULL;
+    }
+
+    for (i = 0; i < count; i++, inode++) {
+        if (inode->inode_no != inode_no)
+            continue;
+        if (inode->state_flag == ASSOOFS_STATE_ALIVE)
+            return inode;
+        if (!found)
+            found = inode;
+    }
+
+    if (!found)
+        errno = ENOENT;
+    return found;
+}
+
+/**************************************************************
+* Recorrido de directorios. Igual que en el modulo, el
+* directorio tiene dir_children_count entradas vivas mezcladas
+* con entradas borradas que hay que saltar
+***************************************************************/
+
+int assoofs_dir_iter_init(struct assoofs_dir_iter *it, const struct assoofs_image *img, const struct assoofs_inode_info *dir) {
+    if (!S_ISDIR(dir->mode)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+
+    it->record = assoofs_image_block(img, dir->data_block_number);
+    if (!it->record)
+        return -1;
+
+    it->end = it->record + ASSOOFS_DIR_RECORDS_PER_BLOCK;
+    it->remaining = dir->dir_children_count;
+    return 0;
+}
+
+struct assoofs_dir_record_entry *assoofs_dir_iter_next(struct assoofs_dir_iter *it) {
+    while (it->remaining && it->record < it->end) {
+        struct assoofs_dir_record_entry *record = it->record++;
+
+        if (record->state_flag == ASSOOFS_STATE_ALIVE) {
+            it->remaining--;
+            return record;
+        }
+    }
+    return NULL;
+}
+
+struct assoofs_inode_info *assoofs_image_lookup(const struct assoofs_image *img, const struct assoofs_inode_info *dir, const char *name) {
+    struct assoofs_dir_iter it;
+    struct assoofs_dir_record_entry *record;
+
+    if (assoofs_dir_iter_init(&it, img, dir))
+        return NULL;
+
+    while ((record = assoofs_dir_iter_next(&it)))
+        if (!strcmp(record->filename, name))
+            return assoofs_image_inode(img, record->inode_no);
+
+    errno = ENOENT;
+    return NULL;
+}
+
+/**************************************************************
+* Tramos de datos de un fichero. Hoy cada fichero ocupa un
+* unico bloque, asi que siempre hay como mucho un tramo
+***************************************************************/
+
+int assoofs_file_extents(const struct assoofs_image *img, const struct assoofs_inode_info *inode, struct assoofs_extent *ext, int max) {
+    if (!S_ISREG(inode->mode)) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    if (!max || !inode->file_size)
+        return 0;
+
+    ext->block = inode->data_block_number;
+    ext->length = inode->file_size;
+    if (ext->length > ASSOOFS_DEFAULT_BLOCK_SIZE)
+        ext->length = ASSOOFS_DEFAULT_BLOCK_SIZE;
+    ext->data = assoofs_image_block(img, ext->block);
+    if (!ext->data)
+        return -1;
+
+    return 1;
+}
+
+/**************************************************************
+* Consecucion de un bloque libre: el primer bit a 1 del grupo
+* goal a partir del bloque 2 o, si esta lleno, del siguiente
+* grupo con sitio, igual que assoofs_sb_get_a_freeblock
+***************************************************************/
+
+static uint64_t group_free(uint64_t free, unsigned int goal) {
+    unsigned int i, g;
+
+    for (i = 0; i < ASSOOFS_GROUPS; i++) {
+        g = (goal + i) % ASSOOFS_GROUPS;
+        if (free & ASSOOFS_GROUP_MASK(g))
+            return free & ASSOOFS_GROUP_MASK(g);
+    }
+    return 0;
+}
+
+static uint64_t allocatable(const struct assoofs_image *img) {
+    return img->sb->free_blocks & ASSOOFS_BLOCKS_MASK(img->nblocks) & ~((1ULL << ASSOOFS_ROOTDIR_BLOCK_NUMBER) - 1);
+}
+
+int assoofs_image_get_freeblock(struct assoofs_image *img, unsigned int goal, uint64_t *block) {
+    uint64_t free = group_free(allocatable(img), goal);
+
+    if (!free) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    *block = __builtin_ctzll(free);
+    img->sb->free_blocks &= ~(1ULL << *block);
+    img->sb->free_blocks_count--;
+    return 0;
+}
+
+//Grupo de un directorio nuevo, como assoofs_dir_group: el de mas bloques libres, con empate el siguiente al del padre
+static unsigned int dir_group(const struct assoofs_image *img, unsigned int parent_group) {
+    uint64_t free = allocatable(img);
+    unsigned int i, g, best = parent_group;
+    int n, most = -1;
+
+    for (i = 1; i <= ASSOOFS_GROUPS; i++) {
+        g = (parent_group + i) % ASSOOFS_GROUPS;
+        n = __builtin_popcountll(free & ASSOOFS_GROUP_MASK(g));
+        if (n > most) {
+            most = n;
+            best = g;
+        }
+    }
+    return best;
+}
+
+//Un bloque compartido por un reflink solo pierde una referencia, como en assoofs_set_a_freeblock
+void assoofs_image_set_freeblock(struct assoofs_image *img, uint64_t block) {
+    if (img->sb->version >= ASSOOFS_VERSION_REFCOUNT && img->sb->block_refcount[block]) {
+        img->sb->block_refcount[block]--;
+        return;
+    }
+    if (!(img->sb->free_blocks & (1ULL << block)))
+        img->sb->free_blocks_count++;
+    img->sb->free_blocks |= 1ULL << block;
+}
+
+/**************************************************************
+* Actualizacion de una imagen antigua, igual que al montar con
+* el modulo. De la version 1 (assoofs_upgrade_v1): solo las
+* entradas vivas, cada una en la posicion inodo - 1, y mapa de
+* inodos libres. De la version 2: referencias de bloque a cero.
+* De la version 3: ninguna instantanea. De la version 4: tantos
+* bloques como quepan en la imagen, hasta 64. De la version 5
+* (assoofs_upgrade_v6): inodos de 56 bytes con los totales de
+* los directorios, en el almacen vivo y en el de cada instantanea.
+* De la version 6: ninguna caracteristica opcional
+***************************************************************/
+
+int assoofs_image_upgrade(struct assoofs_image *img) {
+    struct assoofs_inode_info_v5 old[ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(struct assoofs_inode_info_v5)], *table;
+    struct assoofs_inode_info *store;
+    uint64_t used = 0, count, slot, block, i;
+    int n;
+
+    if (img->sb->version >= ASSOOFS_VERSION)
+        return 0;
+    if (!(img->flags & ASSOOFS_IMAGE_RDWR)) {
+        errno = EROFS;
+        return -1;
+    }
+
+    if (img->sb->version >= ASSOOFS_VERSION_USAGE)
+        goto features;
+    if (img->sb->version >= ASSOOFS_VERSION_BLOCKS_COUNT)
+        goto usage;
+    if (img->sb->version >= ASSOOFS_VERSION_SNAPSHOT)
+        goto blocks_count;
+    if (img->sb->version >= ASSOOFS_VERSION_REFCOUNT)
+        goto snapshot;
+    if (img->sb->version >= ASSOOFS_VERSION_INODE_BITMAP)
+        goto refcount;
+
+    table = assoofs_image_block(img, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+    count = img->sb->inodes_count < sizeof(old) / sizeof(old[0]) ? img->sb->inodes_count : sizeof(old) / sizeof(old[0]);
+    memcpy(old, table, sizeof(old));
+    memset(table, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+
+    for (i = 0; i < count; i++) {
+        if (old[i].state_flag != ASSOOFS_STATE_ALIVE || old[i].inode_no < ASSOOFS_ROOTDIR_INODE_NUMBER)
+            continue;
+        slot = ASSOOFS_INODE_SLOT(old[i].inode_no);
+        if (slot >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)
+            continue;
+        table[slot] = old[i];
+        used |= 1ULL << slot;
+    }
+
+    img->sb->free_inodes = ~used;
+    img->sb->free_inodes_count = __builtin_popcountll(~used);
+    img->sb->inodes_count = used ? 64 - __builtin_clzll(used) : 0;
+    img->sb->real_inodes_count = __builtin_popcountll(used);
+
+refcount:
+    memset(img->sb->block_refcount, 0, sizeof(img->sb->block_refcount));
+
+snapshot:
+    memset(img->sb->snapshot_store, 0, sizeof(img->sb->snapshot_store));
+    memset(img->sb->snapshot_inodes_count, 0, sizeof(img->sb->snapshot_inodes_count));
+    memset(img->sb->snapshot_time, 0, sizeof(img->sb->snapshot_time));
+
+blocks_count:
+    img->sb->blocks_count = img->nblocks < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED ? img->nblocks : ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED;
+    img->sb->free_blocks &= ASSOOFS_BLOCKS_MASK(img->sb->blocks_count);
+    img->sb->free_blocks_count = __builtin_popcountll(img->sb->free_blocks);
+    img->sb->version = ASSOOFS_VERSION_BLOCKS_COUNT;
+
+usage:
+    //n = -1 es el almacen vivo; despues, el de cada instantanea
+    for (n = -1; n < ASSOOFS_MAX_SNAPSHOTS; n++) {
+        block = n < 0 ? ASSOOFS_INODESTORE_BLOCK_NUMBER : img->sb->snapshot_store[n];
+        count = n < 0 ? img->sb->inodes_count : img->sb->snapshot_inodes_count[n];
+        store = block ? assoofs_image_block(img, block) : NULL;
+        if (!store)
+            continue;
+        memcpy(old, store, sizeof(old));
+        convert_table(img, old, count, store);
+    }
+
+    free(img->legacy);
+    img->legacy = NULL;
+    img->sb->version = ASSOOFS_VERSION_USAGE;
+
+features:
+    img->sb->features = 0;
+    img->sb->version = ASSOOFS_VERSION;
+    return 0;
+}
+
+/**************************************************************
+* Creacion de un inodo: la posicion libre mas baja del tramo del
+* mapa de inodos de su grupo (i_ino = posicion + 1) y un bloque
+* libre independiente del mismo grupo, como assoofs_create y
+* assoofs_mkdir: un fichero va al grupo de su directorio padre y
+* un directorio al grupo con mas sitio. Sin padre, al grupo 0
+***************************************************************/
+
+struct assoofs_inode_info *assoofs_image_new_inode(struct assoofs_image *img, mode_t mode, const struct assoofs_inode_info *parent) {
+    struct assoofs_inode_info *table, *inode;
+    unsigned int group = parent ? ASSOOFS_GROUP_OF(parent->data_block_number) : 0;
+    uint64_t block, slot;
+
+    //El grupo se saca antes: actualizar una imagen antigua deja parent apuntando a la copia convertida, ya liberada
+    if (img->sb->version < ASSOOFS_VERSION && assoofs_image_upgrade(img))
+        return NULL;
+
+    if (!img->sb->free_inodes) {
+        errno = ENOSPC;
+        return NULL;
+    }
+
+    if (S_ISDIR(mode) && parent)
+        group = dir_group(img, group);
+    if (assoofs_image_get_freeblock(img, group, &block))
+        return NULL;
+
+    slot = __builtin_ctzll(group_free(img->sb->free_inodes, group));
+    img->sb->free_inodes &= ~(1ULL << slot);
+    img->sb->free_inodes_count--;
+    if (slot >= img->sb->inodes_count)
+        img->sb->inodes_count = slot + 1;
+
+    table = assoofs_image_inode_table(img, NULL);
+    inode = table + slot;
+    memset(inode, 0, sizeof(*inode));
+    inode->mode = mode;
+    inode->inode_no = ASSOOFS_SLOT_INODE(slot);
+    inode->data_block_number = block;
+    inode->state_flag = ASSOOFS_STATE_ALIVE;
+
+    //Un bloque reutilizado puede tener basura de un objeto anterior
+    memset(assoofs_image_block(img, block), 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+
+    img->sb->real_inodes_count++;
+    return inode;
+}
+
+//Deshace assoofs_image_new_inode: bloque y posicion del almacen vuelven a estar libres
+void assoofs_image_release_inode(struct assoofs_image *img, struct assoofs_inode_info *inode) {
+    uint64_t slot = ASSOOFS_INODE_SLOT(inode->inode_no);
+
+    inode->state_flag = ASSOOFS_STATE_REMOVED;
+    assoofs_image_set_freeblock(img, inode->data_block_number);
+    if (img->sb->version >= ASSOOFS_VERSION_INODE_BITMAP && slot < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED &&
+        !(img->sb->free_inodes & (1ULL << slot))) {
+        img->sb->free_inodes |= 1ULL << slot;
+        img->sb->free_inodes_count++;
+    }
+    img->sb->real_inodes_count--;
+}
+
+/**************************************************************
+* Reflink y copia en escritura, como assoofs_remap_file_range y
+* assoofs_unshare_block: un clon comparte el bloque del origen y
+* el primero que lo modifica se queda con una copia
+***************************************************************/
+
+int assoofs_image_clone(struct assoofs_image *img, const struct assoofs_inode_info *src, struct assoofs_inode_info *dst) {
+    uint64_t block = src->data_block_number, old_block = dst->data_block_number;
+    struct assoofs_inode_info *parent;
+
+    if (!S_ISREG(src->mode) || !S_ISREG(dst->mode)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (img->sb->version < ASSOOFS_VERSION && assoofs_image_upgrade(img))
+        return -1;
+    if (block == old_block)
+        return 0;
+    if (img->sb->block_refcount[block] == ASSOOFS_MAX_BLOCK_REFCOUNT) {
+        errno = EMLINK;
+        return -1;
+    }
+
+    parent = assoofs_image_parent(img, dst);
+    if (parent)
+        assoofs_image_usage_add(img, parent, (int64_t)src->file_size - (int64_t)dst->file_size, 0);
+
+    dst->data_block_number = block;
+    dst->file_size = src->file_size;
+    img->sb->block_refcount[block]++;
+    assoofs_image_set_freeblock(img, old_block);
+    return 0;
+}
+
+int assoofs_image_unshare(struct assoofs_image *img, struct assoofs_inode_info *inode) {
+    uint64_t old_block = inode->data_block_number, block;
+
+    if (img->sb->version < ASSOOFS_VERSION_REFCOUNT || !img->sb->block_refcount[old_block])
+        return 0;
+    if (assoofs_image_get_freeblock(img, ASSOOFS_GROUP_OF(old_block), &block))
+        return -1;
+
+    memcpy(assoofs_image_block(img, block), assoofs_image_block(img, old_block), ASSOOFS_DEFAULT_BLOCK_SIZE);
+    inode->data_block_number = block;
+    assoofs_image_set_freeblock(img, old_block);
+    return 0;
+}
+
+/**************************************************************
+* Entradas de directorio. El bloque de un directorio tambien
+* puede estar compartido con una instantanea, asi que se copia
+* antes de cambiarlo
+***************************************************************/
+
+//La nueva entrada va detras de las dir_children_count entradas vivas o, si el bloque ya no tiene sitio
+//al final, en la primera entrada borrada, como assoofs_add_record
+int assoofs_image_add_record(struct assoofs_image *img, struct assoofs_inode_info *dir, const char *name, uint64_t inode_no) {
+    struct assoofs_dir_record_entry *record, *end;
+    struct assoofs_inode_info *inode;
+    int64_t bytes, inodes;
+    uint64_t i;
+
+    if (strlen(name) >= ASSOOFS_FILENAME_MAXLEN) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (assoofs_image_unshare(img, dir))
+        return -1;
+
+    record = assoofs_image_block(img, dir->data_block_number);
+    if (!record)
+        return -1;
+    end = record + ASSOOFS_DIR_RECORDS_PER_BLOCK;
+
+    for (i = 0; i < dir->dir_children_count && record < end; record++)
+        if (record->state_flag == ASSOOFS_STATE_ALIVE)
+            i++;
+
+    if (record == end)
+        for (record = end - ASSOOFS_DIR_RECORDS_PER_BLOCK; record < end && record->state_flag == ASSOOFS_STATE_ALIVE; record++)
+            ;
+
+    if (record == end) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    memset(record, 0, sizeof(*record));
+    strcpy(record->filename, name);
+    record->inode_no = inode_no;
+    record->state_flag = ASSOOFS_STATE_ALIVE;
+    dir->dir_children_count++;
+
+    inode = assoofs_image_inode(img, inode_no);
+    if (inode) {
+        assoofs_usage_of(inode, &bytes, &inodes);
+        assoofs_image_usage_add(img, dir, bytes, inodes);
+    }
+    return 0;
+}
+
+struct assoofs_dir_record_entry *assoofs_image_find_record(const struct assoofs_image *img, const struct assoofs_inode_info *dir, const char *name) {
+    struct assoofs_dir_iter it;
+    struct assoofs_dir_record_entry *record;
+
+    if (assoofs_dir_iter_init(&it, img, dir))
+        return NULL;
+
+    while ((record = assoofs_dir_iter_next(&it)))
+        if (!strcmp(record->filename, name))
+            return record;
+
+    errno = ENOENT;
+    return NULL;
+}
+
+/**************************************************************
+* Borrado: inodo y entrada marcados como REMOVED, bloque
+* devuelto al mapa de bits y contadores decrementados, igual
+* que assoofs_remove
+***************************************************************/
+
+int assoofs_image_unlink(struct assoofs_image *img, struct assoofs_inode_info *dir, const char *name) {
+    struct assoofs_dir_record_entry *record;
+    struct assoofs_inode_info *inode;
+    int64_t bytes, inodes;
+
+    if (assoofs_image_unshare(img, dir))
+        return -1;
+
+    record = assoofs_image_find_record(img, dir, name);
+    if (!record)
+        return -1;
+
+    inode = assoofs_image_inode(img, record->inode_no);
+    if (inode) {
+        if (S_ISDIR(inode->mode) && inode->dir_children_count) {
+            errno = ENOTEMPTY;
+            return -1;
+        }
+        assoofs_usage_of(inode, &bytes, &inodes);
+        assoofs_image_usage_add(img, dir, -bytes, -inodes);
+        assoofs_image_release_inode(img, inode);
+    }
+
+    record->state_flag = ASSOOFS_STATE_REMOVED;
+    dir->dir_children_count--;
+    return 0;
+}
+
+/**************************************************************
+* Instantaneas: copia del almacen de inodos en un bloque libre y
+* una referencia mas en el bloque de cada inodo vivo, como
+* assoofs_snapshot_create y assoofs_snapshot_delete
+***************************************************************/
+
+int assoofs_image_use_snapshot(struct assoofs_image *img, int id) {
+    if (img->flags & ASSOOFS_IMAGE_RDWR) {
+        errno = EROFS;
+        return -1;
+    }
+    if (id && (img->sb->version < ASSOOFS_VERSION_SNAPSHOT || id < 0 || id > ASSOOFS_MAX_SNAPSHOTS ||
+               !img->sb->snapshot_store[id - 1] || !assoofs_image_block(img, img->sb->snapshot_store[id - 1]))) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (img->sb->version < ASSOOFS_VERSION_USAGE &&
+        legacy_view(img, id ? img->sb->snapshot_store[id - 1] : ASSOOFS_INODESTORE_BLOCK_NUMBER,
+                    id ? img->sb->snapshot_inodes_count[id - 1] : img->sb->inodes_count))
+        return -1;
+    img->snapshot = id;
+    return 0;
+}
+
+int assoofs_image_snapshot_create(struct assoofs_image *img, uint32_t *id) {
+    unsigned int refs[ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED] = { 0 };
+    struct assoofs_inode_info *table;
+    uint64_t block, count, i;
+    int slot;
+
+    if (img->snapshot || !(img->flags & ASSOOFS_IMAGE_RDWR)) {
+        errno = EROFS;
+        return -1;
+    }
+    if (img->sb->version < ASSOOFS_VERSION && assoofs_image_upgrade(img))
+        return -1;
+
+    for (slot = 0; slot < ASSOOFS_MAX_SNAPSHOTS && img->sb->snapshot_store[slot]; slot++)
+        ;
+    if (slot == ASSOOFS_MAX_SNAPSHOTS) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    table = assoofs_image_inode_table(img, &count);
+    for (i = 0; i < count; i++) {
+        if (table[i].state_flag != ASSOOFS_STATE_ALIVE || table[i].data_block_number >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)
+            continue;
+        if (img->sb->block_refcount[table[i].data_block_number] + ++refs[table[i].data_block_number] > ASSOOFS_MAX_BLOCK_REFCOUNT) {
+            errno = EMLINK;
+            return -1;
+        }
+    }
+
+    if (assoofs_image_get_freeblock(img, 0, &block))
+        return -1;
+
+    memcpy(assoofs_image_block(img, block), table, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    for (i = 0; i < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++)
+        img->sb->block_refcount[i] += refs[i];
+
+    img->sb->snapshot_store[slot] = block;
+    img->sb->snapshot_inodes_count[slot] = count;
+    img->sb->snapshot_time[slot] = time(NULL);
+    *id = slot + 1;
+    return 0;
+}
+
+int assoofs_image_snapshot_delete(struct assoofs_image *img, uint32_t id) {
+    struct assoofs_inode_info *table;
+    uint64_t block, i;
+
+    if (img->snapshot || !(img->flags & ASSOOFS_IMAGE_RDWR)) {
+        errno = EROFS;
+        return -1;
+    }
+    if (img->sb->version < ASSOOFS_VERSION_SNAPSHOT || id < 1 || id > ASSOOFS_MAX_SNAPSHOTS || !img->sb->snapshot_store[id - 1]) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (img->sb->version < ASSOOFS_VERSION && assoofs_image_upgrade(img))
+        return -1;
+
+    block = img->sb->snapshot_store[id - 1];
+    table = assoofs_image_block(img, block);
+    for (i = 0; table && i < img->sb->snapshot_inodes_count[id - 1] && i < ASSOOFS_INODES_PER_BLOCK; i++)
+        if (table[i].state_flag == ASSOOFS_STATE_ALIVE && table[i].data_block_number < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)
+            assoofs_image_set_freeblock(img, table[i].data_block_number);
+
+    img->sb->snapshot_store[id - 1] = 0;
+    img->sb->snapshot_inodes_count[id - 1] = 0;
+    img->sb->snapshot_time[id - 1] = 0;
+    if (block < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)
+        assoofs_image_set_freeblock(img, block);
+    return 0;
+}
+
+/**************************************************************
+* Crecimiento offline, como assoofs_resize: los bloques entre
+* blocks_count y el nuevo tamano quedan libres. blocks = 0 crece
+* hasta donde llegue la imagen
+***************************************************************/
+
+int assoofs_image_resize(struct assoofs_image *img, uint64_t *blocks) {
+    uint64_t added;
+
+    if (img->snapshot || !(img->flags & ASSOOFS_IMAGE_RDWR)) {
+        errno = EROFS;
+        return -1;
+    }
+    if (img->sb->version < ASSOOFS_VERSION && assoofs_image_upgrade(img))
+        return -1;
+
+    if (!*blocks)
+        *blocks = img->nblocks < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED ? img->nblocks : ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED;
+    if (*blocks > ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (*blocks > img->nblocks || *blocks < img->sb->blocks_count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    added = ASSOOFS_BLOCKS_MASK(*blocks) & ~ASSOOFS_BLOCKS_MASK(img->sb->blocks_count);
+    img->sb->free_blocks |= added;
+    img->sb->free_blocks_count += __builtin_popcountll(added);
+    img->sb->blocks_count = *blocks;
+    return 0;
+}
+
+/**************************************************************
+* Totales recursivos de los directorios. No hay punteros al
+* padre, asi que se busca la entrada que apunta a cada inodo:
+* como mucho 64 directorios de un bloque cada uno
+***************************************************************/
+
+//Lo que aporta un objeto a sus antepasados: el mismo y, si es un directorio, todo lo que tiene debajo
+void assoofs_usage_of(const struct assoofs_inode_info *inode, int64_t *bytes, int64_t *inodes) {
+    if (S_ISDIR(inode->mode)) {
+        *bytes = inode->usage_bytes;
+        *inodes = inode->usage_inodes + 1;
+    } else {
+        *bytes = inode->file_size;
+        *inodes = 1;
+    }
+}
+
+struct assoofs_inode_info *assoofs_image_parent(const struct assoofs_image *img, const struct assoofs_inode_info *inode) {
+    struct assoofs_inode_info *table;
+    struct assoofs_dir_record_entry *record;
+    struct assoofs_dir_iter it;
+    uint64_t count, i;
+
+    table = assoofs_image_inode_table(img, &count);
+    for (i = 0; inode->inode_no != ASSOOFS_ROOTDIR_INODE_NUMBER && i < count; i++) {
+        if (table[i].state_flag != ASSOOFS_STATE_ALIVE || table[i].inode_no == inode->inode_no ||
+            assoofs_dir_iter_init(&it, img, &table[i]))
+            continue;
+        while ((record = assoofs_dir_iter_next(&it)))
+            if (record->inode_no == inode->inode_no)
+                return &table[i];
+    }
+
+    errno = ENOENT;
+    return NULL;
+}
+
+//El directorio dir y todos sus antepasados, hasta el raiz
+void assoofs_image_usage_add(struct assoofs_image *img, struct assoofs_inode_info *dir, int64_t bytes, int64_t inodes) {
+    int depth;
+
+    if (img->sb->version < ASSOOFS_VERSION_USAGE)
+        return;
+
+    for (depth = 0; dir && depth < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; depth++) {
+        dir->usage_bytes += bytes;
+        dir->usage_inodes += inodes;
+        dir = assoofs_image_parent(img, dir);
+    }
+}
+
+void assoofs_image_usage_scan(const struct assoofs_image *img, struct assoofs_usage *usage) {
+    struct assoofs_inode_info *table;
+    uint64_t count;
+
+    table = assoofs_image_inode_table(img, &count);
+    scan_usage(img, table, count, usage);
+}
@@ -0,0 +1,120 @@
+#ifndef LIBASSOOFS_H
+#define LIBASSOOFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "assoofs.h"
+
+/**************************************************************
+* libassoofs: acceso desde espacio de usuario a una imagen
+* assoofs. La imagen se proyecta entera con mmap y todos los
+* accesores devuelven punteros dentro de la proyeccion, sin
+* copias ni llamadas al sistema por bloque.
+*
+* Las funciones devuelven 0 (o un puntero) si todo va bien y
+* -1 (o NULL) con errno configurado si algo falla.
+***************************************************************/
+
+#define ASSOOFS_IMAGE_RDONLY 0
+#define ASSOOFS_IMAGE_RDWR   1
+
+//Numero de entradas de directorio que caben en un bloque
+#define ASSOOFS_DIR_RECORDS_PER_BLOCK (ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(struct assoofs_dir_record_entry))
+
+//Numero de inodos que caben en el almacen de inodos
+#define ASSOOFS_INODES_PER_BLOCK (ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(struct assoofs_inode_info))
+
+struct assoofs_image {
+    int fd;
+    int flags;
+    unsigned char *map;                         //Proyeccion de la imagen completa
+    size_t size;                                //Tamano de la proyeccion en bytes
+    uint64_t nblocks;                           //Bloques completos disponibles
+    struct assoofs_super_block_info *sb;        //Apunta al bloque 0 de la proyeccion
+    int snapshot;                               //Instantanea que se lee (0 = sistema vivo)
+    struct assoofs_inode_info *legacy;          //Imagenes anteriores a la version 6: copia del almacen con el formato nuevo
+    uint64_t legacy_count;
+};
+
+//Recorrido de las entradas vivas de un directorio
+struct assoofs_dir_iter {
+    struct assoofs_dir_record_entry *record;
+    struct assoofs_dir_record_entry *end;
+    uint64_t remaining;                         //Hijos vivos que quedan por devolver
+};
+
+//Tramo contiguo de datos de un fichero
+struct assoofs_extent {
+    uint64_t block;                             //Primer bloque fisico
+    uint64_t length;                            //Bytes validos en el tramo
+    const void *data;                           //Datos dentro de la proyeccion
+};
+
+int assoofs_image_open(struct assoofs_image *img, const char *path, int flags);
+void assoofs_image_close(struct assoofs_image *img);
+int assoofs_image_sync(struct assoofs_image *img);
+
+void *assoofs_image_block(const struct assoofs_image *img, uint64_t block);
+struct assoofs_inode_info *assoofs_image_inode_table(const struct assoofs_image *img, uint64_t *count);
+struct assoofs_inode_info *assoofs_image_inode(const struct assoofs_image *img, uint64_t inode_no);
+
+int assoofs_dir_iter_init(struct assoofs_dir_iter *it, const struct assoofs_image *img, const struct assoofs_inode_info *dir);
+struct assoofs_dir_record_entry *assoofs_dir_iter_next(struct assoofs_dir_iter *it);
+struct assoofs_inode_info *assoofs_image_lookup(const struct assoofs_image *img, const struct assoofs_inode_info *dir, const char *name);
+
+int assoofs_file_extents(const struct assoofs_image *img, const struct assoofs_inode_info *inode, struct assoofs_extent *ext, int max);
+
+/**************************************************************
+* Operaciones de escritura, con los mismos algoritmos que el
+* modulo (assoofs_sb_get_a_freeblock, assoofs_sb_get_a_freeinode,
+* assoofs_create, assoofs_remove). Requieren ASSOOFS_IMAGE_RDWR.
+* Crear un inodo en una imagen antigua la actualiza antes; hasta
+* entonces una imagen anterior a la version 6 se lee a traves de
+* una copia de su almacen convertida en memoria.
+* Un bloque con block_refcount > 0 esta compartido por varios
+* ficheros: hay que llamar a assoofs_image_unshare antes de
+* modificar sus datos
+***************************************************************/
+
+int assoofs_image_get_freeblock(struct assoofs_image *img, unsigned int goal, uint64_t *block);
+void assoofs_image_set_freeblock(struct assoofs_image *img, uint64_t block);
+int assoofs_image_upgrade(struct assoofs_image *img);
+struct assoofs_inode_info *assoofs_image_new_inode(struct assoofs_image *img, mode_t mode, const struct assoofs_inode_info *parent);
+void assoofs_image_release_inode(struct assoofs_image *img, struct assoofs_inode_info *inode);
+int assoofs_image_clone(struct assoofs_image *img, const struct assoofs_inode_info *src, struct assoofs_inode_info *dst);
+int assoofs_image_unshare(struct assoofs_image *img, struct assoofs_inode_info *inode);
+int assoofs_image_add_record(struct assoofs_image *img, struct assoofs_inode_info *dir, const char *name, uint64_t inode_no);
+struct assoofs_dir_record_entry *assoofs_image_find_record(const struct assoofs_image *img, const struct assoofs_inode_info *dir, const char *name);
+int assoofs_image_unlink(struct assoofs_image *img, struct assoofs_inode_info *dir, const char *name);
+
+/**************************************************************
+* Instantaneas (version 4), como el ioctl del modulo. Con
+* assoofs_image_use_snapshot los accesores leen la copia del
+* almacen de la instantanea en lugar del vivo; solo se permite
+* en imagenes abiertas con ASSOOFS_IMAGE_RDONLY
+***************************************************************/
+
+int assoofs_image_use_snapshot(struct assoofs_image *img, int id);
+int assoofs_image_snapshot_create(struct assoofs_image *img, uint32_t *id);
+int assoofs_image_snapshot_delete(struct assoofs_image *img, uint32_t id);
+
+//Crecimiento hasta blocks bloques (0 = toda la imagen), como ASSOOFS_IOC_RESIZE
+int assoofs_image_resize(struct assoofs_image *img, uint64_t *blocks);
+
+/**************************************************************
+* Totales recursivos de los directorios (version 6), como
+* assoofs_usage_update: add_record, unlink y clone los mantienen
+* solos; quien cambie file_size o quite una entrada a mano tiene
+* que llamar a assoofs_image_usage_add con el directorio que la
+* contiene. assoofs_image_usage_scan los calcula desde cero
+* recorriendo el arbol, indexados por posicion del almacen
+***************************************************************/
+
+void assoofs_usage_of(const struct assoofs_inode_info *inode, int64_t *bytes, int64_t *inodes);
+struct assoofs_inode_info *assoofs_image_parent(const struct assoofs_image *img, const struct assoofs_inode_info *inode);
+void assoofs_image_usage_add(struct assoofs_image *img, struct assoofs_inode_info *dir, int64_t bytes, int64_t inodes);
+void assoofs_image_usage_scan(const struct assoofs_image *img, struct assoofs_usage *usage);
+
+#endif
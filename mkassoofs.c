@@ -6,6 +6,10 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include "assoofs.h"
 
 #define WELCOMEFILE_DATABLOCK_NUMBER (ASSOOFS_LAST_RESERVED_BLOCK + 1)
@@ -17,13 +21,18 @@
 * a estar nuestro sistema de archivos
 ***************************************************************/
 
-static int write_superblock(int fd) {
+static int write_superblock(int fd, uint64_t blocks) {
     struct assoofs_super_block_info sb = {
-        .version = 1,                               //Versión
+        .version = ASSOOFS_VERSION,                 //Versión
         .magic = ASSOOFS_MAGIC,                     //Número mágico
         .block_size = ASSOOFS_DEFAULT_BLOCK_SIZE,   //Tamaño de bloque
         .inodes_count = WELCOMEFILE_INODE_NUMBER,   //Ya sé que parto de 2 inodos (root y welcome)
-        .free_blocks = (~0) & ~(15),                //Inicialización del mapa de bits (vídeo)
+        .real_inodes_count = WELCOMEFILE_INODE_NUMBER,  //Los dos estan vivos
+        .free_blocks = ASSOOFS_BLOCKS_MASK(blocks) & ~(15),     //Inicialización del mapa de bits (vídeo), solo hasta el final del dispositivo
+        .free_blocks_count = blocks - 4,                                                           //Los bloques 0..3 estan ocupados
+        .blocks_count = blocks,
+        .free_inodes_count = ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED - WELCOMEFILE_INODE_NUMBER,
+        .free_inodes = ~0ULL << WELCOMEFILE_INODE_NUMBER,   //Posiciones 0 (root) y 1 (welcome) ocupadas
     };
     ssize_t ret;
 
@@ -46,16 +55,20 @@ static int write_superblock(int fd) {
 * Escribimos el inodo raíz (root)
 ***************************************************************/
 
-static int write_root_inode(int fd) {
+static int write_root_inode(int fd, const struct assoofs_inode_info *welcome) {
     ssize_t ret;
 
     struct assoofs_inode_info root_inode;
 
+    memset(&root_inode, 0, sizeof(root_inode));
+
     root_inode.mode = S_IFDIR;                                      //Modo: directorio
     root_inode.inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER;             //Número de inodo
     root_inode.data_block_number = ASSOOFS_ROOTDIR_BLOCK_NUMBER;    //Número de bloque
     root_inode.state_flag = ASSOOFS_STATE_ALIVE;                //necesario para el remove
     root_inode.dir_children_count = 1;                              //Número de archivos que vamos a meter dentro
+    root_inode.usage_bytes = welcome->file_size;                    //Totales recursivos: solo el fichero de bienvenida
+    root_inode.usage_inodes = 1;
 
     /**************************************************************
     * Escribir el inodo raíz en memoria
@@ -157,6 +170,508 @@ int write_block(int fd, char *block, size_t len) {
     return 0;
 }
 
+/**************************************************************
+* MODO -d: CONSTRUIR LA IMAGEN A PARTIR DE UN DIRECTORIO
+*
+* Recorremos el directorio del anfitrion en anchura (BFS) y
+* numeramos los objetos en ese orden: el objeto n-esimo recibe
+* el inodo n y el bloque n + 1 (igual que hace el modulo con
+* i_ino = block_number - 1). Asi los hijos de un directorio
+* quedan consecutivos y la imagen se escribe de un tiron, bloque
+* a bloque, sin lseek hacia atras.
+***************************************************************/
+
+#define ASSOOFS_DIR_MAX_RECORDS (ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(struct assoofs_dir_record_entry))
+
+struct tree_node {
+    char name[ASSOOFS_FILENAME_MAXLEN];     //Nombre dentro del directorio padre
+    char *host_path;                        //Ruta en el anfitrion
+    mode_t mode;
+    mode_t perm;                            //Permisos del anfitrion, solo para las imagenes empaquetadas
+    uint64_t size;                          //Bytes del fichero o numero de hijos
+    int first_child;                        //Indice del primer hijo en la tabla
+    int nchildren;
+    int parent;                             //Indice del padre (el raiz es su propio padre)
+    uint64_t usage_bytes;                   //Totales recursivos de los directorios, version 6
+    uint64_t usage_inodes;
+};
+
+static struct tree_node *tree;
+static int tree_count;
+static int tree_max = ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED - ASSOOFS_ROOTDIR_BLOCK_NUMBER;     //El bloque del objeto es su indice + 2
+static int dir_max = ASSOOFS_DIR_MAX_RECORDS;                                                     //Entradas que caben en el bloque del directorio
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/**************************************************************
+* Leer los hijos de un directorio y anadirlos al final de la
+* tabla. Los ordenamos por nombre para que la imagen sea
+* reproducible.
+***************************************************************/
+
+static int scan_directory(int parent) {
+    DIR *dir;
+    struct dirent *de;
+    struct stat st;
+    char *names[ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED], *path;
+    int count = 0, i;
+
+    dir = opendir(tree[parent].host_path);
+    if (!dir) {
+        perror(tree[parent].host_path);
+        return -1;
+    }
+
+    while ((de = readdir(dir))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (count == dir_max) {
+            printf("Directory %s has more than %d entries.\n", tree[parent].host_path, dir_max);
+            closedir(dir);
+            while (count--)
+                free(names[count]);
+            return -1;
+        }
+        names[count++] = strdup(de->d_name);
+    }
+    closedir(dir);
+
+    qsort(names, count, sizeof(names[0]), compare_names);
+
+    tree[parent].first_child = tree_count;
+    tree[parent].nchildren = 0;
+
+    for (i = 0; i < count; i++) {
+        struct tree_node *node;
+        size_t len = strlen(tree[parent].host_path) + strlen(names[i]) + 2;
+
+        path = malloc(len);
+
+        snprintf(path, len, "%s/%s", tree[parent].host_path, names[i]);
+        if (lstat(path, &st)) {
+            perror(path);
+            free(path);
+            free(names[i]);
+            continue;
+        }
+
+        if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+            printf("Skipping %s: only regular files and directories are supported.\n", path);
+            free(path);
+            free(names[i]);
+            continue;
+        }
+
+        if (strlen(names[i]) >= ASSOOFS_FILENAME_MAXLEN) {
+            printf("File name %s is too long.\n", path);
+            goto err;
+        }
+
+        if (S_ISREG(st.st_mode) && st.st_size > ASSOOFS_DEFAULT_BLOCK_SIZE) {
+            printf("File %s does not fit in one block (%lld bytes).\n", path, (long long)st.st_size);
+            goto err;
+        }
+
+        if (tree_count >= tree_max) {
+            printf("Too many objects: the image can hold at most %d.\n", tree_max);
+            goto err;
+        }
+
+        node = &tree[tree_count++];
+        strcpy(node->name, names[i]);
+        node->host_path = path;
+        node->mode = S_ISDIR(st.st_mode) ? S_IFDIR : S_IFREG;
+        node->perm = st.st_mode & 07777;
+        node->size = S_ISREG(st.st_mode) ? st.st_size : 0;
+        node->parent = parent;
+        tree[parent].nchildren++;
+        free(names[i]);
+    }
+
+    tree[parent].size = tree[parent].nchildren;
+    return 0;
+
+err:
+    //La ruta y los nombres que aun no han pasado a la tabla
+    free(path);
+    while (i < count)
+        free(names[i++]);
+    return -1;
+}
+
+/**************************************************************
+* Escribir el contenido de un objeto en su bloque: entradas de
+* directorio empaquetadas o los datos del fichero
+***************************************************************/
+
+static int write_node_block(int fd, int index) {
+    char block[ASSOOFS_DEFAULT_BLOCK_SIZE];
+    struct tree_node *node = &tree[index];
+    int i, hfd;
+    ssize_t ret;
+
+    memset(block, 0, sizeof(block));
+
+    if (S_ISDIR(node->mode)) {
+        struct assoofs_dir_record_entry *record = (struct assoofs_dir_record_entry *)block;
+
+        for (i = 0; i < node->nchildren; i++, record++) {
+            strcpy(record->filename, tree[node->first_child + i].name);
+            record->inode_no = node->first_child + i + ASSOOFS_ROOTDIR_INODE_NUMBER;
+            record->state_flag = ASSOOFS_STATE_ALIVE;
+        }
+    } else {
+        hfd = open(node->host_path, O_RDONLY);
+        if (hfd == -1) {
+            perror(node->host_path);
+            return -1;
+        }
+        ret = read(hfd, block, node->size);
+        close(hfd);
+        if (ret != node->size) {
+            printf("Reading %s has failed.\n", node->host_path);
+            return -1;
+        }
+    }
+
+    return write_block(fd, block, sizeof(block));
+}
+
+/**************************************************************
+* Recorrer el arbol del anfitrion en anchura y calcular los
+* totales recursivos de cada directorio
+***************************************************************/
+
+static int build_tree(const char *root_path) {
+    struct stat st;
+    int i;
+
+    if (stat(root_path, &st)) {
+        perror(root_path);
+        return -1;
+    }
+
+    tree = calloc(ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED, sizeof(*tree));
+    tree[0].host_path = strdup(root_path);
+    tree[0].mode = S_IFDIR;
+    tree[0].perm = st.st_mode & 07777;
+    tree_count = 1;
+    for (i = 0; i < tree_count; i++)
+        if (S_ISDIR(tree[i].mode) && scan_directory(i))
+            return -1;
+
+    //La tabla esta en anchura: de atras hacia delante cada objeto ya tiene sus totales al sumarlos al padre
+    for (i = tree_count - 1; i > 0; i--) {
+        tree[tree[i].parent].usage_bytes += S_ISREG(tree[i].mode) ? tree[i].size : tree[i].usage_bytes;
+        tree[tree[i].parent].usage_inodes += 1 + (S_ISDIR(tree[i].mode) ? tree[i].usage_inodes : 0);
+    }
+    return 0;
+}
+
+static int write_tree_image(int fd, const char *root_path, uint64_t blocks) {
+    struct assoofs_super_block_info sb = {
+        .version = ASSOOFS_VERSION,
+        .magic = ASSOOFS_MAGIC,
+        .block_size = ASSOOFS_DEFAULT_BLOCK_SIZE,
+        .blocks_count = blocks,
+    };
+    struct assoofs_inode_info *inode;
+    char block[ASSOOFS_DEFAULT_BLOCK_SIZE];
+    uint64_t last_block;
+    int i;
+
+    //1.- Recorrer el arbol del anfitrion en anchura
+    if (build_tree(root_path))
+        return -1;
+
+    //2.- Superbloque: los bloques 0..last_block quedan ocupados
+    last_block = tree_count - 1 + ASSOOFS_ROOTDIR_BLOCK_NUMBER;
+    if (last_block >= blocks) {
+        printf("The image needs %llu blocks but the device only has %llu.\n", (unsigned long long)last_block + 1, (unsigned long long)blocks);
+        return -1;
+    }
+    sb.inodes_count = tree_count;
+    sb.real_inodes_count = tree_count;
+    sb.free_blocks = (last_block + 1 < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED ? ~0ULL << (last_block + 1) : 0) & ASSOOFS_BLOCKS_MASK(blocks);
+    sb.free_blocks_count = blocks - (last_block + 1);
+    sb.free_inodes_count = ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED - tree_count;
+    sb.free_inodes = tree_count < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED ? ~0ULL << tree_count : 0;     //El inodo i+1 ocupa la posicion i
+    if (write_block(fd, (char *)&sb, sizeof(sb)))
+        return -1;
+
+    //3.- Almacen de inodos, en el mismo orden que los bloques
+    memset(block, 0, sizeof(block));
+    inode = (struct assoofs_inode_info *)block;
+    for (i = 0; i < tree_count; i++, inode++) {
+        inode->mode = tree[i].mode;
+        inode->inode_no = i + ASSOOFS_ROOTDIR_INODE_NUMBER;
+        inode->data_block_number = i + ASSOOFS_ROOTDIR_BLOCK_NUMBER;
+        inode->file_size = tree[i].size;
+        inode->state_flag = ASSOOFS_STATE_ALIVE;
+        inode->usage_bytes = tree[i].usage_bytes;
+        inode->usage_inodes = tree[i].usage_inodes;
+    }
+    if (write_block(fd, block, sizeof(block)))
+        return -1;
+
+    //4.- Bloques de datos, secuenciales a partir del bloque del raiz
+    for (i = 0; i < tree_count; i++)
+        if (write_node_block(fd, i))
+            return -1;
+
+    printf("Image populated with %d objects from %s.\n", tree_count, root_path);
+    return 0;
+}
+
+/**************************************************************
+* MODO -p: IMAGEN EMPAQUETADA DE SOLO LECTURA
+*
+* Despues del superbloque va la tabla de inodos (struct
+* assoofs_packed_inode) y a continuacion las entradas de cada
+* directorio, de tamano variable, en anchura. Los ficheros de
+* hasta 16 bytes van dentro de su inodo; el resto se colocan en
+* orden de acceso (primero los de la lista de -a, despues los
+* demas en anchura), cada uno en el primero de los ultimos
+* bloques abiertos donde quepa entero o en un bloque nuevo. Asi
+* los ficheros pequenos comparten bloque y los que se leen
+* juntos quedan juntos, sin que ninguno cruce de bloque.
+***************************************************************/
+
+#define PACKED_OPEN_BLOCKS 4        //Bloques abiertos en los que se buscan huecos
+#define PACKED_MAX_SIZE (ASSOOFS_PACKED_INODES_OFFSET + \
+                         ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED * (sizeof(struct assoofs_packed_inode) + sizeof(struct assoofs_packed_dirent) + ASSOOFS_FILENAME_MAXLEN) + \
+                         (ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED + 1) * ASSOOFS_DEFAULT_BLOCK_SIZE)
+
+//Objeto de la tabla con esa ruta (relativa al raiz), o -1
+static int find_node(char *path) {
+    char *name, *save;
+    int node = 0, i;
+
+    for (name = strtok_r(path, "/", &save); name; name = strtok_r(NULL, "/", &save)) {
+        if (!strcmp(name, "."))
+            continue;
+        if (!S_ISDIR(tree[node].mode))
+            return -1;
+        for (i = 0; i < tree[node].nchildren && strcmp(tree[tree[node].first_child + i].name, name); i++)
+            ;
+        if (i == tree[node].nchildren)
+            return -1;
+        node = tree[node].first_child + i;
+    }
+    return node;
+}
+
+//Orden de colocacion de los ficheros: los de la lista, despues el resto en anchura
+static int packed_order(const char *order_path, int *order) {
+    char line[4096], *path;
+    char placed[ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED] = {0};
+    FILE *list;
+    int count = 0, i;
+
+    if (order_path) {
+        list = fopen(order_path, "r");
+        if (!list) {
+            perror(order_path);
+            return -1;
+        }
+        while (fgets(line, sizeof(line), list)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            for (path = line; *path == '/'; path++)
+                ;
+            if (!*path)
+                continue;
+            i = find_node(path);
+            if (i < 0 || !S_ISREG(tree[i].mode)) {
+                printf("Skipping %s: not a regular file in the tree.\n", line);
+                continue;
+            }
+            if (!placed[i]) {
+                placed[i] = 1;
+                order[count++] = i;
+            }
+        }
+        fclose(list);
+    }
+
+    for (i = 0; i < tree_count; i++)
+        if (S_ISREG(tree[i].mode) && !placed[i])
+            order[count++] = i;
+    return count;
+}
+
+static int read_host_file(int index, char *buf) {
+    ssize_t ret;
+    int hfd;
+
+    hfd = open(tree[index].host_path, O_RDONLY);
+    if (hfd == -1) {
+        perror(tree[index].host_path);
+        return -1;
+    }
+    ret = read(hfd, buf, tree[index].size);
+    close(hfd);
+    if (ret != tree[index].size) {
+        printf("Reading %s has failed.\n", tree[index].host_path);
+        return -1;
+    }
+    return 0;
+}
+
+static int write_packed_image(int fd, const char *root_path, const char *order_path) {
+    struct assoofs_super_block_info *sb;
+    struct assoofs_packed_inode *inode;
+    struct assoofs_packed_dirent *de;
+    uint64_t open_blocks[PACKED_OPEN_BLOCKS], used[PACKED_OPEN_BLOCKS];
+    uint64_t pos, blocks, size, dev_size;
+    int order[ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED];
+    int nopen = 0, ninline = 0, nfiles, i, j;
+    struct stat st;
+    char *image;
+
+    //1.- Recorrer el arbol del anfitrion en anchura (sin bloques por objeto caben los 64 inodos)
+    tree_max = ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED;
+    dir_max = ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED - 1;
+    if (build_tree(root_path))
+        return -1;
+
+    image = calloc(1, PACKED_MAX_SIZE);
+    if (!image) {
+        perror("calloc");
+        return -1;
+    }
+    inode = (struct assoofs_packed_inode *)(image + ASSOOFS_PACKED_INODES_OFFSET);
+
+    //2.- Tabla de inodos y entradas de los directorios, seguidas
+    pos = ASSOOFS_PACKED_INODES_OFFSET + tree_count * sizeof(*inode);
+    for (i = 0; i < tree_count; i++) {
+        inode[i].mode = tree[i].mode | tree[i].perm;
+        inode[i].usage_bytes = tree[i].usage_bytes;
+        inode[i].usage_inodes = tree[i].usage_inodes;
+        if (!S_ISDIR(tree[i].mode))
+            continue;
+        inode[i].offset = pos;
+        for (j = 0; j < tree[i].nchildren; j++) {
+            de = (struct assoofs_packed_dirent *)(image + pos);
+            de->inode_no = tree[i].first_child + j + ASSOOFS_ROOTDIR_INODE_NUMBER;
+            de->name_len = strlen(tree[tree[i].first_child + j].name);
+            memcpy(de->name, tree[tree[i].first_child + j].name, de->name_len);
+            pos += sizeof(*de) + de->name_len;
+        }
+        inode[i].size = pos - inode[i].offset;
+    }
+
+    //El hueco que quede en el ultimo bloque de metadatos es el primer bloque abierto
+    blocks = (pos + ASSOOFS_DEFAULT_BLOCK_SIZE - 1) / ASSOOFS_DEFAULT_BLOCK_SIZE;
+    if (pos % ASSOOFS_DEFAULT_BLOCK_SIZE) {
+        open_blocks[0] = blocks - 1;
+        used[0] = pos % ASSOOFS_DEFAULT_BLOCK_SIZE;
+        nopen = 1;
+    }
+
+    //3.- Datos de los ficheros, en orden de acceso
+    nfiles = packed_order(order_path, order);
+    if (nfiles < 0) {
+        free(image);
+        return -1;
+    }
+    for (i = 0; i < nfiles; i++) {
+        struct assoofs_packed_inode *pi = &inode[order[i]];
+
+        size = tree[order[i]].size;
+        pi->size = size;
+        if (size <= ASSOOFS_PACKED_INLINE) {
+            if (read_host_file(order[i], pi->data))
+                goto err;
+            ninline++;
+            continue;
+        }
+
+        //El bloque abierto mas reciente donde quepa entero
+        for (j = nopen - 1; j >= 0 && ASSOOFS_DEFAULT_BLOCK_SIZE - used[j] < size; j--)
+            ;
+        if (j < 0) {
+            if (nopen == PACKED_OPEN_BLOCKS) {
+                memmove(open_blocks, open_blocks + 1, sizeof(open_blocks[0]) * (PACKED_OPEN_BLOCKS - 1));
+                memmove(used, used + 1, sizeof(used[0]) * (PACKED_OPEN_BLOCKS - 1));
+                nopen--;
+            }
+            j = nopen++;
+            open_blocks[j] = blocks++;
+            used[j] = 0;
+        }
+
+        pi->offset = open_blocks[j] * ASSOOFS_DEFAULT_BLOCK_SIZE + used[j];
+        used[j] += size;
+        if (read_host_file(order[i], image + pi->offset))
+            goto err;
+    }
+
+    //4.- Superbloque
+    sb = (struct assoofs_super_block_info *)image;
+    sb->version = ASSOOFS_VERSION;
+    sb->magic = ASSOOFS_MAGIC;
+    sb->block_size = ASSOOFS_DEFAULT_BLOCK_SIZE;
+    sb->inodes_count = tree_count;
+    sb->real_inodes_count = tree_count;
+    sb->blocks_count = blocks;
+    sb->features = ASSOOFS_FEATURE_PACKED;
+
+    //5.- La imagen entera de una vez; un fichero se deja con el tamano justo
+    size = blocks * ASSOOFS_DEFAULT_BLOCK_SIZE;
+    if (fstat(fd, &st))
+        goto err;
+    if (S_ISBLK(st.st_mode)) {
+        if (ioctl(fd, BLKGETSIZE64, &dev_size) || dev_size < size) {
+            printf("The image needs %llu blocks but the device is smaller.\n", (unsigned long long)blocks);
+            goto err;
+        }
+    } else if (ftruncate(fd, size)) {
+        perror("ftruncate");
+        goto err;
+    }
+    if (write_block(fd, image, size))
+        goto err;
+
+    printf("Packed image with %d objects from %s: %llu blocks, %d files inline.\n",
+           tree_count, root_path, (unsigned long long)blocks, ninline);
+    free(image);
+    return 0;
+
+err:
+    free(image);
+    return -1;
+}
+
+/**************************************************************
+* Numero de bloques del sistema: los que quepan en el
+* dispositivo, hasta 64. Un fichero vacio se hace crecer (sin
+* ocupar disco) a los 64 bloques de siempre
+***************************************************************/
+
+static uint64_t device_blocks(int fd) {
+    struct stat st;
+    uint64_t size;
+
+    if (fstat(fd, &st))
+        return 0;
+
+    if (S_ISBLK(st.st_mode)) {
+        if (ioctl(fd, BLKGETSIZE64, &size))
+            return 0;
+    } else if (!st.st_size) {
+        size = (uint64_t)ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED * ASSOOFS_DEFAULT_BLOCK_SIZE;
+        if (ftruncate(fd, size))
+            return 0;
+    } else {
+        size = st.st_size;
+    }
+
+    size /= ASSOOFS_DEFAULT_BLOCK_SIZE;
+    return size < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED ? size : ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED;
+}
+
 int main(int argc, char *argv[])
 {
 
@@ -165,8 +680,11 @@ int main(int argc, char *argv[])
 * bienvenida, creamos lo siguiente
 ***************************************************************/
 
-    int fd;
+    int fd, opt;
     ssize_t ret;
+    const char *root_dir = NULL, *order_file = NULL;
+    int packed = 0;
+    uint64_t blocks, max_blocks = 0;
 
 /**************************************************************
 * Texto que va a contenter el archivo que vamos a situar al
@@ -205,10 +723,43 @@ int main(int argc, char *argv[])
 *    ./programa & DIRECTORIO
 *
 * Si no recibe esos dos parametros, el programa no funcionna
+*
+* Con -d <directorio> la imagen se rellena con el contenido
+* de ese directorio en lugar del fichero de bienvenida
+*
+* Con -b <bloques> el sistema ocupa solo los primeros bloques
+* del dispositivo; se puede hacer crecer despues con
+* assoofs-resize
+*
+* Con -p (junto a -d) la imagen es empaquetada y de solo
+* lectura, con los ficheros de la lista de -a <fichero> (una
+* ruta por linea, relativa al directorio) colocados primero
 ***************************************************************/
 
-    if (argc != 2) {
-        printf("Usage: mkassoofs <device>\n");
+    while ((opt = getopt(argc, argv, "d:b:pa:")) != -1) {
+        switch (opt) {
+        case 'd':
+            root_dir = optarg;
+            break;
+        case 'b':
+            max_blocks = strtoull(optarg, NULL, 0);
+            break;
+        case 'p':
+            packed = 1;
+            break;
+        case 'a':
+            order_file = optarg;
+            break;
+        default:
+            printf("Usage: mkassoofs [-d directory] [-b blocks] <device>\n"
+                   "       mkassoofs -p -d directory [-a access-list] <device>\n");
+            return -1;
+        }
+    }
+
+    if (optind != argc - 1 || (packed && (!root_dir || max_blocks)) || (order_file && !packed)) {
+        printf("Usage: mkassoofs [-d directory] [-b blocks] <device>\n"
+               "       mkassoofs -p -d directory [-a access-list] <device>\n");
         return -1;
     }
 
@@ -218,22 +769,43 @@ int main(int argc, char *argv[])
 * Si no lo consigue, nos salta un error
 ***************************************************************/
 
-    fd = open(argv[1], O_RDWR);
+    fd = open(argv[optind], O_RDWR);
     if (fd == -1) {
         perror("Error opening the device");
         return -1;
     }
 
+    if (packed) {
+        ret = write_packed_image(fd, root_dir, order_file) ? 1 : 0;
+        close(fd);
+        return ret;
+    }
+
+    blocks = device_blocks(fd);
+    if (max_blocks && max_blocks < blocks)
+        blocks = max_blocks;
+    if (blocks <= WELCOMEFILE_DATABLOCK_NUMBER) {
+        printf("The device is too small: assoofs needs at least %d blocks.\n", WELCOMEFILE_DATABLOCK_NUMBER + 1);
+        close(fd);
+        return 1;
+    }
+
 // Cuando ya tenemos todo lo de arriba va a ejecutar una serie
 //  de funciones. Si no consigue ejecutar alguno de los pasos
 //  lo intentará más veces.
 
+    if (root_dir) {
+        ret = write_tree_image(fd, root_dir, blocks) ? 1 : 0;
+        close(fd);
+        return ret;
+    }
+
     ret = 1;
     do {
-        if (write_superblock(fd))
+        if (write_superblock(fd, blocks))
             break;
 
-        if (write_root_inode(fd))
+        if (write_root_inode(fd, &welcome))
             break;
 
         if (write_welcome_inode(fd, &welcome))